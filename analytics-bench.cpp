@@ -0,0 +1,56 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include "tree_analytics.h"
+
+using namespace std;
+
+// Scaling benchmark for leafDepthStats. Builds one perfect tree of
+// 2^levels - 1 nodes (22 levels by default), with its nodes scattered in
+// memory as a tree that was built piecemeal would be, and times the
+// statistics with ThreadPools of 0, 1, 2, 4, ... workers up to the first
+// argument. The wall time should fall with the number of cores.
+
+int main(int argc, char *argv[])
+{
+    int maxThreads = (argc > 1) ? atoi(argv[1]) : 16;
+    int levels = (argc > 2) ? atoi(argv[2]) : 22;
+
+    size_t nodeCount = ((size_t)1 << levels) - 1;
+    vector<Node> nodes(nodeCount, Node(0));
+    vector<size_t> slot(nodeCount);
+    for(size_t i = 0; i < nodeCount; ++i) {
+        slot[i] = i;
+    }
+    shuffle(slot.begin(), slot.end(), mt19937(104));
+    for(size_t i = 0; 2 * i + 2 < nodeCount; ++i) {
+        nodes[slot[i]].left = &nodes[slot[2 * i + 1]];
+        nodes[slot[i]].right = &nodes[slot[2 * i + 2]];
+    }
+    Node* root = &nodes[slot[0]];
+
+    cout << setw(10) << "threads"
+         << setw(10) << "ms"
+         << setw(10) << "speedup" << endl;
+    double baseMs = 0;
+    for(int threads = 0; threads <= maxThreads; threads = threads ? 2 * threads : 1) {
+        ThreadPool pool(threads);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        LeafDepthStats stats = leafDepthStats(root, &pool);
+        double ms = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - start).count() / 1000.0;
+        if(threads == 0)
+            baseMs = ms;
+        if(stats.leaves != (nodeCount + 1) / 2 || stats.minDepth != stats.maxDepth)
+            cout << "leaf depth mismatch" << endl;
+        cout << setw(10) << threads
+             << fixed << setprecision(1)
+             << setw(10) << ms
+             << setw(10) << baseMs / ms << endl;
+    }
+    return 0;
+}
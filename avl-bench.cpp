@@ -0,0 +1,385 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <cstdio>
+#include "avlbst.h"
+#include "interval_tree.h"
+#include "btree.h"
+
+using namespace std;
+
+// Scaling benchmark for AVLTree::insert / AVLTree::remove.
+// For each tree size n, loads n random keys and then removes them all,
+// reporting the average cost per operation. With O(log n) rebalancing the
+// last column (ns per op divided by log2 n) should stay roughly flat.
+// A second table compares sorted batches of BATCH keys applied with
+// insert_batch/remove_batch against the same keys applied one at a time.
+// A third table compares random lookups in a tree, one at a time and
+// batched with find_many, in its freeze() and in a BTreeMap holding the
+// same keys. Its "generic" column makes the same lookups through the
+// branching descent that keys other than a SmallKey get, reached here by
+// searching with long keys under TransparentLess. The fourth table compares rebuilding a
+// tree by inserting its keys again with saving it and loading the image.
+// The fifth table answers stabbing queries on an IntervalTree, against a
+// scan over every interval. The last one follows a random walk through the
+// keys, finding and inserting each one from the root and again with the
+// previous result as the hint. The hinted calls form a chain, each waiting
+// on the one before, where the plain ones overlap; they pay off once the
+// levels saved cost more than that, as cache misses do in larger trees.
+// Its last column appends ascending keys to an unbalanced BinarySearchTree
+// with end() as the hint, which links each one without a search.
+
+static const size_t BATCH = 1024;
+static const char* IMAGE_PATH = "avl-bench.img";
+static const size_t STAB_QUERIES = 256;
+
+static double elapsedNs(chrono::steady_clock::time_point start)
+{
+    return (double)chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+    size_t maxSize = (argc > 1) ? strtoul(argv[1], nullptr, 10) : (1u << 20);
+    mt19937 rng(104);
+
+    cout << setw(10) << "n"
+         << setw(14) << "insert ns/op"
+         << setw(14) << "remove ns/op"
+         << setw(16) << "insert/log2(n)"
+         << setw(16) << "remove/log2(n)" << endl;
+
+    for(size_t n = 1024; n <= maxSize; n *= 4) {
+        vector<int> keys(n);
+        for(size_t i = 0; i < n; ++i) {
+            keys[i] = (int)i;
+        }
+        shuffle(keys.begin(), keys.end(), rng);
+
+        AVLTree<int, int> tree;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            tree.insert(make_pair(keys[i], (int)i));
+        }
+        double insertNs = elapsedNs(start) / n;
+
+        shuffle(keys.begin(), keys.end(), rng);
+        start = chrono::steady_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            tree.remove(keys[i]);
+        }
+        double removeNs = elapsedNs(start) / n;
+
+        double lg = log2((double)n);
+        cout << setw(10) << n << fixed << setprecision(1)
+             << setw(14) << insertNs
+             << setw(14) << removeNs
+             << setw(16) << insertNs / lg
+             << setw(16) << removeNs / lg << endl;
+    }
+
+    cout << endl
+         << setw(10) << "n"
+         << setw(14) << "insert ns/op"
+         << setw(14) << "batch ns/op"
+         << setw(14) << "remove ns/op"
+         << setw(14) << "batch ns/op" << endl;
+
+    for(size_t n = 1024; n <= maxSize; n *= 4) {
+        // The trees hold the even keys; each batch adds and then removes
+        // a sorted run of random odd keys.
+        vector<pair<int, int> > base(n);
+        for(size_t i = 0; i < n; ++i) {
+            base[i] = make_pair(2 * (int)i, (int)i);
+        }
+        size_t batches = max((size_t)1, n / BATCH);
+        vector<vector<pair<int, int> > > items(batches);
+        vector<vector<int> > keys(batches);
+        for(size_t b = 0; b < batches; ++b) {
+            for(size_t i = 0; i < BATCH; ++i) {
+                keys[b].push_back(2 * (int)(rng() % n) + 1);
+            }
+            sort(keys[b].begin(), keys[b].end());
+            keys[b].erase(unique(keys[b].begin(), keys[b].end()), keys[b].end());
+            for(size_t i = 0; i < keys[b].size(); ++i) {
+                items[b].push_back(make_pair(keys[b][i], (int)i));
+            }
+        }
+        size_t ops = 0;
+        for(size_t b = 0; b < batches; ++b) {
+            ops += keys[b].size();
+        }
+
+        AVLTree<int, int> single(base.begin(), base.end());
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for(size_t b = 0; b < batches; ++b) {
+            for(size_t i = 0; i < items[b].size(); ++i) {
+                single.insert(items[b][i]);
+            }
+        }
+        double insertNs = elapsedNs(start) / ops;
+        start = chrono::steady_clock::now();
+        for(size_t b = 0; b < batches; ++b) {
+            for(size_t i = 0; i < keys[b].size(); ++i) {
+                single.remove(keys[b][i]);
+            }
+        }
+        double removeNs = elapsedNs(start) / ops;
+
+        AVLTree<int, int> batched(base.begin(), base.end());
+        start = chrono::steady_clock::now();
+        for(size_t b = 0; b < batches; ++b) {
+            batched.insert_batch(items[b].begin(), items[b].end());
+        }
+        double batchInsertNs = elapsedNs(start) / ops;
+        start = chrono::steady_clock::now();
+        for(size_t b = 0; b < batches; ++b) {
+            batched.remove_batch(keys[b].begin(), keys[b].end());
+        }
+        double batchRemoveNs = elapsedNs(start) / ops;
+
+        cout << setw(10) << n << fixed << setprecision(1)
+             << setw(14) << insertNs
+             << setw(14) << batchInsertNs
+             << setw(14) << removeNs
+             << setw(14) << batchRemoveNs << endl;
+    }
+
+    cout << endl
+         << setw(10) << "n"
+         << setw(14) << "find ns/op"
+         << setw(14) << "generic ns/op"
+         << setw(14) << "many ns/op"
+         << setw(14) << "frozen ns/op"
+         << setw(14) << "btree ns/op" << endl;
+
+    for(size_t n = 1024; n <= maxSize; n *= 4) {
+        vector<int> keys(n);
+        for(size_t i = 0; i < n; ++i) {
+            keys[i] = 2 * (int)i;
+        }
+        shuffle(keys.begin(), keys.end(), rng);
+        // Both trees are built the same way, so their nodes lie alike in memory.
+        AVLTree<int, int> tree;
+        AVLTree<int, int, TransparentLess> generic;
+        for(size_t i = 0; i < n; ++i) {
+            tree.insert(make_pair(keys[i], (int)i));
+            generic.insert(make_pair(keys[i], (int)i));
+        }
+        FrozenTree<int, int> frozen = tree.freeze();
+        BTreeMap<int, int> btree;
+        for(size_t i = 0; i < n; ++i) {
+            btree.insert(make_pair(keys[i], (int)i));
+        }
+        // Half of the lookups miss.
+        vector<int> probes(n);
+        for(size_t i = 0; i < n; ++i) {
+            probes[i] = (int)(rng() % (2 * n));
+        }
+
+        // The hit counts keep the lookups from being optimized away.
+        long treeHits = 0;
+        long frozenHits = 0;
+        long btreeHits = 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            treeHits += (tree.find(probes[i]) != tree.end());
+        }
+        double findNs = elapsedNs(start) / n;
+        vector<long> wideProbes(probes.begin(), probes.end());
+        long genericHits = 0;
+        start = chrono::steady_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            genericHits += (generic.find(wideProbes[i]) != generic.end());
+        }
+        double genericNs = elapsedNs(start) / n;
+        long manyHits = 0;
+        vector<AVLTree<int, int>::const_iterator> found;
+        found.reserve(n);
+        start = chrono::steady_clock::now();
+        static_cast<const AVLTree<int, int>&>(tree).find_many(probes, found);
+        for(size_t i = 0; i < n; ++i) {
+            manyHits += (found[i] != tree.end());
+        }
+        double manyNs = elapsedNs(start) / n;
+        start = chrono::steady_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            frozenHits += (frozen.find(probes[i]) != frozen.end());
+        }
+        double frozenNs = elapsedNs(start) / n;
+        start = chrono::steady_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            btreeHits += (btree.find(probes[i]) != btree.end());
+        }
+        double btreeNs = elapsedNs(start) / n;
+        if(genericHits != treeHits || manyHits != treeHits || frozenHits != treeHits || btreeHits != treeHits)
+            cout << "lookup mismatch" << endl;
+
+        cout << setw(10) << n << fixed << setprecision(1)
+             << setw(14) << findNs
+             << setw(14) << genericNs
+             << setw(14) << manyNs
+             << setw(14) << frozenNs
+             << setw(14) << btreeNs << endl;
+    }
+
+    cout << endl
+         << setw(10) << "n"
+         << setw(14) << "insert ns/op"
+         << setw(14) << "save ns/op"
+         << setw(14) << "load ns/op" << endl;
+
+    for(size_t n = 1024; n <= maxSize; n *= 4) {
+        vector<int> keys(n);
+        for(size_t i = 0; i < n; ++i) {
+            keys[i] = (int)i;
+        }
+        shuffle(keys.begin(), keys.end(), rng);
+
+        AVLTree<int, int> tree;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            tree.insert(make_pair(keys[i], (int)i));
+        }
+        double insertNs = elapsedNs(start) / n;
+        start = chrono::steady_clock::now();
+        tree.save(IMAGE_PATH);
+        double saveNs = elapsedNs(start) / n;
+        AVLTree<int, int> loaded;
+        start = chrono::steady_clock::now();
+        loaded.load(IMAGE_PATH);
+        double loadNs = elapsedNs(start) / n;
+        if(loaded.size() != tree.size())
+            cout << "load mismatch" << endl;
+
+        cout << setw(10) << n << fixed << setprecision(1)
+             << setw(14) << insertNs
+             << setw(14) << saveNs
+             << setw(14) << loadNs << endl;
+    }
+    remove(IMAGE_PATH);
+
+    cout << endl
+         << setw(10) << "n"
+         << setw(14) << "stab ns/op"
+         << setw(14) << "scan ns/op" << endl;
+
+    for(size_t n = 1024; n <= maxSize; n *= 4) {
+        // Starts 16 apart and lengths up to 64, so a point hits about two.
+        vector<int64_t> starts(n);
+        for(size_t i = 0; i < n; ++i) {
+            starts[i] = 16 * (int64_t)i;
+        }
+        shuffle(starts.begin(), starts.end(), rng);
+        IntervalTree<int64_t, int64_t, IntervalEndValue> intervals;
+        for(size_t i = 0; i < n; ++i) {
+            intervals.insert(make_pair(starts[i], starts[i] + (int64_t)(rng() % 64)));
+        }
+        vector<int64_t> points(STAB_QUERIES);
+        for(size_t i = 0; i < STAB_QUERIES; ++i) {
+            points[i] = (int64_t)(rng() % (16 * n));
+        }
+
+        long stabHits = 0;
+        long scanHits = 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for(size_t i = 0; i < STAB_QUERIES; ++i) {
+            intervals.for_each_containing(points[i], [&](const pair<const int64_t, int64_t>&) { ++stabHits; });
+        }
+        double stabNs = elapsedNs(start) / STAB_QUERIES;
+        start = chrono::steady_clock::now();
+        for(size_t i = 0; i < STAB_QUERIES; ++i) {
+            for(IntervalTree<int64_t, int64_t, IntervalEndValue>::const_iterator it = intervals.begin();
+                it != intervals.end(); ++it) {
+                scanHits += (it->first <= points[i] && points[i] < it->second);
+            }
+        }
+        double scanNs = elapsedNs(start) / STAB_QUERIES;
+        if(stabHits != scanHits)
+            cout << "stab mismatch" << endl;
+
+        cout << setw(10) << n << fixed << setprecision(1)
+             << setw(14) << stabNs
+             << setw(14) << scanNs << endl;
+    }
+
+    cout << endl
+         << setw(10) << "n"
+         << setw(14) << "find ns/op"
+         << setw(14) << "hinted ns/op"
+         << setw(14) << "insert ns/op"
+         << setw(14) << "hinted ns/op"
+         << setw(14) << "append ns/op" << endl;
+
+    for(size_t n = 1024; n <= maxSize; n *= 4) {
+        // The tree holds the even keys; the walk moves up to 16 of them
+        // either way at each step, and the inserts add the odd key after.
+        AVLTree<int, int> tree;
+        for(size_t i = 0; i < n; ++i) {
+            tree.insert(make_pair(2 * (int)i, (int)i));
+        }
+        vector<int> walk(n);
+        long position = (long)(n / 2);
+        for(size_t i = 0; i < n; ++i) {
+            position += (long)(rng() % 33) - 16;
+            position = min(max(position, 0L), (long)n - 1);
+            walk[i] = 2 * (int)position;
+        }
+
+        long plainHits = 0;
+        long hintedHits = 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            plainHits += tree.find(walk[i])->second;
+        }
+        double findNs = elapsedNs(start) / n;
+        AVLTree<int, int>::iterator hint = tree.end();
+        start = chrono::steady_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            hint = tree.find(hint, walk[i]);
+            hintedHits += hint->second;
+        }
+        double hintedFindNs = elapsedNs(start) / n;
+        if(plainHits != hintedHits)
+            cout << "hinted find mismatch" << endl;
+
+        AVLTree<int, int> plain(tree);
+        start = chrono::steady_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            plain.insert(make_pair(walk[i] + 1, (int)i));
+        }
+        double insertNs = elapsedNs(start) / n;
+        AVLTree<int, int> hinted(tree);
+        hint = hinted.end();
+        start = chrono::steady_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            hint = hinted.insert(hint, make_pair(walk[i] + 1, (int)i));
+        }
+        double hintedInsertNs = elapsedNs(start) / n;
+        if(plain.size() != hinted.size())
+            cout << "hinted insert mismatch" << endl;
+
+        BinarySearchTree<int, int> appended;
+        start = chrono::steady_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            appended.insert(appended.end(), make_pair((int)i, (int)i));
+        }
+        double appendNs = elapsedNs(start) / n;
+        if(appended.size() != n)
+            cout << "append mismatch" << endl;
+
+        cout << setw(10) << n << fixed << setprecision(1)
+             << setw(14) << findNs
+             << setw(14) << hintedFindNs
+             << setw(14) << insertNs
+             << setw(14) << hintedInsertNs
+             << setw(14) << appendNs << endl;
+    }
+    return 0;
+}
@@ -6,157 +6,664 @@
 #include <cstdlib>
 #include <cstdint>
 #include <algorithm>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <vector>
 #include "bst.h"
+#include "thread_pool.h"
 
 struct KeyError { };
 
+/**
+ * Augmentation policies for AVLTree. A policy adds a summary of each
+ * node's subtree to AVLNode (through its NodeData base class) and provides
+ * a static update(node) that recomputes a node's summary from its own item
+ * and its children's summaries. The tree calls update whenever a subtree
+ * changes: on the path to the root after an insert or remove, or after a
+ * value is replaced by insert or insert_or_assign, on both nodes of every
+ * rotation, and on each node of a bulk load. Values changed through
+ * operator[] or an iterator are not seen.
+ */
+
+/**
+ * The default policy: no summary, and no cost.
+ */
+struct NoAugment
+{
+    static const bool enabled = false;
+
+    struct NodeData { };
+
+    template<typename NodeType>
+    static void update(NodeType*) { }
+
+    template<typename NodeType>
+    static bool isConsistent(const NodeType*) { return true; }
+};
+
+/**
+ * Order-statistic mode: each node counts the nodes in its subtree,
+ * which gives AVLTree O(log n) rank, select and percentile queries.
+ */
+struct OrderStatistic
+{
+    static const bool enabled = true;
+
+    struct NodeData
+    {
+        NodeData() : subtreeSize(1) { }
+        size_t subtreeSize;
+    };
+
+    template<typename NodeType>
+    static size_t sizeOf(const NodeType* node)
+    {
+        return (node == nullptr) ? 0 : node->subtreeSize;
+    }
+
+    template<typename NodeType>
+    static void update(NodeType* node)
+    {
+        node->subtreeSize = 1 + sizeOf(node->getLeft()) + sizeOf(node->getRight());
+    }
+
+    // Whether node's summary is what update would compute, for validate().
+    template<typename NodeType>
+    static bool isConsistent(const NodeType* node)
+    {
+        return node->subtreeSize == 1 + sizeOf(node->getLeft()) + sizeOf(node->getRight());
+    }
+};
+
+/**
+ * Aggregate mode: each node keeps Monoid's summary of its subtree, which
+ * gives AVLTree O(log n) aggregate(lo, hi) queries over key ranges. A
+ * Monoid provides
+ *
+ *   typedef ... Result;
+ *   static Result identity();
+ *   static Result of(const Key& key, const Value& value);
+ *   static Result combine(const Result& left, const Result& right);
+ *
+ * where combine is associative with identity as its neutral element; it
+ * need not be commutative, as summaries are always combined in key
+ * order. Result must support == for validate().
+ */
+template<typename Monoid>
+struct SubtreeAggregate
+{
+    static const bool enabled = true;
+    typedef typename Monoid::Result Result;
+
+    struct NodeData
+    {
+        NodeData() : aggregate(Monoid::identity()) { }
+        Result aggregate;
+    };
+
+    static Result identity()
+    {
+        return Monoid::identity();
+    }
+
+    static Result combine(const Result& left, const Result& right)
+    {
+        return Monoid::combine(left, right);
+    }
+
+    // The summary of node's own item, and of its whole subtree.
+    template<typename NodeType>
+    static Result itemOf(const NodeType* node)
+    {
+        return Monoid::of(node->getKey(), node->getValue());
+    }
+
+    template<typename NodeType>
+    static Result summaryOf(const NodeType* node)
+    {
+        return (node == nullptr) ? Monoid::identity() : node->aggregate;
+    }
+
+    template<typename NodeType>
+    static Result compute(const NodeType* node)
+    {
+        return combine(combine(summaryOf(node->getLeft()), itemOf(node)), summaryOf(node->getRight()));
+    }
+
+    template<typename NodeType>
+    static void update(NodeType* node)
+    {
+        node->aggregate = compute(node);
+    }
+
+    template<typename NodeType>
+    static bool isConsistent(const NodeType* node)
+    {
+        return compute(node) == node->aggregate;
+    }
+};
+
+template<typename Augment>
+struct IsSubtreeAggregate : std::false_type { };
+template<typename Monoid>
+struct IsSubtreeAggregate<SubtreeAggregate<Monoid> > : std::true_type { };
+
+/**
+ * Monoids over the values, for SubtreeAggregate: their sum, and their
+ * smallest and largest (numeric_limits' max and lowest for none).
+ */
+template<typename T>
+struct SumOfValues
+{
+    typedef T Result;
+    static T identity() { return T(); }
+    template<typename Key>
+    static T of(const Key&, const T& value) { return value; }
+    static T combine(const T& left, const T& right) { return left + right; }
+};
+
+template<typename T>
+struct MinOfValues
+{
+    typedef T Result;
+    static T identity() { return std::numeric_limits<T>::max(); }
+    template<typename Key>
+    static T of(const Key&, const T& value) { return value; }
+    static T combine(const T& left, const T& right) { return std::min(left, right); }
+};
+
+template<typename T>
+struct MaxOfValues
+{
+    typedef T Result;
+    static T identity() { return std::numeric_limits<T>::lowest(); }
+    template<typename Key>
+    static T of(const Key&, const T& value) { return value; }
+    static T combine(const T& left, const T& right) { return std::max(left, right); }
+};
+
 /**
  * A special kind of node for an AVL tree. It extends the BST Node by adding
- * a balance factor (balance_ = height(left subtree) – height(right subtree)).
+ * a balance factor (balance = height(left subtree) – height(right subtree)).
+ * The balance factor is always in [-1, 1] between operations, so it is
+ * stored as balance + 1 in the tag bits of the parent pointer and an
+ * AVLNode without augmentation is exactly as large as a plain Node.
  */
-template <typename Key, typename Value>
-class AVLNode : public Node<Key, Value>
+template <typename Key, typename Value, typename Augment = NoAugment>
+class AVLNode : public Node<Key, Value>, public Augment::NodeData
 {
 public:
-    AVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
-    virtual ~AVLNode();
+    AVLNode(const Key& key, const Value& value, AVLNode<Key, Value, Augment>* parent);
+    AVLNode(Key&& key, Value&& value, AVLNode<Key, Value, Augment>* parent);
+    ~AVLNode();
 
     int8_t getBalance() const;
     void setBalance(int8_t balance);
     void updateBalance(int8_t diff);
 
-    // Overridden getters that return AVLNode pointers.
-    virtual AVLNode<Key, Value>* getParent() const override;
-    virtual AVLNode<Key, Value>* getLeft() const override;
-    virtual AVLNode<Key, Value>* getRight() const override;
+    // Bulk-load hook: sets the balance from the subtree heights
+    // and computes the augmentation from the finished children.
+    void setSubtreeHeights(int leftHeight, int rightHeight);
 
-protected:
-    int8_t balance_; // balance factor = height(left) - height(right)
+    // Copy hook: takes over other's balance and augmentation.
+    void copyState(const AVLNode<Key, Value, Augment>& other);
+
+    // Getters that return AVLNode pointers; they hide the base versions.
+    AVLNode<Key, Value, Augment>* getParent() const;
+    AVLNode<Key, Value, Augment>* getLeft() const;
+    AVLNode<Key, Value, Augment>* getRight() const;
 };
 
 /* --- AVLNode implementations --- */
 
-template<class Key, class Value>
-AVLNode<Key, Value>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent)
-    : Node<Key, Value>(key, value, parent), balance_(0)
-{ }
+template<class Key, class Value, class Augment>
+AVLNode<Key, Value, Augment>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Value, Augment>* parent)
+    : Node<Key, Value>(key, value, parent)
+{
+    setBalance(0);
+}
+
+template<class Key, class Value, class Augment>
+AVLNode<Key, Value, Augment>::AVLNode(Key&& key, Value&& value, AVLNode<Key, Value, Augment>* parent)
+    : Node<Key, Value>(std::move(key), std::move(value), parent)
+{
+    setBalance(0);
+}
 
-template<class Key, class Value>
-AVLNode<Key, Value>::~AVLNode() { }
+template<class Key, class Value, class Augment>
+AVLNode<Key, Value, Augment>::~AVLNode() { }
 
-template<class Key, class Value>
-int8_t AVLNode<Key, Value>::getBalance() const
+template<class Key, class Value, class Augment>
+int8_t AVLNode<Key, Value, Augment>::getBalance() const
 {
-    return balance_;
+    return (int8_t)((int)this->getTag() - 1);
 }
 
-template<class Key, class Value>
-void AVLNode<Key, Value>::setBalance(int8_t balance)
+template<class Key, class Value, class Augment>
+void AVLNode<Key, Value, Augment>::setBalance(int8_t balance)
 {
-    balance_ = balance;
+    this->setTag((unsigned)(balance + 1));
 }
 
-template<class Key, class Value>
-void AVLNode<Key, Value>::updateBalance(int8_t diff)
+template<class Key, class Value, class Augment>
+void AVLNode<Key, Value, Augment>::updateBalance(int8_t diff)
 {
-    balance_ += diff;
+    setBalance(getBalance() + diff);
 }
 
-template<class Key, class Value>
-AVLNode<Key, Value>* AVLNode<Key, Value>::getParent() const
+template<class Key, class Value, class Augment>
+void AVLNode<Key, Value, Augment>::setSubtreeHeights(int leftHeight, int rightHeight)
 {
-    return static_cast<AVLNode<Key, Value>*>(this->parent_);
+    setBalance((int8_t)(leftHeight - rightHeight));
+    Augment::update(this);
 }
 
-template<class Key, class Value>
-AVLNode<Key, Value>* AVLNode<Key, Value>::getLeft() const
+template<class Key, class Value, class Augment>
+void AVLNode<Key, Value, Augment>::copyState(const AVLNode<Key, Value, Augment>& other)
 {
-    return static_cast<AVLNode<Key, Value>*>(this->left_);
+    Node<Key, Value>::copyState(other);
+    static_cast<typename Augment::NodeData&>(*this) = static_cast<const typename Augment::NodeData&>(other);
 }
 
-template<class Key, class Value>
-AVLNode<Key, Value>* AVLNode<Key, Value>::getRight() const
+template<class Key, class Value, class Augment>
+AVLNode<Key, Value, Augment>* AVLNode<Key, Value, Augment>::getParent() const
 {
-    return static_cast<AVLNode<Key, Value>*>(this->right_);
+    return static_cast<AVLNode<Key, Value, Augment>*>(Node<Key, Value>::getParent());
+}
+
+template<class Key, class Value, class Augment>
+AVLNode<Key, Value, Augment>* AVLNode<Key, Value, Augment>::getLeft() const
+{
+    return static_cast<AVLNode<Key, Value, Augment>*>(this->left_);
+}
+
+template<class Key, class Value, class Augment>
+AVLNode<Key, Value, Augment>* AVLNode<Key, Value, Augment>::getRight() const
+{
+    return static_cast<AVLNode<Key, Value, Augment>*>(this->right_);
 }
 
 /**
  * computeHeight: A free helper that returns the height of an AVLNode subtree.
- * The height of a nullptr is 0.
+ * The height of a nullptr is 0. Counts levels breadth-first, so it needs
+ * no recursion.
  */
-template <class Key, class Value>
-int computeHeight(AVLNode<Key, Value>* node) {
+template <class Key, class Value, class Augment>
+int computeHeight(AVLNode<Key, Value, Augment>* node) {
     if(node == nullptr)
         return 0;
-    return std::max(computeHeight(node->getLeft()), computeHeight(node->getRight())) + 1;
+    std::vector<AVLNode<Key, Value, Augment>*> level(1, node);
+    std::vector<AVLNode<Key, Value, Augment>*> next;
+    int height = 0;
+    while(!level.empty()) {
+        ++height;
+        next.clear();
+        for(size_t i = 0; i < level.size(); ++i) {
+            if(level[i]->getLeft() != nullptr)
+                next.push_back(level[i]->getLeft());
+            if(level[i]->getRight() != nullptr)
+                next.push_back(level[i]->getRight());
+        }
+        level.swap(next);
+    }
+    return height;
 }
 
 /**
  * AVLTree extends BinarySearchTree with AVL rebalancing.
+ * Augment selects an optional per-subtree summary kept in every node
+ * (see NoAugment, OrderStatistic and SubtreeAggregate above).
  */
-template <class Key, class Value>
-class AVLTree : public BinarySearchTree<Key, Value>
+template <class Key, class Value, class Compare = std::less<Key>, class Alloc = NodePool, class Augment = NoAugment>
+class AVLTree : public BinarySearchTree<Key, Value, Compare, Alloc>
 {
 public:
+    typedef typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator iterator;
+
+    AVLTree();
+    explicit AVLTree(const Compare& comp);
+    template<typename InputIterator>
+    AVLTree(InputIterator first, InputIterator last);
+    AVLTree(const AVLTree& other);
+    AVLTree(AVLTree&& other);
+    virtual ~AVLTree();
+    AVLTree& operator=(const AVLTree& other);
+    AVLTree& operator=(AVLTree&& other);
+    AVLTree clone() const;
+    using BinarySearchTree<Key, Value, Compare, Alloc>::insert;
     virtual void insert (const std::pair<const Key, Value> &new_item) override;
     virtual void remove(const Key& key) override;
+
+    // Order-statistic queries, available with Augment = OrderStatistic.
+    size_t rank(const Key& key) const;
+    iterator select(size_t k) const;
+    iterator percentile(double p) const;
+
+    // The Monoid summary of the items with keys in [lo, hi), combined in
+    // key order, in O(log n). Available with Augment = SubtreeAggregate.
+    template<typename A = Augment>
+    typename A::Result aggregate(const Key& lo, const Key& hi) const;
+
+    // Join-based set operations. Each moves every node of other into this
+    // tree or destroys it, leaving other empty, in O(m log(n/m + 1)) work
+    // for sizes m <= n. With a pool, the two halves of every large enough
+    // subproblem run in parallel. On equal keys union_with keeps other's
+    // value and intersect keeps this tree's. Compare must not throw.
+    void union_with(AVLTree& other, ThreadPool* pool = nullptr);
+    void intersect(AVLTree& other, ThreadPool* pool = nullptr);
+    void difference(AVLTree& other, ThreadPool* pool = nullptr);
+
+    // O(log n) partitioning. split moves the keys less than key into the
+    // first tree and the rest into the second, leaving this tree empty.
+    // join appends right, whose keys must all be greater than this tree's,
+    // and leaves right empty; it throws std::invalid_argument otherwise.
+    std::pair<AVLTree, AVLTree> split(const Key& key);
+    void join(AVLTree& right);
+
+    // Batch updates. The batch is applied in key order (it is sorted first
+    // if it is not already), and each key's search starts from the previous
+    // key's position instead of the root. As with insert, later duplicates
+    // override earlier ones and existing values are replaced.
+    template<typename InputIterator>
+    void insert_batch(InputIterator first, InputIterator last);
+    template<typename InputIterator>
+    void remove_batch(InputIterator first, InputIterator last);
 protected:
     // Our custom nodeSwap override.
-    virtual void nodeSwap(AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2);
+    virtual void nodeSwap(AVLNode<Key, Value, Augment>* n1, AVLNode<Key, Value, Augment>* n2);
 
     // Rotation helpers.
-    void rotateLeft(AVLNode<Key, Value>* n);
-    void rotateRight(AVLNode<Key, Value>* n);
+    void rotateLeft(AVLNode<Key, Value, Augment>* n);
+    void rotateRight(AVLNode<Key, Value, Augment>* n);
 
-    // Recalculates and sets the balance factor for a node.
-    void updateBalance(AVLNode<Key, Value>* node);
+    // Rebalances upward after child grew by one level in the subtree of parent.
+    // Returns true if the growth reached the top, i.e. the tree grew.
+    bool insertFix(AVLNode<Key, Value, Augment>* parent, AVLNode<Key, Value, Augment>* child);
 
-    // Rebalances upward from the given node.
-    void rebalance(AVLNode<Key, Value>* node);
+    // Rebalances upward after node's balance changed by diff because one of
+    // its subtrees shrank by one level.
+    void removeFix(AVLNode<Key, Value, Augment>* node, int8_t diff);
+
+    // Unlinks and destroys node, then rebalances.
+    void removeNode(AVLNode<Key, Value, Augment>* node);
+
+    // Whether a sorted batch of count keys from low to high is dense enough
+    // in the tree for finger searches to pay off (see insert_batch).
+    bool isLocalBatch(const Key& low, const Key& high, size_t count) const;
+    // Finger searches win while there are at most this many tree nodes per
+    // batch key in the batch's range.
+    static const size_t FINGER_MAX_GAP = 8;
+
+    // Recomputes the augmentation of node and all of its ancestors.
+    void updateAugmentToRoot(AVLNode<Key, Value, Augment>* node);
+
+    // Nodes of an AVLTree are AVLNodes.
+    virtual Node<Key, Value>* linkNewNode(Node<Key, Value>* slot, bool isLeft, Key&& key, Value&& value) override;
+    virtual void valueChanged(Node<Key, Value>* node) override;
+    virtual void destroyNode(Node<Key, Value>* node) override;
+    virtual void assignSorted(const std::vector<std::pair<Key, Value> >& items) override;
+    virtual void copyNodes(const BinarySearchTree<Key, Value, Compare, Alloc>& other) override;
+    virtual void loadNodes(const char* records, size_t count) override;
+    virtual uint32_t imageKind() const override;
+    virtual unsigned checkNode(const Node<Key, Value>* node, int leftHeight, int rightHeight) const override;
+
+    // Split/join machinery. A Subtree is detached (its root has no parent)
+    // and carries its height, which the balance factors alone do not give.
+    struct Subtree
+    {
+        AVLNode<Key, Value, Augment>* root;
+        int height;
+    };
+    enum SetOperation { UNION, INTERSECTION, DIFFERENCE };
+    // What the set operations leave behind: detached subtrees to destroy,
+    // and the number of keys found in both trees.
+    struct MergeScratch
+    {
+        std::vector<Node<Key, Value>*> dropped;
+        size_t matches;
+    };
+    // Subproblems with a shorter input than this are not worth a task.
+    static const int PARALLEL_MIN_HEIGHT = 12;
+
+    static Subtree makeSubtree(AVLNode<Key, Value, Augment>* root);
+    static Subtree takeLeft(AVLNode<Key, Value, Augment>* node, int height);
+    static Subtree takeRight(AVLNode<Key, Value, Augment>* node, int height);
+    Subtree joinSubtrees(Subtree left, AVLNode<Key, Value, Augment>* mid, Subtree right);
+    Subtree joinSubtrees(Subtree left, Subtree right);
+    void splitSubtree(Subtree tree, const Key& key, Subtree& left, AVLNode<Key, Value, Augment>*& match, Subtree& right);
+    Subtree splitLast(Subtree tree, AVLNode<Key, Value, Augment>*& last);
+    // Number of nodes in left, whose tree held total nodes together with
+    // right: read off the root with OrderStatistic, otherwise counted.
+    static size_t sizeOfSplit(Subtree left, Subtree right, size_t total, std::true_type);
+    static size_t sizeOfSplit(Subtree left, Subtree right, size_t total, std::false_type);
+    void combine(AVLTree& other, SetOperation op, ThreadPool* pool);
+    Subtree combineSubtrees(SetOperation op, Subtree a, Subtree b, MergeScratch& scratch, ThreadPool* pool, int depth);
 
     // Helper to cast a Node pointer to an AVLNode pointer.
-    AVLNode<Key, Value>* asAVL(Node<Key, Value>* node) {
-        return static_cast<AVLNode<Key, Value>*>(node);
+    static AVLNode<Key, Value, Augment>* asAVL(Node<Key, Value>* node) {
+        return static_cast<AVLNode<Key, Value, Augment>*>(node);
     }
 };
 
 /* --- AVLTree implementations --- */
 
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+AVLTree<Key, Value, Compare, Alloc, Augment>::AVLTree()
+{ }
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+AVLTree<Key, Value, Compare, Alloc, Augment>::AVLTree(const Compare& comp)
+    : BinarySearchTree<Key, Value, Compare, Alloc>(comp)
+{ }
+
+/**
+ * Bulk-load constructor. The base constructor cannot reach the
+ * assignSorted override, so the range is loaded here.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+template<typename InputIterator>
+AVLTree<Key, Value, Compare, Alloc, Augment>::AVLTree(InputIterator first, InputIterator last)
+{
+    this->assign(first, last);
+}
+
+/**
+ * Copy constructor. Like the bulk-load constructor, the copy is made here
+ * because the base constructor cannot reach the copyNodes override.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+AVLTree<Key, Value, Compare, Alloc, Augment>::AVLTree(const AVLTree& other)
+    : BinarySearchTree<Key, Value, Compare, Alloc>(other.comp_)
+{
+    copyNodes(other);
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+AVLTree<Key, Value, Compare, Alloc, Augment>& AVLTree<Key, Value, Compare, Alloc, Augment>::operator=(const AVLTree& other)
+{
+    BinarySearchTree<Key, Value, Compare, Alloc>::operator=(other);
+    return *this;
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+AVLTree<Key, Value, Compare, Alloc, Augment> AVLTree<Key, Value, Compare, Alloc, Augment>::clone() const
+{
+    return AVLTree(*this);
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+AVLTree<Key, Value, Compare, Alloc, Augment>::AVLTree(AVLTree&& other)
+    : BinarySearchTree<Key, Value, Compare, Alloc>(std::move(other))
+{ }
+
+/**
+ * Move assignment. The base operator clears this tree first, which must
+ * go through destroyNode's override, so it is run on a fully built object.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+AVLTree<Key, Value, Compare, Alloc, Augment>& AVLTree<Key, Value, Compare, Alloc, Augment>::operator=(AVLTree&& other)
+{
+    BinarySearchTree<Key, Value, Compare, Alloc>::operator=(std::move(other));
+    return *this;
+}
+
+/**
+ * The base destructor can no longer reach destroyNode's override,
+ * so the nodes are destroyed here.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+AVLTree<Key, Value, Compare, Alloc, Augment>::~AVLTree()
+{
+    this->clear();
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::destroyNode(Node<Key, Value>* node)
+{
+    this->releaseNode(asAVL(node));
+}
+
+/**
+ * Links a new AVLNode into the slot found by findSlot and rebalances.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+Node<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Augment>::linkNewNode(Node<Key, Value>* slot, bool isLeft, Key&& key, Value&& value)
+{
+    AVLNode<Key, Value, Augment>* parent = asAVL(slot);
+    AVLNode<Key, Value, Augment>* newNode = this->createNode(std::move(key), std::move(value), parent);
+    ++this->size_;
+    if(parent == nullptr) {
+         this->root_ = newNode;
+         this->leftmost_ = newNode;
+         this->rightmost_ = newNode;
+         updateAugmentToRoot(newNode);
+         return newNode;
+    }
+    if(isLeft) {
+         parent->setLeft(newNode);
+         if(parent == this->leftmost_)
+              this->leftmost_ = newNode;
+    }
+    else {
+         parent->setRight(newNode);
+         if(parent == this->rightmost_)
+              this->rightmost_ = newNode;
+    }
+    updateAugmentToRoot(newNode);
+    insertFix(parent, newNode);
+    return newNode;
+}
+
+/**
+ * The summaries on the path up may read the value (see IntervalMaxEnd).
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::valueChanged(Node<Key, Value>* node)
+{
+    updateAugmentToRoot(asAVL(node));
+}
+
+/**
+ * A perfectly balanced build never leans by more than one level,
+ * so each AVLNode gets its balance straight from the subtree heights.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::assignSorted(const std::vector<std::pair<Key, Value> >& items)
+{
+    this->template buildSubtree<AVLNode<Key, Value, Augment> >(items, 0, items.size(), nullptr, true);
+}
+
+/**
+ * The copy keeps every balance factor and augmentation, so nothing is
+ * rebalanced or recomputed.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::copyNodes(const BinarySearchTree<Key, Value, Compare, Alloc>& other)
+{
+    this->template cloneNodes<AVLNode<Key, Value, Augment> >(other);
+}
+
+/**
+ * The image holds every balance factor, so only the augmentation, which
+ * is not saved, needs a pass over the loaded tree.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::loadNodes(const char* records, size_t count)
+{
+    this->template readNodes<AVLNode<Key, Value, Augment> >(records, count);
+    if(Augment::enabled) {
+         this->postOrderHeights(this->root_, [](Node<Key, Value>* node, int, int) {
+              Augment::update(static_cast<AVLNode<Key, Value, Augment>*>(node));
+              return true;
+         });
+    }
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+uint32_t AVLTree<Key, Value, Compare, Alloc, Augment>::imageKind() const
+{
+    return TREE_IMAGE_AVL;
+}
+
+/**
+ * A node's stored balance must match its subtree heights, its summary must
+ * match its children's, and the heights may differ by at most one.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+unsigned AVLTree<Key, Value, Compare, Alloc, Augment>::checkNode(const Node<Key, Value>* node, int leftHeight, int rightHeight) const
+{
+    const AVLNode<Key, Value, Augment>* avlNode = static_cast<const AVLNode<Key, Value, Augment>*>(node);
+    unsigned problems = 0;
+    if(avlNode->getBalance() != leftHeight - rightHeight || !Augment::isConsistent(avlNode))
+         problems |= TreeReport::STATE_ERROR;
+    if(std::abs(leftHeight - rightHeight) > 1)
+         problems |= TreeReport::BALANCE_ERROR;
+    return problems;
+}
+
 /**
  * AVLTree::insert
  *
  * Performs a standard BST insertion using AVLNode objects.
  * After insertion, walks upward from the parent and rebalances.
  */
-template<class Key, class Value>
-void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::insert (const std::pair<const Key, Value> &new_item)
 {
-    if(this->root_ == nullptr) {
-         this->root_ = new AVLNode<Key, Value>(new_item.first, new_item.second, nullptr);
+    Node<Key, Value>* slot = nullptr;
+    bool isLeft = false;
+    AVLNode<Key, Value, Augment>* existing = asAVL(this->findSlot(new_item.first, slot, isLeft));
+    if(existing != nullptr) {
+         // Key exists; update its value.
+         existing->setValue(new_item.second);
+         updateAugmentToRoot(existing);
          return;
     }
-    AVLNode<Key, Value>* current = asAVL(this->root_);
-    AVLNode<Key, Value>* parent = nullptr;
-    while(current != nullptr) {
-         parent = current;
-         if(new_item.first < current->getKey())
-              current = asAVL(current->getLeft());
-         else if(new_item.first > current->getKey())
-              current = asAVL(current->getRight());
-         else {
-              // Key exists; update its value.
-              current->setValue(new_item.second);
-              return;
-         }
+    AVLNode<Key, Value, Augment>* parent = asAVL(slot);
+    AVLNode<Key, Value, Augment>* newNode = this->createNode(new_item.first, new_item.second, parent);
+    ++this->size_;
+    if(parent == nullptr) {
+         this->root_ = newNode;
+         this->leftmost_ = newNode;
+         this->rightmost_ = newNode;
+         updateAugmentToRoot(newNode);
+         return;
     }
-    AVLNode<Key, Value>* newNode = new AVLNode<Key, Value>(new_item.first, new_item.second, parent);
-    if(new_item.first < parent->getKey())
+    if(isLeft) {
          parent->setLeft(newNode);
-    else
+         if(parent == this->leftmost_)
+              this->leftmost_ = newNode;
+    }
+    else {
          parent->setRight(newNode);
+         if(parent == this->rightmost_)
+              this->rightmost_ = newNode;
+    }
+    updateAugmentToRoot(newNode);
 
     // Rebalance upward from the parent.
-    rebalance(parent);
+    insertFix(parent, newNode);
 }
 
 /**
@@ -169,18 +676,23 @@ void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
  *
  * (Key change: We do not update the pointer to remove after swapping.)
  */
-template<class Key, class Value>
-void AVLTree<Key, Value>::remove(const Key& key)
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::remove(const Key& key)
 {
-    AVLNode<Key, Value>* nodeToRemove = asAVL(this->internalFind(key));
+    AVLNode<Key, Value, Augment>* nodeToRemove = asAVL(this->internalFind(key));
     if(nodeToRemove == nullptr)
          return; // key not found
+    removeNode(nodeToRemove);
+}
 
-    AVLNode<Key, Value>* parent = nodeToRemove->getParent();
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::removeNode(AVLNode<Key, Value, Augment>* nodeToRemove)
+{
+    AVLNode<Key, Value, Augment>* parent = nodeToRemove->getParent();
 
     if(nodeToRemove->getLeft() != nullptr && nodeToRemove->getRight() != nullptr) {
          // Find predecessor.
-         AVLNode<Key, Value>* pred = asAVL(BinarySearchTree<Key, Value>::predecessor(nodeToRemove));
+         AVLNode<Key, Value, Augment>* pred = asAVL(BinarySearchTree<Key, Value, Compare, Alloc>::predecessor(nodeToRemove));
          // Swap nodeToRemove and its predecessor.
          this->nodeSwap(nodeToRemove, pred);
          // Do not update nodeToRemove—remove the same node (which now holds the predecessor's key).
@@ -188,106 +700,77 @@ void AVLTree<Key, Value>::remove(const Key& key)
          parent = nodeToRemove->getParent();
     }
 
-    AVLNode<Key, Value>* child = (nodeToRemove->getLeft() != nullptr) ?
+    if(nodeToRemove == this->leftmost_)
+         this->leftmost_ = BinarySearchTree<Key, Value, Compare, Alloc>::successor(nodeToRemove);
+    if(nodeToRemove == this->rightmost_)
+         this->rightmost_ = BinarySearchTree<Key, Value, Compare, Alloc>::predecessor(nodeToRemove);
+    AVLNode<Key, Value, Augment>* child = (nodeToRemove->getLeft() != nullptr) ?
                                    asAVL(nodeToRemove->getLeft()) : asAVL(nodeToRemove->getRight());
+    // Removing from the left subtree tips the parent to the right, and vice versa.
+    int8_t diff = 0;
     if(child != nullptr)
          child->setParent(parent);
     if(parent == nullptr)
          this->root_ = child;
     else {
-         if(parent->getLeft() == nodeToRemove)
+         if(parent->getLeft() == nodeToRemove) {
               parent->setLeft(child);
-         else
+              diff = -1;
+         }
+         else {
               parent->setRight(child);
+              diff = 1;
+         }
     }
-    delete nodeToRemove;
+    this->releaseNode(nodeToRemove);
+    --this->size_;
 
-    if(parent != nullptr)
-         rebalance(parent);
+    if(parent != nullptr) {
+         updateAugmentToRoot(parent);
+         removeFix(parent, diff);
+    }
 }
 
 /**
  * AVLTree::nodeSwap
  *
- * Swaps two AVLNodes. If one is the parent of the other (adjacent swap),
- * handles that case by rearranging pointers so that the node with the predecessor's
- * key moves into the position of the node to remove.
- * Otherwise, delegates to the base class nodeSwap.
- */
-template<class Key, class Value>
-void AVLTree<Key, Value>::nodeSwap(AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2)
-{
-    // Check if n1 is parent of n2.
-    if(n1->getLeft() == n2) {
-         AVLNode<Key, Value>* P = n1->getParent();
-         AVLNode<Key, Value>* B = n2->getRight();  // n2's right subtree
-         n2->setParent(P);
-         if(P != nullptr) {
-             if(P->getLeft() == n1)
-                  P->setLeft(n2);
-             else
-                  P->setRight(n2);
-         } else {
-             this->root_ = n2;
-         }
-         n2->setRight(n1);
-         n1->setParent(n2);
-         n1->setLeft(B);
-         if(B != nullptr)
-              B->setParent(n1);
-         int8_t tempB = n1->getBalance();
-         n1->setBalance(n2->getBalance());
-         n2->setBalance(tempB);
-         return;
-    }
-    else if(n1->getRight() == n2) {
-         AVLNode<Key, Value>* P = n1->getParent();
-         AVLNode<Key, Value>* B = n2->getLeft();  // n2's left subtree
-         n2->setParent(P);
-         if(P != nullptr) {
-             if(P->getLeft() == n1)
-                  P->setLeft(n2);
-             else
-                  P->setRight(n2);
-         } else {
-             this->root_ = n2;
-         }
-         n2->setLeft(n1);
-         n1->setParent(n2);
-         n1->setRight(B);
-         if(B != nullptr)
-              B->setParent(n1);
-         int8_t tempB = n1->getBalance();
-         n1->setBalance(n2->getBalance());
-         n2->setBalance(tempB);
-         return;
-    }
-    else {
-         // Non-adjacent: delegate to base class swap.
-         BinarySearchTree<Key, Value>::nodeSwap(n1, n2);
-         int8_t tempB = n1->getBalance();
-         n1->setBalance(n2->getBalance());
-         n2->setBalance(tempB);
-         return;
-    }
+ * Swaps the positions of two AVLNodes and their balance factors and
+ * augmentation, so each position keeps the values that describe its subtrees. The base
+ * class swap already handles the adjacent case where one node is the
+ * parent of the other; keeping the shape intact there matters because
+ * removeFix relies on knowing which side of the parent actually shrank.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::nodeSwap(AVLNode<Key, Value, Augment>* n1, AVLNode<Key, Value, Augment>* n2)
+{
+    BinarySearchTree<Key, Value, Compare, Alloc>::nodeSwap(n1, n2);
+    int8_t tempB = n1->getBalance();
+    n1->setBalance(n2->getBalance());
+    n2->setBalance(tempB);
+    std::swap(static_cast<typename Augment::NodeData&>(*n1), static_cast<typename Augment::NodeData&>(*n2));
 }
 
 /**
  * rotateLeft
  *
  * Performs a left rotation on node n.
- * After rotation, updates balance factors.
+ * Only the links and the augmentation of the two rotated nodes change;
+ * callers fix up the balance factors, since the correct values depend on
+ * which rebalancing case triggered the rotation.
  */
-template<class Key, class Value>
-void AVLTree<Key, Value>::rotateLeft(AVLNode<Key, Value>* n)
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::rotateLeft(AVLNode<Key, Value, Augment>* n)
 {
-    AVLNode<Key, Value>* r = n->getRight();
+    AVLNode<Key, Value, Augment>* r = n->getRight();
     n->setRight(r->getLeft());
     if(r->getLeft() != nullptr)
          r->getLeft()->setParent(n);
     r->setParent(n->getParent());
-    if(n->getParent() == nullptr)
-         this->root_ = r;
+    if(n->getParent() == nullptr) {
+         // n tops the tree, or a detached subtree during a join.
+         if(this->root_ == n)
+              this->root_ = r;
+    }
     else if(n == n->getParent()->getLeft())
          n->getParent()->setLeft(r);
     else
@@ -295,26 +778,30 @@ void AVLTree<Key, Value>::rotateLeft(AVLNode<Key, Value>* n)
     r->setLeft(n);
     n->setParent(r);
 
-    updateBalance(n);
-    updateBalance(r);
+    Augment::update(n);
+    Augment::update(r);
 }
 
 /**
  * rotateRight
  *
  * Performs a right rotation on node n.
- * After rotation, updates balance factors.
+ * Only the links and the augmentation of the two rotated nodes change;
+ * callers fix up the balance factors.
  */
-template<class Key, class Value>
-void AVLTree<Key, Value>::rotateRight(AVLNode<Key, Value>* n)
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::rotateRight(AVLNode<Key, Value, Augment>* n)
 {
-    AVLNode<Key, Value>* l = n->getLeft();
+    AVLNode<Key, Value, Augment>* l = n->getLeft();
     n->setLeft(l->getRight());
     if(l->getRight() != nullptr)
          l->getRight()->setParent(n);
     l->setParent(n->getParent());
-    if(n->getParent() == nullptr)
-         this->root_ = l;
+    if(n->getParent() == nullptr) {
+         // n tops the tree, or a detached subtree during a join.
+         if(this->root_ == n)
+              this->root_ = l;
+    }
     else if(n == n->getParent()->getRight())
          n->getParent()->setRight(l);
     else
@@ -322,59 +809,839 @@ void AVLTree<Key, Value>::rotateRight(AVLNode<Key, Value>* n)
     l->setRight(n);
     n->setParent(l);
 
-    updateBalance(n);
-    updateBalance(l);
+    Augment::update(n);
+    Augment::update(l);
 }
 
 /**
- * updateBalance
+ * updateAugmentToRoot
  *
- * Recalculates the balance factor for node as:
- *   height(left subtree) - height(right subtree)
+ * Recomputes the augmentation along the path from node to the root, after
+ * node's subtree gained or lost a node. Compiles to nothing for NoAugment.
  */
-template<class Key, class Value>
-void AVLTree<Key, Value>::updateBalance(AVLNode<Key, Value>* node)
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::updateAugmentToRoot(AVLNode<Key, Value, Augment>* node)
 {
-    if(node == nullptr) return;
-    int leftHeight = (node->getLeft() == nullptr) ? 0 : computeHeight(asAVL(node->getLeft()));
-    int rightHeight = (node->getRight() == nullptr) ? 0 : computeHeight(asAVL(node->getRight()));
-    node->setBalance(leftHeight - rightHeight);
+    if(!Augment::enabled)
+         return;
+    while(node != nullptr) {
+         Augment::update(node);
+         node = node->getParent();
+    }
 }
 
 /**
- * rebalance
+ * rank
  *
- * Walks upward from node, updating balance factors and performing rotations as needed.
- * Uses computeHeight to determine subtree heights.
+ * Returns the number of keys less than key, in O(log n).
  */
-template<class Key, class Value>
-void AVLTree<Key, Value>::rebalance(AVLNode<Key, Value>* node)
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+size_t AVLTree<Key, Value, Compare, Alloc, Augment>::rank(const Key& key) const
 {
-    while(node != nullptr) {
-         updateBalance(node);
-         int balance = node->getBalance();
-         if(balance > 1) { // left heavy
-              AVLNode<Key, Value>* leftChild = node->getLeft();
-              if(leftChild != nullptr && computeHeight(asAVL(leftChild->getLeft())) < computeHeight(asAVL(leftChild->getRight()))) {
+    static_assert(std::is_same<Augment, OrderStatistic>::value, "rank() needs AVLTree<..., OrderStatistic>");
+    size_t result = 0;
+    AVLNode<Key, Value, Augment>* current = asAVL(this->root_);
+    while(current != nullptr) {
+         if(this->comp_(current->getKey(), key)) {
+              result += OrderStatistic::sizeOf(current->getLeft()) + 1;
+              current = current->getRight();
+         }
+         else
+              current = current->getLeft();
+    }
+    return result;
+}
+
+/**
+ * select
+ *
+ * Returns an iterator to the k-th smallest key (counting from 0),
+ * or end() if k >= size(), in O(log n).
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+typename AVLTree<Key, Value, Compare, Alloc, Augment>::iterator AVLTree<Key, Value, Compare, Alloc, Augment>::select(size_t k) const
+{
+    static_assert(std::is_same<Augment, OrderStatistic>::value, "select() needs AVLTree<..., OrderStatistic>");
+    AVLNode<Key, Value, Augment>* current = asAVL(this->root_);
+    while(current != nullptr) {
+         size_t leftSize = OrderStatistic::sizeOf(current->getLeft());
+         if(k < leftSize)
+              current = current->getLeft();
+         else if(k == leftSize)
+              break;
+         else {
+              k -= leftSize + 1;
+              current = current->getRight();
+         }
+    }
+    return this->iteratorAt(current);
+}
+
+/**
+ * aggregate
+ *
+ * Descends to the highest node inside [lo, hi). Everything else in range
+ * is in its two subtrees: on the way down its left subtree, each node at
+ * or above lo brings itself and its right subtree, which come before what
+ * was collected so far, and on the way down its right subtree each node
+ * below hi brings its left subtree and itself, which come after.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+template<typename A>
+typename A::Result AVLTree<Key, Value, Compare, Alloc, Augment>::aggregate(const Key& lo, const Key& hi) const
+{
+    static_assert(IsSubtreeAggregate<Augment>::value && std::is_same<A, Augment>::value,
+                  "aggregate() needs AVLTree<..., SubtreeAggregate<Monoid> >");
+    typedef typename Augment::Result Result;
+    typedef AVLNode<Key, Value, Augment> NodeType;
+    NodeType* top = asAVL(this->root_);
+    while(top != nullptr) {
+         if(this->comp_(top->getKey(), lo))
+              top = top->getRight();
+         else if(!this->comp_(top->getKey(), hi))
+              top = top->getLeft();
+         else
+              break;
+    }
+    if(top == nullptr)
+         return Augment::identity();
+
+    Result before = Augment::identity();
+    for(NodeType* current = top->getLeft(); current != nullptr; ) {
+         if(this->comp_(current->getKey(), lo))
+              current = current->getRight();
+         else {
+              before = Augment::combine(Augment::combine(Augment::itemOf(current), Augment::summaryOf(current->getRight())), before);
+              current = current->getLeft();
+         }
+    }
+    Result after = Augment::identity();
+    for(NodeType* current = top->getRight(); current != nullptr; ) {
+         if(this->comp_(current->getKey(), hi)) {
+              after = Augment::combine(after, Augment::combine(Augment::summaryOf(current->getLeft()), Augment::itemOf(current)));
+              current = current->getRight();
+         }
+         else
+              current = current->getLeft();
+    }
+    return Augment::combine(Augment::combine(before, Augment::itemOf(top)), after);
+}
+
+/**
+ * percentile
+ *
+ * Returns an iterator to the nearest-rank p-quantile, for p in [0, 1]:
+ * the smallest key with at least p * size() keys at or below it.
+ * Returns end() for an empty tree.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+typename AVLTree<Key, Value, Compare, Alloc, Augment>::iterator AVLTree<Key, Value, Compare, Alloc, Augment>::percentile(double p) const
+{
+    size_t n = this->size_;
+    if(n == 0)
+         return this->iteratorAt(nullptr);
+    double position = std::ceil(p * (double)n);
+    size_t k = (position <= 1.0) ? 0 : (size_t)position - 1;
+    return select(std::min(k, n - 1));
+}
+
+/**
+ * insertFix
+ *
+ * Called after child's subtree grew by one level under parent. Walks upward
+ * adjusting balance factors incrementally, and stops as soon as a subtree's
+ * height is unchanged: either a node becomes perfectly balanced, or a single
+ * or double rotation restores the height the subtree had before the insert.
+ * Each step is O(1), so the whole fix-up is O(log n).
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+bool AVLTree<Key, Value, Compare, Alloc, Augment>::insertFix(AVLNode<Key, Value, Augment>* parent, AVLNode<Key, Value, Augment>* child)
+{
+    while(parent != nullptr) {
+         int8_t diff = (parent->getLeft() == child) ? 1 : -1;
+         int8_t balance = parent->getBalance() + diff;
+         if(balance == 0) {
+              // The shorter side caught up; the height did not change.
+              parent->setBalance(0);
+              return false;
+         }
+         if(balance == 1 || balance == -1) {
+              // The subtree grew; keep walking up.
+              parent->updateBalance(diff);
+              child = parent;
+              parent = parent->getParent();
+              continue;
+         }
+         if(diff == 1) {
+              if(child->getBalance() == 1) {
+                   // Left-Left case.
+                   this->stats_.countRotation(TreeCounters::LL);
+                   rotateRight(parent);
+                   parent->setBalance(0);
+                   child->setBalance(0);
+              } else {
                    // Left-Right case.
-                   rotateLeft(leftChild);
-                   rotateRight(node);
+                   this->stats_.countRotation(TreeCounters::LR);
+                   AVLNode<Key, Value, Augment>* grandchild = child->getRight();
+                   rotateLeft(child);
+                   rotateRight(parent);
+                   int8_t g = grandchild->getBalance();
+                   child->setBalance(g == -1 ? 1 : 0);
+                   parent->setBalance(g == 1 ? -1 : 0);
+                   grandchild->setBalance(0);
+              }
+         } else {
+              if(child->getBalance() == -1) {
+                   // Right-Right case.
+                   this->stats_.countRotation(TreeCounters::RR);
+                   rotateLeft(parent);
+                   parent->setBalance(0);
+                   child->setBalance(0);
               } else {
+                   // Right-Left case.
+                   this->stats_.countRotation(TreeCounters::RL);
+                   AVLNode<Key, Value, Augment>* grandchild = child->getLeft();
+                   rotateRight(child);
+                   rotateLeft(parent);
+                   int8_t g = grandchild->getBalance();
+                   child->setBalance(g == 1 ? -1 : 0);
+                   parent->setBalance(g == -1 ? 1 : 0);
+                   grandchild->setBalance(0);
+              }
+         }
+         // After an insert rotation the subtree is back to its old height.
+         return false;
+    }
+    return true;
+}
+
+/**
+ * removeFix
+ *
+ * Called after one of node's subtrees shrank by one level; diff is the
+ * resulting change to node's balance factor (-1 if the left side shrank,
+ * +1 if the right side shrank). Walks upward until some subtree keeps its
+ * height, which happens when a node goes from balanced to leaning, or when
+ * a single rotation is done around a balanced child.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::removeFix(AVLNode<Key, Value, Augment>* node, int8_t diff)
+{
+    while(node != nullptr) {
+         AVLNode<Key, Value, Augment>* parent = node->getParent();
+         int8_t nextDiff = (parent != nullptr && parent->getLeft() == node) ? -1 : 1;
+         int8_t balance = node->getBalance() + diff;
+         if(balance == 1 || balance == -1) {
+              // Was balanced; the taller side keeps the subtree's height.
+              node->updateBalance(diff);
+              return;
+         }
+         if(balance == 0) {
+              // The taller side shrank, so this subtree shrank too.
+              node->setBalance(0);
+              node = parent;
+              diff = nextDiff;
+              continue;
+         }
+         if(balance == 2) {
+              AVLNode<Key, Value, Augment>* child = node->getLeft();
+              int8_t c = child->getBalance();
+              if(c == 0) {
+                   // Left-Left case around a balanced child: height is kept.
+                   this->stats_.countRotation(TreeCounters::LL);
+                   rotateRight(node);
+                   node->setBalance(1);
+                   child->setBalance(-1);
+                   return;
+              }
+              if(c == 1) {
                    // Left-Left case.
+                   this->stats_.countRotation(TreeCounters::LL);
                    rotateRight(node);
+                   node->setBalance(0);
+                   child->setBalance(0);
+              } else {
+                   // Left-Right case.
+                   this->stats_.countRotation(TreeCounters::LR);
+                   AVLNode<Key, Value, Augment>* grandchild = child->getRight();
+                   rotateLeft(child);
+                   rotateRight(node);
+                   int8_t g = grandchild->getBalance();
+                   child->setBalance(g == -1 ? 1 : 0);
+                   node->setBalance(g == 1 ? -1 : 0);
+                   grandchild->setBalance(0);
               }
-         } else if(balance < -1) { // right heavy
-              AVLNode<Key, Value>* rightChild = node->getRight();
-              if(rightChild != nullptr && computeHeight(asAVL(rightChild->getRight())) < computeHeight(asAVL(rightChild->getLeft()))) {
-                   // Right-Left case.
-                   rotateRight(rightChild);
+         } else {
+              AVLNode<Key, Value, Augment>* child = node->getRight();
+              int8_t c = child->getBalance();
+              if(c == 0) {
+                   // Right-Right case around a balanced child: height is kept.
+                   this->stats_.countRotation(TreeCounters::RR);
                    rotateLeft(node);
-              } else {
+                   node->setBalance(-1);
+                   child->setBalance(1);
+                   return;
+              }
+              if(c == -1) {
                    // Right-Right case.
+                   this->stats_.countRotation(TreeCounters::RR);
                    rotateLeft(node);
+                   node->setBalance(0);
+                   child->setBalance(0);
+              } else {
+                   // Right-Left case.
+                   this->stats_.countRotation(TreeCounters::RL);
+                   AVLNode<Key, Value, Augment>* grandchild = child->getLeft();
+                   rotateRight(child);
+                   rotateLeft(node);
+                   int8_t g = grandchild->getBalance();
+                   child->setBalance(g == 1 ? -1 : 0);
+                   node->setBalance(g == -1 ? 1 : 0);
+                   grandchild->setBalance(0);
               }
          }
-         node = asAVL(node->getParent());
+         // The rotated subtree is one level shorter; keep walking up.
+         node = parent;
+         diff = nextDiff;
+    }
+}
+
+/**
+ * Set operations
+ *
+ * All three follow the same recursion: the root of other splits this tree
+ * at its key, the two halves are combined recursively (in parallel when a
+ * pool is given), and the results are joined back together, with the root
+ * of other, the matching node of this tree, or neither as the middle key.
+ * No node is allocated or copied. Nodes that leave the result are only
+ * collected while the recursion runs, since the allocator is not
+ * thread-safe, and are destroyed at the end.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::union_with(AVLTree& other, ThreadPool* pool)
+{
+    combine(other, UNION, pool);
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::intersect(AVLTree& other, ThreadPool* pool)
+{
+    combine(other, INTERSECTION, pool);
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::difference(AVLTree& other, ThreadPool* pool)
+{
+    combine(other, DIFFERENCE, pool);
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::combine(AVLTree& other, SetOperation op, ThreadPool* pool)
+{
+    if(&other == this) {
+         if(op == DIFFERENCE)
+              this->clear();
+         return;
+    }
+    // other's nodes now belong to this tree, whatever happens to them.
+    this->alloc_.absorb(other.alloc_);
+    Subtree a = makeSubtree(asAVL(this->root_));
+    Subtree b = makeSubtree(asAVL(other.root_));
+    size_t sizeA = this->size_;
+    size_t sizeB = other.size_;
+    this->root_ = nullptr;
+    this->leftmost_ = nullptr;
+    this->rightmost_ = nullptr;
+    this->size_ = 0;
+    other.root_ = nullptr;
+    other.leftmost_ = nullptr;
+    other.rightmost_ = nullptr;
+    other.size_ = 0;
+
+    // Allow a few more levels of tasks than threads, to even out the halves.
+    int depth = 0;
+    if(pool != nullptr) {
+         for(size_t threads = pool->size(); threads > 0; threads /= 2)
+              ++depth;
+         if(depth > 0)
+              depth += 2;
+    }
+    MergeScratch scratch;
+    scratch.matches = 0;
+    Subtree result = combineSubtrees(op, a, b, scratch, pool, depth);
+
+    this->root_ = result.root;
+    this->resetEnds();
+    if(op == UNION)
+         this->size_ = sizeA + sizeB - scratch.matches;
+    else if(op == INTERSECTION)
+         this->size_ = scratch.matches;
+    else
+         this->size_ = sizeA - scratch.matches;
+    for(size_t i = 0; i < scratch.dropped.size(); ++i)
+         this->clearHelper(scratch.dropped[i]);
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+typename AVLTree<Key, Value, Compare, Alloc, Augment>::Subtree
+AVLTree<Key, Value, Compare, Alloc, Augment>::combineSubtrees(SetOperation op, Subtree a, Subtree b, MergeScratch& scratch, ThreadPool* pool, int depth)
+{
+    if(a.root == nullptr) {
+         if(op == UNION)
+              return b;
+         if(b.root != nullptr)
+              scratch.dropped.push_back(b.root);
+         return a;
+    }
+    if(b.root == nullptr) {
+         if(op != INTERSECTION)
+              return a;
+         scratch.dropped.push_back(a.root);
+         return b;
+    }
+    AVLNode<Key, Value, Augment>* mid = b.root;
+    Subtree bLeft = takeLeft(mid, b.height);
+    Subtree bRight = takeRight(mid, b.height);
+    Subtree aLeft, aRight;
+    AVLNode<Key, Value, Augment>* match = nullptr;
+    splitSubtree(a, mid->getKey(), aLeft, match, aRight);
+    if(match != nullptr)
+         ++scratch.matches;
+
+    Subtree left, right;
+    if(pool != nullptr && depth > 0 && std::min(a.height, b.height) >= PARALLEL_MIN_HEIGHT) {
+         MergeScratch leftScratch;
+         leftScratch.matches = 0;
+         pool->invoke(
+              [&]() { left = combineSubtrees(op, aLeft, bLeft, leftScratch, pool, depth - 1); },
+              [&]() { right = combineSubtrees(op, aRight, bRight, scratch, pool, depth - 1); });
+         scratch.dropped.insert(scratch.dropped.end(), leftScratch.dropped.begin(), leftScratch.dropped.end());
+         scratch.matches += leftScratch.matches;
+    }
+    else {
+         left = combineSubtrees(op, aLeft, bLeft, scratch, pool, 0);
+         right = combineSubtrees(op, aRight, bRight, scratch, pool, 0);
+    }
+
+    if(op == UNION) {
+         if(match != nullptr)
+              scratch.dropped.push_back(match);
+         return joinSubtrees(left, mid, right);
+    }
+    scratch.dropped.push_back(mid);
+    if(op == INTERSECTION && match != nullptr)
+         return joinSubtrees(left, match, right);
+    if(match != nullptr)
+         scratch.dropped.push_back(match);
+    return joinSubtrees(left, right);
+}
+
+/**
+ * makeSubtree
+ *
+ * Wraps a detached root with its height, found in O(log n) by always
+ * stepping into the taller child.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+typename AVLTree<Key, Value, Compare, Alloc, Augment>::Subtree
+AVLTree<Key, Value, Compare, Alloc, Augment>::makeSubtree(AVLNode<Key, Value, Augment>* root)
+{
+    Subtree tree;
+    tree.root = root;
+    tree.height = 0;
+    for(AVLNode<Key, Value, Augment>* node = root; node != nullptr; ) {
+         ++tree.height;
+         node = (node->getBalance() < 0) ? node->getRight() : node->getLeft();
+    }
+    return tree;
+}
+
+/**
+ * takeLeft / takeRight
+ *
+ * Detach a child of node, whose subtree has the given height, and return it
+ * with its height.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+typename AVLTree<Key, Value, Compare, Alloc, Augment>::Subtree
+AVLTree<Key, Value, Compare, Alloc, Augment>::takeLeft(AVLNode<Key, Value, Augment>* node, int height)
+{
+    Subtree tree;
+    tree.root = node->getLeft();
+    tree.height = height - ((node->getBalance() < 0) ? 2 : 1);
+    if(tree.root != nullptr)
+         tree.root->setParent(nullptr);
+    node->setLeft(nullptr);
+    return tree;
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+typename AVLTree<Key, Value, Compare, Alloc, Augment>::Subtree
+AVLTree<Key, Value, Compare, Alloc, Augment>::takeRight(AVLNode<Key, Value, Augment>* node, int height)
+{
+    Subtree tree;
+    tree.root = node->getRight();
+    tree.height = height - ((node->getBalance() > 0) ? 2 : 1);
+    if(tree.root != nullptr)
+         tree.root->setParent(nullptr);
+    node->setRight(nullptr);
+    return tree;
+}
+
+/**
+ * joinSubtrees
+ *
+ * Joins left, mid and right, where every key of left is less than mid's
+ * and every key of right is greater, in O(|height difference| + 1).
+ * If the heights are close, mid simply becomes the root. Otherwise mid
+ * replaces the first node down the inner spine of the taller tree that is
+ * at most one level taller than the shorter tree, with that node and the
+ * shorter tree as its children. That grows the taller tree by one level at
+ * that point, which is exactly what insertFix repairs.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+typename AVLTree<Key, Value, Compare, Alloc, Augment>::Subtree
+AVLTree<Key, Value, Compare, Alloc, Augment>::joinSubtrees(Subtree left, AVLNode<Key, Value, Augment>* mid, Subtree right)
+{
+    int diff = left.height - right.height;
+    AVLNode<Key, Value, Augment>* parent = nullptr;
+    AVLNode<Key, Value, Augment>* inner = nullptr;
+    int innerHeight = 0;
+    int tallerHeight = std::max(left.height, right.height);
+    if(diff > 1) {
+         inner = left.root;
+         innerHeight = left.height;
+         while(innerHeight > right.height + 1) {
+              parent = inner;
+              innerHeight -= (inner->getBalance() > 0) ? 2 : 1;
+              inner = inner->getRight();
+         }
+         left.root = inner;
+         left.height = innerHeight;
+    }
+    else if(diff < -1) {
+         inner = right.root;
+         innerHeight = right.height;
+         while(innerHeight > left.height + 1) {
+              parent = inner;
+              innerHeight -= (inner->getBalance() < 0) ? 2 : 1;
+              inner = inner->getLeft();
+         }
+         right.root = inner;
+         right.height = innerHeight;
+    }
+
+    mid->setParent(parent);
+    mid->setLeft(left.root);
+    if(left.root != nullptr)
+         left.root->setParent(mid);
+    mid->setRight(right.root);
+    if(right.root != nullptr)
+         right.root->setParent(mid);
+    mid->setBalance((int8_t)(left.height - right.height));
+    Augment::update(mid);
+
+    Subtree joined;
+    if(parent == nullptr) {
+         joined.root = mid;
+         joined.height = std::max(left.height, right.height) + 1;
+         return joined;
+    }
+    if(diff > 1)
+         parent->setRight(mid);
+    else
+         parent->setLeft(mid);
+    updateAugmentToRoot(parent);
+    bool grew = insertFix(parent, mid);
+    AVLNode<Key, Value, Augment>* top = mid;
+    while(top->getParent() != nullptr)
+         top = top->getParent();
+    joined.root = top;
+    joined.height = tallerHeight + (grew ? 1 : 0);
+    return joined;
+}
+
+/**
+ * joinSubtrees
+ *
+ * Joins two trees without a middle key by borrowing the last node of left.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+typename AVLTree<Key, Value, Compare, Alloc, Augment>::Subtree
+AVLTree<Key, Value, Compare, Alloc, Augment>::joinSubtrees(Subtree left, Subtree right)
+{
+    if(left.root == nullptr)
+         return right;
+    if(right.root == nullptr)
+         return left;
+    AVLNode<Key, Value, Augment>* last = nullptr;
+    Subtree rest = splitLast(left, last);
+    return joinSubtrees(rest, last, right);
+}
+
+/**
+ * splitSubtree
+ *
+ * Splits tree into the keys less than key (left), a node holding key if
+ * there is one (match, detached, or nullptr), and the keys greater than key
+ * (right). Walks one root-to-leaf path and joins the pieces hanging off it
+ * on the way back; the joins' costs telescope, so the total is O(log n).
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::splitSubtree(Subtree tree, const Key& key, Subtree& left, AVLNode<Key, Value, Augment>*& match, Subtree& right)
+{
+    if(tree.root == nullptr) {
+         left = tree;
+         right = tree;
+         match = nullptr;
+         return;
+    }
+    AVLNode<Key, Value, Augment>* node = tree.root;
+    Subtree nodeLeft = takeLeft(node, tree.height);
+    Subtree nodeRight = takeRight(node, tree.height);
+    if(this->comp_(key, node->getKey())) {
+         Subtree between;
+         splitSubtree(nodeLeft, key, left, match, between);
+         right = joinSubtrees(between, node, nodeRight);
+    }
+    else if(this->comp_(node->getKey(), key)) {
+         Subtree between;
+         splitSubtree(nodeRight, key, between, match, right);
+         left = joinSubtrees(nodeLeft, node, between);
+    }
+    else {
+         left = nodeLeft;
+         match = node;
+         right = nodeRight;
+    }
+}
+
+/**
+ * splitLast
+ *
+ * Detaches the node with the greatest key into last and returns the rest.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+typename AVLTree<Key, Value, Compare, Alloc, Augment>::Subtree
+AVLTree<Key, Value, Compare, Alloc, Augment>::splitLast(Subtree tree, AVLNode<Key, Value, Augment>*& last)
+{
+    AVLNode<Key, Value, Augment>* node = tree.root;
+    Subtree nodeLeft = takeLeft(node, tree.height);
+    Subtree nodeRight = takeRight(node, tree.height);
+    if(nodeRight.root == nullptr) {
+         last = node;
+         return nodeLeft;
+    }
+    Subtree rest = splitLast(nodeRight, last);
+    return joinSubtrees(nodeLeft, node, rest);
+}
+
+/**
+ * split
+ *
+ * Both halves keep using the nodes in place, so the second tree shares this
+ * tree's allocator memory with the first. Apart from the sizes this takes
+ * O(log n); see sizeOfSplit.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+std::pair<AVLTree<Key, Value, Compare, Alloc, Augment>, AVLTree<Key, Value, Compare, Alloc, Augment> >
+AVLTree<Key, Value, Compare, Alloc, Augment>::split(const Key& key)
+{
+    std::pair<AVLTree, AVLTree> parts(AVLTree(this->comp_), AVLTree(this->comp_));
+    parts.first.alloc_.absorb(this->alloc_);
+    parts.second.alloc_.share(parts.first.alloc_);
+
+    size_t total = this->size_;
+    Subtree whole = makeSubtree(asAVL(this->root_));
+    this->root_ = nullptr;
+    this->leftmost_ = nullptr;
+    this->rightmost_ = nullptr;
+    this->size_ = 0;
+    Subtree left, right;
+    AVLNode<Key, Value, Augment>* match = nullptr;
+    splitSubtree(whole, key, left, match, right);
+    if(match != nullptr) {
+         Subtree empty = makeSubtree(nullptr);
+         right = joinSubtrees(empty, match, right);
+    }
+
+    size_t leftSize = sizeOfSplit(left, right, total, std::is_same<Augment, OrderStatistic>());
+    parts.first.root_ = left.root;
+    parts.first.size_ = leftSize;
+    parts.first.resetEnds();
+    parts.second.root_ = right.root;
+    parts.second.size_ = total - leftSize;
+    parts.second.resetEnds();
+    return parts;
+}
+
+/**
+ * join
+ *
+ * Checks the key order at the seam, then joins the two trees around the
+ * last node of this one in O(log n).
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::join(AVLTree& right)
+{
+    if(&right == this || right.root_ == nullptr)
+         return;
+    if(this->root_ == nullptr) {
+         *this = std::move(right);
+         return;
+    }
+    if(!this->comp_(this->rightmost_->getKey(), right.leftmost_->getKey()))
+         throw std::invalid_argument("join: keys of right must all be greater");
+
+    this->alloc_.absorb(right.alloc_);
+    Subtree l = makeSubtree(asAVL(this->root_));
+    Subtree r = makeSubtree(asAVL(right.root_));
+    AVLNode<Key, Value, Augment>* mid = nullptr;
+    l = splitLast(l, mid);
+    this->root_ = joinSubtrees(l, mid, r).root;
+    this->rightmost_ = right.rightmost_;
+    this->size_ += right.size_;
+    right.root_ = nullptr;
+    right.leftmost_ = nullptr;
+    right.rightmost_ = nullptr;
+    right.size_ = 0;
+}
+
+/**
+ * sizeOfSplit
+ *
+ * With OrderStatistic the size is stored at the root. Otherwise both halves
+ * are walked in order in step until the smaller one runs out, which costs
+ * O(min(left, right)) and not the O(n) of counting one side.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+size_t AVLTree<Key, Value, Compare, Alloc, Augment>::sizeOfSplit(Subtree left, Subtree, size_t, std::true_type)
+{
+    return OrderStatistic::sizeOf(left.root);
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+size_t AVLTree<Key, Value, Compare, Alloc, Augment>::sizeOfSplit(Subtree left, Subtree right, size_t total, std::false_type)
+{
+    Node<Key, Value>* a = left.root;
+    Node<Key, Value>* b = right.root;
+    while(a != nullptr && a->getLeft() != nullptr)
+         a = a->getLeft();
+    while(b != nullptr && b->getLeft() != nullptr)
+         b = b->getLeft();
+    size_t steps = 0;
+    while(a != nullptr && b != nullptr) {
+         a = BinarySearchTree<Key, Value, Compare, Alloc>::successor(a);
+         b = BinarySearchTree<Key, Value, Compare, Alloc>::successor(b);
+         ++steps;
+    }
+    // Each walk took steps nodes; the one that ran out has exactly that many.
+    if(a == nullptr)
+         return steps;
+    return total - steps;
+}
+
+/**
+ * isLocalBatch
+ *
+ * Looks at the smallest subtree holding every tree key between low and
+ * high. If there is none, the whole batch goes into one gap. Otherwise the
+ * batch is local if that subtree is small next to the batch; its height
+ * bounds its size from above. The cost is one root-to-leaf walk.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+bool AVLTree<Key, Value, Compare, Alloc, Augment>::isLocalBatch(const Key& low, const Key& high, size_t count) const
+{
+    Node<Key, Value>* span = this->root_;
+    while(span != nullptr) {
+         if(this->comp_(high, span->getKey()))
+              span = span->getLeft();
+         else if(this->comp_(span->getKey(), low))
+              span = span->getRight();
+         else
+              break;
+    }
+    if(span == nullptr)
+         return true;
+    int height = makeSubtree(asAVL(span)).height;
+    size_t limit = count * FINGER_MAX_GAP;
+    for(int h = 0; h < height; ++h) {
+         if(limit < 2)
+              return false;
+         limit /= 2;
+    }
+    return true;
+}
+
+/**
+ * insert_batch
+ *
+ * When the batch is local (isLocalBatch), each search after the first
+ * climbs from the node of the previous, smaller key only as far as the
+ * lowest ancestor whose subtree spans the new key, so a run of nearby keys
+ * costs O(log distance) per key instead of a full descent. Scattered keys
+ * are searched from the root: each finger search has to wait for the
+ * insert before it, while searches from the root overlap in the CPU, so
+ * fingers only win when they save most of the walk. Rebalancing is AVL's
+ * usual amortized O(1) per key. If an insert throws, the keys before it
+ * stay inserted.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+template<typename InputIterator>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::insert_batch(InputIterator first, InputIterator last)
+{
+    std::vector<std::pair<Key, Value> > items(first, last);
+    this->sortItems(items);
+    if(items.empty())
+         return;
+    bool local = isLocalBatch(items.front().first, items.back().first, items.size());
+    Node<Key, Value>* finger = nullptr;
+    for(size_t i = 0; i < items.size(); ++i) {
+         Node<Key, Value>* parent = nullptr;
+         bool isLeft = false;
+         Node<Key, Value>* start = local ? this->fingerStart(finger, items[i].first) : this->root_;
+         Node<Key, Value>* existing = this->findSlotFrom(start, items[i].first, parent, isLeft);
+         if(existing != nullptr) {
+              existing->setValue(std::move(items[i].second));
+              updateAugmentToRoot(asAVL(existing));
+              finger = existing;
+         }
+         else {
+              finger = linkNewNode(parent, isLeft, std::move(items[i].first), std::move(items[i].second));
+         }
+    }
+}
+
+/**
+ * remove_batch
+ *
+ * Like insert_batch, but the finger is the predecessor of each removed
+ * node: removal may move nodes around, but never destroys that node.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+template<typename InputIterator>
+void AVLTree<Key, Value, Compare, Alloc, Augment>::remove_batch(InputIterator first, InputIterator last)
+{
+    std::vector<Key> keys(first, last);
+    this->sortKeys(keys);
+    if(keys.empty())
+         return;
+    bool local = isLocalBatch(keys.front(), keys.back(), keys.size());
+    Node<Key, Value>* finger = nullptr;
+    for(size_t i = 0; i < keys.size() && this->root_ != nullptr; ++i) {
+         Node<Key, Value>* parent = nullptr;
+         bool isLeft = false;
+         Node<Key, Value>* start = local ? this->fingerStart(finger, keys[i]) : this->root_;
+         Node<Key, Value>* node = this->findSlotFrom(start, keys[i], parent, isLeft);
+         if(node == nullptr) {
+              // parent holds the nearest key; keep the finger below keys[i].
+              if(local && parent != nullptr && this->comp_(parent->getKey(), keys[i]))
+                   finger = parent;
+              continue;
+         }
+         if(local)
+              finger = BinarySearchTree<Key, Value, Compare, Alloc>::predecessor(node);
+         removeNode(asAVL(node));
     }
 }
 
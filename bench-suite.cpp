@@ -0,0 +1,556 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <map>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include "bst.h"
+#include "avlbst.h"
+#include "splay_tree.h"
+#include "red_black_tree.h"
+
+using namespace std;
+
+// Benchmark suite for BinarySearchTree, AVLTree, RedBlackTree, SplayTree and
+// std::map, run by `make bench`. For each structure, key distribution and
+// size (1K, 10K, ... up to the first argument, 1M by default) it times
+// insert, find, iteration, remove and clear, and writes the results as JSON
+// to the second argument (stdout by default) so they can be compared over
+// time.
+//
+// Throughput is the whole loop over n operations. Latency percentiles come
+// from timing one operation in every `stride`, at most MAX_SAMPLES of them,
+// so the cost of reading the clock barely shows in the throughput; it is
+// reported as clock_overhead_ns and included in every latency sample.
+//
+// Key distributions, over n distinct keys:
+//   sequential   inserted in increasing order
+//   random       inserted in random order
+//   zipfian      drawn from a Zipf(0.99) distribution over the keys in random
+//                order, so a few hot keys repeat (repeats overwrite, and miss
+//                when removing), as in a skewed read-mostly workload
+//   skewed       the same with Zipf(1.2), where the hottest few keys take most
+//                of the accesses: the case SplayTree, which moves them to the
+//                root, is meant for
+//   adversarial  inserted from both ends inwards (0, n-1, 1, n-2, ...), which
+//                makes a plain BST a zig-zag path and keeps AVLTree rotating
+// Lookups use a second sequence from the same distribution. Removes use
+// the insertion sequence. A plain BST degenerates to a path on sequential
+// and adversarial keys and takes quadratic time, so those runs stop at
+// DEGENERATE_MAX and the larger ones are reported as skipped.
+//
+// The "mixed" section pits the balanced trees against each other under
+// interleaved reads and writes. A tree of n random keys from [0, 2n) gets
+// max(n, MIXED_MIN_OPS) operations on uniformly random keys from the same
+// range: finds, and for the given write fraction of them, inserts and
+// removes in equal numbers, so the size stays near n. AVLTree keeps the
+// shorter tree and RedBlackTree rotates less on writes, so the crossover
+// shows up as the write fraction grows.
+
+static const size_t MAX_SAMPLES = 65536;
+static const size_t MIN_STRIDE = 16;
+static const size_t DEGENERATE_MAX = 20000;
+static const double ZIPF_THETA = 0.99;
+static const double SKEWED_THETA = 1.2;
+static const size_t MIXED_MIN_OPS = 100000;
+static const double WRITE_FRACTIONS[] = { 0.1, 0.5, 0.9 };
+
+typedef chrono::steady_clock Clock;
+
+static double elapsedNs(Clock::time_point start, Clock::time_point end)
+{
+    return (double)chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+}
+
+/**
+ * Draws ranks in [0, n) with P(rank i) proportional to 1 / (i + 1)^theta,
+ * using the rejection-free method of Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases" (as in YCSB).
+ */
+class ZipfGenerator
+{
+public:
+    ZipfGenerator(uint64_t n, double theta);
+    uint64_t next(mt19937_64& rng);
+
+private:
+    uint64_t n_;
+    double theta_;
+    double alpha_;
+    double zetaN_;
+    double eta_;
+};
+
+ZipfGenerator::ZipfGenerator(uint64_t n, double theta) :
+    n_(n),
+    theta_(theta),
+    alpha_(1.0 / (1.0 - theta)),
+    zetaN_(0.0)
+{
+    for(uint64_t i = 1; i <= n; ++i) {
+        zetaN_ += 1.0 / pow((double)i, theta);
+    }
+    double zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+    eta_ = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta2 / zetaN_);
+}
+
+uint64_t ZipfGenerator::next(mt19937_64& rng)
+{
+    double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+    double uz = u * zetaN_;
+    if(uz < 1.0)
+        return 0;
+    if(uz < 1.0 + pow(0.5, theta_))
+        return 1;
+    uint64_t rank = (uint64_t)((double)n_ * pow(eta_ * u - eta_ + 1.0, alpha_));
+    return min(rank, n_ - 1);
+}
+
+/**
+ * Draws ranks in [0, n) with P(rank i) proportional to 1 / (i + 1)^theta
+ * for any theta, by binary search in a table of the cumulative weights.
+ * ZipfGenerator needs theta < 1.
+ */
+class ZipfTable
+{
+public:
+    ZipfTable(uint64_t n, double theta);
+    uint64_t next(mt19937_64& rng);
+
+private:
+    vector<double> cumulative_;
+};
+
+ZipfTable::ZipfTable(uint64_t n, double theta) :
+    cumulative_(n)
+{
+    double total = 0.0;
+    for(uint64_t i = 0; i < n; ++i) {
+        total += 1.0 / pow((double)(i + 1), theta);
+        cumulative_[i] = total;
+    }
+}
+
+uint64_t ZipfTable::next(mt19937_64& rng)
+{
+    double u = uniform_real_distribution<double>(0.0, cumulative_.back())(rng);
+    uint64_t rank = (uint64_t)(lower_bound(cumulative_.begin(), cumulative_.end(), u) - cumulative_.begin());
+    return min(rank, (uint64_t)cumulative_.size() - 1);
+}
+
+enum Distribution { SEQUENTIAL, RANDOM, ZIPFIAN, SKEWED, ADVERSARIAL };
+
+static const char* distributionName(Distribution dist)
+{
+    switch(dist) {
+    case SEQUENTIAL: return "sequential";
+    case RANDOM: return "random";
+    case ZIPFIAN: return "zipfian";
+    case SKEWED: return "skewed";
+    default: return "adversarial";
+    }
+}
+
+/**
+ * The insertion and lookup sequences of n keys for one distribution.
+ */
+struct Workload
+{
+    vector<int> inserts;
+    vector<int> lookups;
+};
+
+// Fills both sequences with the keys of ranks drawn from zipf.
+template<typename Zipf>
+static void drawZipf(Workload& work, const vector<int>& keyOfRank, Zipf& zipf, mt19937_64& rng)
+{
+    for(size_t i = 0; i < work.inserts.size(); ++i) {
+        work.inserts[i] = keyOfRank[zipf.next(rng)];
+    }
+    for(size_t i = 0; i < work.lookups.size(); ++i) {
+        work.lookups[i] = keyOfRank[zipf.next(rng)];
+    }
+}
+
+static Workload makeWorkload(Distribution dist, size_t n, mt19937_64& rng)
+{
+    Workload work;
+    work.inserts.resize(n);
+    work.lookups.resize(n);
+    switch(dist) {
+    case SEQUENTIAL:
+        for(size_t i = 0; i < n; ++i) {
+            work.inserts[i] = (int)i;
+        }
+        break;
+    case ADVERSARIAL:
+        for(size_t i = 0; i < n; ++i) {
+            work.inserts[i] = (i % 2 == 0) ? (int)(i / 2) : (int)(n - 1 - i / 2);
+        }
+        break;
+    case RANDOM:
+        for(size_t i = 0; i < n; ++i) {
+            work.inserts[i] = (int)i;
+        }
+        shuffle(work.inserts.begin(), work.inserts.end(), rng);
+        break;
+    case ZIPFIAN:
+    case SKEWED: {
+        // Hot ranks are scattered over the key space, not clustered at 0.
+        vector<int> keyOfRank(n);
+        for(size_t i = 0; i < n; ++i) {
+            keyOfRank[i] = (int)i;
+        }
+        shuffle(keyOfRank.begin(), keyOfRank.end(), rng);
+        if(dist == ZIPFIAN) {
+            ZipfGenerator zipf(n, ZIPF_THETA);
+            drawZipf(work, keyOfRank, zipf, rng);
+        }
+        else {
+            ZipfTable zipf(n, SKEWED_THETA);
+            drawZipf(work, keyOfRank, zipf, rng);
+        }
+        return work;
+    }
+    }
+    // Lookups hit uniformly random keys that were inserted.
+    for(size_t i = 0; i < n; ++i) {
+        work.lookups[i] = work.inserts[rng() % n];
+    }
+    return work;
+}
+
+/**
+ * The preloaded keys and the operations of one mixed run.
+ */
+struct MixedWorkload
+{
+    enum Kind { FIND, INSERT, REMOVE };
+
+    vector<int> preload;
+    vector<int> keys;
+    vector<unsigned char> kinds;
+};
+
+static MixedWorkload makeMixedWorkload(size_t n, double writeFraction, mt19937_64& rng)
+{
+    MixedWorkload work;
+    vector<int> range(2 * n);
+    for(size_t i = 0; i < range.size(); ++i) {
+        range[i] = (int)i;
+    }
+    shuffle(range.begin(), range.end(), rng);
+    work.preload.assign(range.begin(), range.begin() + n);
+
+    size_t ops = max(n, MIXED_MIN_OPS);
+    uniform_real_distribution<double> unit(0.0, 1.0);
+    work.keys.resize(ops);
+    work.kinds.resize(ops);
+    for(size_t i = 0; i < ops; ++i) {
+        work.keys[i] = (int)(rng() % (2 * n));
+        if(unit(rng) >= writeFraction)
+            work.kinds[i] = MixedWorkload::FIND;
+        else
+            work.kinds[i] = (rng() % 2 == 0) ? MixedWorkload::INSERT : MixedWorkload::REMOVE;
+    }
+    return work;
+}
+
+/**
+ * Throughput and sampled latency of one operation over one run.
+ */
+struct OpStats
+{
+    OpStats() : ops(0), totalNs(0.0), samples(0) { }
+
+    size_t ops;
+    double totalNs;
+    size_t samples;
+    double p50, p90, p99, p999, max;
+};
+
+/**
+ * Runs op(i) for i in [0, n), timing the whole loop and, separately,
+ * every stride-th call.
+ */
+template<typename Op>
+static OpStats timeOps(size_t n, Op op)
+{
+    size_t stride = max(MIN_STRIDE, (n + MAX_SAMPLES - 1) / MAX_SAMPLES);
+    vector<double> latencies;
+    latencies.reserve(n / stride + 1);
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        if(i % stride == 0) {
+            Clock::time_point before = Clock::now();
+            op(i);
+            latencies.push_back(elapsedNs(before, Clock::now()));
+        }
+        else {
+            op(i);
+        }
+    }
+    OpStats stats;
+    stats.totalNs = elapsedNs(start, Clock::now());
+    stats.ops = n;
+    stats.samples = latencies.size();
+    sort(latencies.begin(), latencies.end());
+    double* sorted = latencies.data();
+    size_t count = latencies.size();
+    stats.p50 = sorted[min(count - 1, count / 2)];
+    stats.p90 = sorted[min(count - 1, count * 9 / 10)];
+    stats.p99 = sorted[min(count - 1, count * 99 / 100)];
+    stats.p999 = sorted[min(count - 1, count * 999 / 1000)];
+    stats.max = sorted[count - 1];
+    return stats;
+}
+
+// The structures differ only in how they overwrite and remove.
+template<typename Key, typename Value, typename Compare, typename Alloc>
+static void put(BinarySearchTree<Key, Value, Compare, Alloc>& tree, const Key& key, const Value& value)
+{
+    tree.insert(make_pair(key, value));
+}
+
+template<typename Key, typename Value>
+static void put(map<Key, Value>& tree, const Key& key, const Value& value)
+{
+    tree[key] = value;
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+static void erase(BinarySearchTree<Key, Value, Compare, Alloc>& tree, const Key& key)
+{
+    tree.remove(key);
+}
+
+template<typename Key, typename Value>
+static void erase(map<Key, Value>& tree, const Key& key)
+{
+    tree.erase(key);
+}
+
+static void writeOp(ostream& out, const char* name, const OpStats& stats, bool last)
+{
+    double nsPerOp = (stats.ops == 0) ? 0.0 : stats.totalNs / stats.ops;
+    out << "        \"" << name << "\": {"
+        << "\"ops\": " << stats.ops
+        << ", \"ns_per_op\": " << nsPerOp
+        << ", \"mops_per_s\": " << ((nsPerOp == 0.0) ? 0.0 : 1000.0 / nsPerOp);
+    if(stats.samples > 0) {
+        out << ", \"samples\": " << stats.samples
+            << ", \"p50_ns\": " << stats.p50
+            << ", \"p90_ns\": " << stats.p90
+            << ", \"p99_ns\": " << stats.p99
+            << ", \"p999_ns\": " << stats.p999
+            << ", \"max_ns\": " << stats.max;
+    }
+    out << "}" << (last ? "" : ",") << "\n";
+}
+
+/**
+ * Runs every operation on one structure with one workload and writes the
+ * result object (without a trailing comma).
+ */
+template<typename Tree>
+static void runOne(ostream& out, const char* structure, Distribution dist,
+                   size_t n, const Workload& work)
+{
+    const vector<int>& inserts = work.inserts;
+    const vector<int>& lookups = work.lookups;
+
+    Tree tree;
+    OpStats insertStats = timeOps(n, [&](size_t i) {
+        put(tree, inserts[i], (int)i);
+    });
+    size_t size = tree.size();
+
+    long hits = 0;
+    OpStats findStats = timeOps(n, [&](size_t i) {
+        hits += (tree.find(lookups[i]) != tree.end());
+    });
+
+    long sum = 0;
+    OpStats iterateStats;
+    Clock::time_point start = Clock::now();
+    for(typename Tree::const_iterator it = tree.begin(); it != tree.end(); ++it) {
+        sum += it->second;
+    }
+    iterateStats.totalNs = elapsedNs(start, Clock::now());
+    iterateStats.ops = size;
+
+    OpStats removeStats = timeOps(n, [&](size_t i) {
+        erase(tree, inserts[i]);
+    });
+
+    // Refill untimed for clear.
+    for(size_t i = 0; i < n; ++i) {
+        put(tree, inserts[i], (int)i);
+    }
+    OpStats clearStats;
+    start = Clock::now();
+    tree.clear();
+    clearStats.totalNs = elapsedNs(start, Clock::now());
+    clearStats.ops = size;
+
+    out << "    {\"structure\": \"" << structure << "\""
+        << ", \"distribution\": \"" << distributionName(dist) << "\""
+        << ", \"n\": " << n
+        << ", \"size\": " << size
+        << ", \"find_hits\": " << hits
+        << ", \"checksum\": " << sum << ",\n"
+        << "      \"ops\": {\n";
+    writeOp(out, "insert", insertStats, false);
+    writeOp(out, "find", findStats, false);
+    writeOp(out, "iterate", iterateStats, false);
+    writeOp(out, "remove", removeStats, false);
+    writeOp(out, "clear", clearStats, true);
+    out << "      }}";
+}
+
+/**
+ * Preloads one structure untimed, times a mixed workload on it and writes
+ * the result object (without a trailing comma).
+ */
+template<typename Tree>
+static void runMixed(ostream& out, const char* structure, double writeFraction,
+                     size_t n, const MixedWorkload& work)
+{
+    Tree tree;
+    for(size_t i = 0; i < work.preload.size(); ++i) {
+        put(tree, work.preload[i], (int)i);
+    }
+
+    long hits = 0;
+    OpStats mixedStats = timeOps(work.keys.size(), [&](size_t i) {
+        int key = work.keys[i];
+        switch(work.kinds[i]) {
+        case MixedWorkload::FIND:
+            hits += (tree.find(key) != tree.end());
+            break;
+        case MixedWorkload::INSERT:
+            put(tree, key, (int)i);
+            break;
+        default:
+            erase(tree, key);
+            break;
+        }
+    });
+
+    out << "    {\"structure\": \"" << structure << "\""
+        << ", \"write_fraction\": " << writeFraction
+        << ", \"n\": " << n
+        << ", \"final_size\": " << tree.size()
+        << ", \"find_hits\": " << hits << ",\n"
+        << "      \"ops\": {\n";
+    writeOp(out, "mixed", mixedStats, true);
+    out << "      }}";
+}
+
+static void writeSkipped(ostream& out, const char* structure, Distribution dist, size_t n)
+{
+    out << "    {\"structure\": \"" << structure << "\""
+        << ", \"distribution\": \"" << distributionName(dist) << "\""
+        << ", \"n\": " << n
+        << ", \"skipped\": \"degenerate tree, quadratic time\"}";
+}
+
+/**
+ * The median cost of reading the clock twice, which every latency sample
+ * includes.
+ */
+static double clockOverheadNs()
+{
+    vector<double> costs(1001);
+    for(size_t i = 0; i < costs.size(); ++i) {
+        Clock::time_point before = Clock::now();
+        costs[i] = elapsedNs(before, Clock::now());
+    }
+    sort(costs.begin(), costs.end());
+    return costs[costs.size() / 2];
+}
+
+int main(int argc, char *argv[])
+{
+    size_t maxSize = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 1000000;
+    ofstream file;
+    if(argc > 2) {
+        file.open(argv[2]);
+        if(!file) {
+            cerr << "cannot write " << argv[2] << endl;
+            return 1;
+        }
+    }
+    ostream& out = (argc > 2) ? file : cout;
+    mt19937_64 rng(104);
+
+    char timestamp[32];
+    time_t now = time(nullptr);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    out << fixed << setprecision(1)
+        << "{\n"
+        << "  \"suite\": \"bst-bench\",\n"
+        << "  \"format_version\": 1,\n"
+        << "  \"timestamp\": \"" << timestamp << "\",\n"
+#if defined(__VERSION__)
+        << "  \"compiler\": \"" << __VERSION__ << "\",\n"
+#endif
+        << "  \"max_size\": " << maxSize << ",\n"
+        << "  \"clock_overhead_ns\": " << clockOverheadNs() << ",\n"
+        << "  \"results\": [\n";
+
+    const Distribution dists[] = { SEQUENTIAL, RANDOM, ZIPFIAN, SKEWED, ADVERSARIAL };
+    bool first = true;
+    for(size_t n = 1000; n <= maxSize; n *= 10) {
+        for(size_t d = 0; d < sizeof(dists) / sizeof(dists[0]); ++d) {
+            Distribution dist = dists[d];
+            Workload work = makeWorkload(dist, n, rng);
+            cerr << distributionName(dist) << " n=" << n << endl;
+
+            out << (first ? "" : ",\n");
+            first = false;
+            bool degenerate = (dist == SEQUENTIAL || dist == ADVERSARIAL);
+            if(degenerate && n > DEGENERATE_MAX)
+                writeSkipped(out, "BinarySearchTree", dist, n);
+            else
+                runOne<BinarySearchTree<int, int> >(out, "BinarySearchTree", dist, n, work);
+            out << ",\n";
+            runOne<AVLTree<int, int> >(out, "AVLTree", dist, n, work);
+            out << ",\n";
+            runOne<RedBlackTree<int, int> >(out, "RedBlackTree", dist, n, work);
+            out << ",\n";
+            runOne<SplayTree<int, int> >(out, "SplayTree", dist, n, work);
+            out << ",\n";
+            runOne<map<int, int> >(out, "std::map", dist, n, work);
+        }
+    }
+    out << "\n  ],\n"
+        << "  \"mixed\": [\n";
+
+    first = true;
+    for(size_t n = 1000; n <= maxSize; n *= 10) {
+        for(size_t w = 0; w < sizeof(WRITE_FRACTIONS) / sizeof(WRITE_FRACTIONS[0]); ++w) {
+            double writeFraction = WRITE_FRACTIONS[w];
+            MixedWorkload work = makeMixedWorkload(n, writeFraction, rng);
+            cerr << "mixed writes=" << writeFraction << " n=" << n << endl;
+
+            out << (first ? "" : ",\n");
+            first = false;
+            runMixed<AVLTree<int, int> >(out, "AVLTree", writeFraction, n, work);
+            out << ",\n";
+            runMixed<RedBlackTree<int, int> >(out, "RedBlackTree", writeFraction, n, work);
+            out << ",\n";
+            runMixed<map<int, int> >(out, "std::map", writeFraction, n, work);
+        }
+    }
+    out << "\n  ]\n}\n";
+    return 0;
+}
@@ -1,10 +1,26 @@
 #include <iostream>
 #include <map>
+#include <vector>
+#include <string>
+#include <sstream>
 #include "bst.h"
 #include "avlbst.h"
+#include "interval_tree.h"
+#include "splay_tree.h"
+#include "red_black_tree.h"
+#include "btree.h"
 
 using namespace std;
 
+// An interval value for IntervalEndMember, with no operator<<.
+struct Lease
+{
+    int64_t end;
+    string owner;
+};
+
+// The AVL balance factor lives in the parent pointer's spare bits.
+static_assert(sizeof(AVLNode<int,int>) == sizeof(Node<int,int>), "AVLNode should not add storage to Node");
 
 int main(int argc, char *argv[])
 {
@@ -44,5 +60,221 @@ int main(int argc, char *argv[])
     cout << "Erasing b" << endl;
     at.remove('b');
 
+    // Bulk load tests
+    vector<pair<char,int> > items;
+    for(char c = 'a'; c <= 'g'; ++c) {
+        items.push_back(make_pair(c, c - 'a' + 1));
+    }
+    AVLTree<char,int> bulk(items.begin(), items.end());
+
+    cout << "\nBulk-loaded AVLTree contents:" << endl;
+    for(AVLTree<char,int>::iterator it = bulk.begin(); it != bulk.end(); ++it) {
+        cout << it->first << " " << it->second << endl;
+    }
+    cout << (bulk.isBalanced() ? "Balanced" : "Not balanced") << endl;
+    cout << "Size: " << bulk.size() << endl;
+
+    // Copying keeps the shape, so the copy is balanced as well
+    AVLTree<char,int> bulkCopy(bulk);
+    cout << "Copy: " << (bulkCopy.isBalanced() ? "Balanced" : "Not balanced")
+         << ", size " << bulkCopy.size() << endl;
+
+    // Order-statistic tests
+    AVLTree<int,int,less<int>,NodePool,OrderStatistic> ost;
+    for(int i = 10; i >= 1; --i) {
+        ost.insert(make_pair(i * 10, i));
+    }
+    cout << "\nRank of 35: " << ost.rank(35) << endl;
+    cout << "Element 3: " << ost.select(3)->first << endl;
+    cout << "Median: " << ost.percentile(0.5)->first << endl;
+
+    // Range tests
+    cout << "Keys in [25, 60):";
+    for(AVLTree<int,int>::iterator it = ost.lower_bound(25); it != ost.lower_bound(60); ++it) {
+        cout << " " << it->first;
+    }
+    cout << endl;
+
+    // Heterogeneous lookup: find a string key from a C string without
+    // building a temporary std::string
+    AVLTree<string,int,TransparentLess> st;
+    st.insert(make_pair(string("apple"), 1));
+    st.insert(make_pair(string("banana"), 2));
+    if(st.find("banana") != st.end()) {
+        cout << "\nFound banana" << endl;
+    }
+    else {
+        cout << "\nDid not find banana" << endl;
+    }
+
+    // In-place insertion: the value is built inside the node
+    AVLTree<int, string> vt;
+    vt.try_emplace(1, 3, 'x');
+    vt.insert_or_assign(2, string("yy"));
+    if(!vt.try_emplace(1, 5, 'z').second) {
+        cout << "Key 1 kept " << vt[1] << endl;
+    }
+    AVLTree<int, string> moved(std::move(vt));
+    cout << "Moved tree size: " << moved.size() << ", old size: " << vt.size() << endl;
+
+    // Set operations: merge a delta into a base tree without re-inserting
+    AVLTree<int,int> base, delta;
+    for(int i = 0; i < 10; ++i) {
+        base.insert(make_pair(i, 0));
+        delta.insert(make_pair(i + 5, 1));
+    }
+    base.union_with(delta);
+    cout << "Union size: " << base.size() << ", value at 7: " << base[7]
+         << (base.isBalanced() ? ", balanced" : ", not balanced") << endl;
+
+    // Split off everything below 8, then join it back on
+    pair<AVLTree<int,int>, AVLTree<int,int> > parts = base.split(8);
+    cout << "Split at 8: " << parts.first.size() << " + " << parts.second.size() << endl;
+    parts.first.join(parts.second);
+    cout << "Joined size: " << parts.first.size() << endl;
+
+    // Batches are sorted first, so any order works
+    vector<pair<int,int> > more;
+    for(int i = 30; i > 15; --i) {
+        more.push_back(make_pair(i, 2));
+    }
+    parts.first.insert_batch(more.begin(), more.end());
+    vector<int> gone;
+    for(int i = 0; i < 31; i += 2) {
+        gone.push_back(i);
+    }
+    parts.first.remove_batch(gone.begin(), gone.end());
+    cout << "After batches: " << parts.first.size()
+         << (parts.first.isBalanced() ? ", balanced" : ", not balanced") << endl;
+
+    // A read-only snapshot for lookups
+    FrozenTree<int,int> frozen = parts.first.freeze();
+    cout << "Frozen size: " << frozen.size() << ", first key >= 20: "
+         << frozen.lower_bound(20)->first << endl;
+
+    // The wide-node map has the same interface
+    BTreeMap<int,int> wide;
+    for(int i = 0; i < 1000; ++i) {
+        wide.insert(make_pair(i, i * i));
+    }
+    for(int i = 0; i < 1000; i += 3) {
+        wide.remove(i);
+    }
+    cout << "BTreeMap size: " << wide.size() << ", value at 31: " << wide[31]
+         << ", first key >= 300: " << wide.lower_bound(300)->first << endl;
+
+    // Newest first: walk back from the end
+    cout << "Largest three:";
+    int shown = 0;
+    for(AVLTree<int,int>::reverse_iterator rit = parts.first.rbegin();
+        rit != parts.first.rend() && shown < 3; ++rit, ++shown) {
+        cout << " " << rit->first;
+    }
+    AVLTree<int,int>::iterator last = parts.first.end();
+    --last;
+    cout << ", end()-- is " << last->first << endl;
+
+    // Save to disk and load it back without rebalancing
+    parts.first.save("bst-test.img");
+    AVLTree<int,int> reloaded;
+    reloaded.load("bst-test.img");
+    remove("bst-test.img");
+    cout << "Reloaded size: " << reloaded.size()
+         << (reloaded.isBalanced() ? ", balanced" : ", not balanced") << endl;
+
+    // A full structural audit in one pass
+    TreeReport report = reloaded.validate();
+    cout << "Validate: " << (report.ok() ? "ok" : "corrupt") << ", " << report.nodes
+         << " nodes, height " << report.height << endl;
+
+    // The top two levels as text, then the whole tree as Graphviz DOT
+    reloaded.print(cout, 2);
+    ostringstream dot;
+    reloaded.printDot(dot);
+    cout << "DOT export: " << dot.str().size() << " bytes" << endl;
+
+    // Intervals [start, end) keyed by start, with the end as the value
+    IntervalTree<int, int, IntervalEndValue> bookings;
+    bookings.insert(make_pair(9, 12));
+    bookings.insert(make_pair(10, 11));
+    bookings.insert(make_pair(13, 17));
+    bookings.insert(make_pair(15, 16));
+    cout << "Bookings at 10:";
+    bookings.for_each_containing(10, [](const pair<const int, int>& b) {
+        cout << " [" << b.first << ", " << b.second << ")";
+    });
+    cout << ", first overlapping [11, 14): [" << bookings.first_overlap(11, 14)->first << ", ...)" << endl;
+
+    // An empty booking, or an empty query, overlaps nothing
+    bookings.insert(make_pair(12, 12));
+    cout << "Bookings in [11, 14):";
+    bookings.for_each_overlap(11, 14, [](const pair<const int, int>& b) {
+        cout << " [" << b.first << ", " << b.second << ")";
+    });
+    cout << ", in [14, 14): " << (bookings.first_overlap(14, 14) == bookings.end() ? "none" : "some") << endl;
+
+    // Values holding their end and more, which need no operator<<
+    IntervalTree<int64_t, Lease> leases;
+    leases.insert(make_pair((int64_t)100, Lease{ 200, "alice" }));
+    leases.insert(make_pair((int64_t)150, Lease{ 160, "bob" }));
+    leases.insert(make_pair((int64_t)300, Lease{ 400, "carol" }));
+    cout << "Leases in [155, 310):";
+    leases.for_each_overlap(155, 310, [](const pair<const int64_t, Lease>& l) {
+        cout << ' ' << l.second.owner;
+    });
+    cout << endl;
+
+    // Range sums from subtree aggregates: bytes written per second
+    AVLTree<int, long, less<int>, NodePool, SubtreeAggregate<SumOfValues<long> > > bytes;
+    for(int second = 0; second < 60; ++second) {
+        bytes.insert(make_pair(second, 100L * (second % 7)));
+    }
+    cout << "Bytes in [10, 20): " << bytes.aggregate(10, 20)
+         << ", in [0, 60): " << bytes.aggregate(0, 60) << endl;
+
+    // Nearby keys from a hint: each search climbs only as far as it must
+    AVLTree<int, long>::iterator near = bytes.find(30);
+    near = bytes.find(near, 32);
+    near = bytes.insert(near, make_pair(33, 0L));
+    cout << "Near 30: " << near->first << " then " << bytes.find(near, 29)->first << endl;
+
+    // A splay tree moves every key it finds to the root
+    SplayTree<int, string> recent;
+    for(int id = 1; id <= 7; ++id) {
+        recent.insert(make_pair(id, "page" + to_string(id)));
+    }
+    recent.remove(5);
+    cout << "Splay tree: " << recent.size() << " pages, 6 is " << recent.find(6)->second << endl;
+
+    // A red-black tree, with the colour in the same spare bits
+    RedBlackTree<int, int> colours;
+    for(int i = 1; i <= 100; ++i) {
+        colours.insert(make_pair(i, i * i));
+    }
+    for(int i = 2; i <= 100; i += 2) {
+        colours.remove(i);
+    }
+    TreeReport colourReport = colours.validate();
+    cout << "Red-black tree: " << colours.size() << " keys, height " << colourReport.height
+         << (colourReport.ok() ? ", valid" : ", INVALID") << endl;
+
+    // Batched lookups, answered in the order asked
+    vector<int> wanted = { 7, 8, 99, 1 };
+    vector<RedBlackTree<int, int>::iterator> hits;
+    colours.find_many(wanted, hits);
+    cout << "Find many:";
+    for(size_t i = 0; i < hits.size(); ++i) {
+        cout << ' ' << (hits[i] == colours.end() ? -1 : hits[i]->second);
+    }
+    cout << endl;
+
+    // Hot-path counters, kept when built with -DBST_STATS
+    if(TreeStats::enabled) {
+        TreeStats counts = parts.first.stats();
+        cout << "Searches: " << counts.searches << ", comparisons: " << counts.comparisons
+             << ", rotations: " << counts.rotationsLL + counts.rotationsLR + counts.rotationsRR + counts.rotationsRL
+             << endl;
+    }
+
     return 0;
 }
@@ -5,22 +5,41 @@
 #include <exception>
 #include <cstdlib>
 #include <utility>
+#include <functional> // for std::less
+#include <cstdint>    // for uintptr_t
 #include <algorithm>  // for std::max
 #include <cmath>      // for std::abs
+#include <stdexcept>  // for std::out_of_range
+#include <vector>
+#include <iterator>
+#include <type_traits>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include "node_pool.h"
+#include "frozen_bst.h"
+#include "tree_image.h"
+#include "tree_stats.h"
 
 /**
  * A templated class for a Node in a search tree.
- * The getters for parent/left/right are virtual so
- * that they can be overridden for future kinds of
- * search trees, such as Red Black trees, Splay trees,
- * and AVL trees.
+ * Nothing in a node is virtual, so nodes carry no vtable
+ * pointer and traversal never makes an indirect call.
+ * Future kinds of search trees, such as Red Black trees,
+ * Splay trees, and AVL trees, derive their own node type
+ * and hide the parent/left/right getters with versions
+ * that return that type. They may also keep a few bits of
+ * per-node state (a balance factor or a colour) in the low
+ * bits of the parent pointer, which node alignment leaves
+ * unused, instead of growing the node.
  */
 template <typename Key, typename Value>
 class Node
 {
 public:
     Node(const Key& key, const Value& value, Node<Key, Value>* parent);
-    virtual ~Node();
+    Node(Key&& key, Value&& value, Node<Key, Value>* parent);
+    ~Node();
 
     const std::pair<const Key, Value>& getItem() const;
     std::pair<const Key, Value>& getItem();
@@ -28,18 +47,39 @@ public:
     const Value& getValue() const;
     Value& getValue();
 
-    virtual Node<Key, Value>* getParent() const;
-    virtual Node<Key, Value>* getLeft() const;
-    virtual Node<Key, Value>* getRight() const;
+    Node<Key, Value>* getParent() const;
+    Node<Key, Value>* getLeft() const;
+    Node<Key, Value>* getRight() const;
 
     void setParent(Node<Key, Value>* parent);
     void setLeft(Node<Key, Value>* left);
     void setRight(Node<Key, Value>* right);
     void setValue(const Value &value);
+    void setValue(Value&& value);
+
+    // Called once a bulk-loaded node's children have been built, with the
+    // heights of its two subtrees. Does nothing for a plain Node.
+    void setSubtreeHeights(int leftHeight, int rightHeight);
+
+    // Called when a tree is copied: takes over other's balancing state
+    // (the tag bits) so the copy needs no rebalancing.
+    void copyState(const Node<Key, Value>& other);
+
+    // Called when a tree is saved and loaded: the balancing state as the
+    // number stored with each node in a tree image (see tree_image.h).
+    unsigned saveState() const;
+    void loadState(unsigned state);
 
 protected:
+    // Low bits of parent_ available to subclasses; setParent preserves them.
+    static const uintptr_t TAG_MASK = 3;
+    static_assert(alignof(Node<Key, Value>*) > TAG_MASK, "node pointers must leave two tag bits free");
+
+    unsigned getTag() const;
+    void setTag(unsigned tag);
+
     std::pair<const Key, Value> item_;
-    Node<Key, Value>* parent_;
+    uintptr_t parent_;  // parent pointer, with the tag in its low bits
     Node<Key, Value>* left_;
     Node<Key, Value>* right_;
 };
@@ -56,18 +96,41 @@ protected:
 template<typename Key, typename Value>
 Node<Key, Value>::Node(const Key& key, const Value& value, Node<Key, Value>* parent) :
     item_(key, value),
-    parent_(parent),
+    parent_(reinterpret_cast<uintptr_t>(parent)),
+    left_(nullptr),
+    right_(nullptr)
+{
+}
+
+/**
+* Constructor that moves the key and value into the node.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>::Node(Key&& key, Value&& value, Node<Key, Value>* parent) :
+    item_(std::move(key), std::move(value)),
+    parent_(reinterpret_cast<uintptr_t>(parent)),
     left_(nullptr),
     right_(nullptr)
 {
 }
 
 /**
-* Destructor.
+* Destructor. Also where the layout promised above is checked, since every
+* tree instantiates it: no vtable, and nothing but the item and three
+* pointers, so an int-to-int node takes 32 bytes.
 */
 template<typename Key, typename Value>
 Node<Key, Value>::~Node()
 {
+    struct Layout
+    {
+        std::pair<const Key, Value> item;
+        uintptr_t parent;
+        void* left;
+        void* right;
+    };
+    static_assert(!std::is_polymorphic<Node<Key, Value> >::value, "Node must not have virtual members");
+    static_assert(sizeof(Node<Key, Value>) == sizeof(Layout), "Node must hold only its item and three links");
 }
 
 /**
@@ -121,7 +184,7 @@ Value& Node<Key, Value>::getValue()
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getParent() const
 {
-    return parent_;
+    return reinterpret_cast<Node<Key, Value>*>(parent_ & ~TAG_MASK);
 }
 
 /**
@@ -143,12 +206,12 @@ Node<Key, Value>* Node<Key, Value>::getRight() const
 }
 
 /**
-* Sets the parent pointer.
+* Sets the parent pointer, keeping this node's tag bits.
 */
 template<typename Key, typename Value>
 void Node<Key, Value>::setParent(Node<Key, Value>* parent)
 {
-    parent_ = parent;
+    parent_ = reinterpret_cast<uintptr_t>(parent) | (parent_ & TAG_MASK);
 }
 
 /**
@@ -178,63 +241,359 @@ void Node<Key, Value>::setValue(const Value& value)
     item_.second = value;
 }
 
+/**
+* Moves a new value into the node.
+*/
+template<typename Key, typename Value>
+void Node<Key, Value>::setValue(Value&& value)
+{
+    item_.second = std::move(value);
+}
+
+/**
+* Bulk-load hook; a plain node keeps no height information.
+*/
+template<typename Key, typename Value>
+void Node<Key, Value>::setSubtreeHeights(int, int)
+{
+}
+
+/**
+* Copies the tag bits of other, leaving the parent pointer alone.
+*/
+template<typename Key, typename Value>
+void Node<Key, Value>::copyState(const Node<Key, Value>& other)
+{
+    setTag(other.getTag());
+}
+
+/**
+* Returns the tag bits, which are all the balancing state a node has
+* apart from any augmentation; that can be recomputed from the children.
+*/
+template<typename Key, typename Value>
+unsigned Node<Key, Value>::saveState() const
+{
+    return getTag();
+}
+
+/**
+* Restores the tag bits returned by saveState.
+*/
+template<typename Key, typename Value>
+void Node<Key, Value>::loadState(unsigned state)
+{
+    setTag(state);
+}
+
+/**
+* Returns the tag bits stored alongside the parent pointer.
+*/
+template<typename Key, typename Value>
+unsigned Node<Key, Value>::getTag() const
+{
+    return (unsigned)(parent_ & TAG_MASK);
+}
+
+/**
+* Sets the tag bits stored alongside the parent pointer.
+*/
+template<typename Key, typename Value>
+void Node<Key, Value>::setTag(unsigned tag)
+{
+    parent_ = (parent_ & ~TAG_MASK) | ((uintptr_t)tag & TAG_MASK);
+}
+
 /*
   ---------------------------------------
   End implementations for the Node class.
   ---------------------------------------
 */
 
+/**
+* Keys cheap enough to copy into a register: trivially copyable and no
+* larger than a pointer, as for AVLTree<int, int> and AVLTree<char, int>.
+* Lookups take such keys by value and descend without branching on the
+* comparisons.
+*/
+template<typename Key>
+struct SmallKey : std::integral_constant<bool, std::is_trivially_copyable<Key>::value && sizeof(Key) <= sizeof(void*)>
+{
+};
+
+/**
+* A comparator that orders any two types with operator<. Being transparent,
+* it lets find() take any type comparable with the key, e.g. a const char*
+* for std::string keys, without constructing a temporary Key.
+* (Equivalent to C++14's std::less<>.)
+*/
+struct TransparentLess
+{
+    typedef void is_transparent;
+
+    template<typename A, typename B>
+    bool operator()(const A& a, const B& b) const
+    {
+        return a < b;
+    }
+};
+
+/**
+* What validate() found: counts of each kind of problem, and where the
+* first bad node is in key order, so it can be reached by iteration.
+*/
+struct TreeReport
+{
+    // The per-node problems a tree's checkNode hook can report.
+    static const unsigned STATE_ERROR = 1;
+    static const unsigned BALANCE_ERROR = 2;
+    static const size_t npos = (size_t)-1;
+
+    TreeReport();
+    bool ok() const;
+
+    size_t nodes;           // nodes reached from the root
+    int height;
+    size_t orderErrors;     // nodes not after their in-order predecessor
+    size_t linkErrors;      // children whose parent pointer is wrong
+    size_t stateErrors;     // stored balance or augmentation out of date
+    size_t balanceErrors;   // nodes breaking the tree's balance invariant
+    bool sizeMismatch;      // nodes != size()
+    bool leftmostMismatch;  // cached smallest node is not the smallest
+    bool rightmostMismatch; // cached largest node is not the largest
+    bool truncated;         // more nodes than size(), maybe a cycle; the walk stopped
+    size_t firstError;      // in-order position of the first bad node, or npos
+};
+
+inline TreeReport::TreeReport() :
+    nodes(0),
+    height(0),
+    orderErrors(0),
+    linkErrors(0),
+    stateErrors(0),
+    balanceErrors(0),
+    sizeMismatch(false),
+    leftmostMismatch(false),
+    rightmostMismatch(false),
+    truncated(false),
+    firstError(npos)
+{
+}
+
+inline bool TreeReport::ok() const
+{
+    return orderErrors == 0 && linkErrors == 0 && stateErrors == 0 && balanceErrors == 0 &&
+           !sizeMismatch && !leftmostMismatch && !rightmostMismatch && !truncated;
+}
+
 /**
 * A templated unbalanced binary search tree.
+* Keys are ordered by Compare, a strict weak ordering like std::less.
 */
-template <typename Key, typename Value>
+template <typename Key, typename Value, typename Compare = std::less<Key>, typename Alloc = NodePool>
 class BinarySearchTree
 {
 public:
     BinarySearchTree(); // Constructor
+    explicit BinarySearchTree(const Compare& comp);
+    template<typename InputIterator>
+    BinarySearchTree(InputIterator first, InputIterator last); // Bulk-load constructor
+    BinarySearchTree(const BinarySearchTree& other); // Copy constructor
+    BinarySearchTree(BinarySearchTree&& other); // Move constructor
     virtual ~BinarySearchTree(); // Destructor
+    BinarySearchTree& operator=(const BinarySearchTree& other);
+    BinarySearchTree& operator=(BinarySearchTree&& other);
+    BinarySearchTree clone() const;
     virtual void insert(const std::pair<const Key, Value>& keyValuePair);
+    void insert(std::pair<const Key, Value>&& keyValuePair);
     virtual void remove(const Key& key);
+    template<typename InputIterator>
+    void assign(InputIterator first, InputIterator last);
     void clear();
-    bool isBalanced() const;
+    // The AVL height rule, unless the tree has a balance invariant of its
+    // own, which is then checked instead.
+    virtual bool isBalanced() const;
+    // Checks the whole structure in one iterative pass: key order, parent
+    // links, size and cached end nodes, and for balanced trees the
+    // stored balancing state and invariant. Safe on corrupt trees.
+    TreeReport validate() const;
     void print() const;
+    // Draws the top maxHeight levels (at most PPBST_HEIGHT_LIMIT) to out,
+    // as print() does to std::cout with PPBST_MAX_HEIGHT; see print_bst.h.
+    // Allocates nothing, and walks the printed nodes once per output row.
+    void print(std::ostream& out, unsigned maxHeight) const;
+    // Writes the tree to out as a Graphviz DOT digraph, cut off below
+    // maxHeight levels unless that is 0. Needs no memory of its own, so it
+    // suits trees far too large to draw as text.
+    void printDot(std::ostream& out, unsigned maxHeight = 0) const;
     bool empty() const;
-
-    template<typename PPKey, typename PPValue>
-    friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue> & tree);
+    size_t size() const;
+    // An immutable copy laid out for fast lookups; see frozen_bst.h.
+    FrozenTree<Key, Value, Compare> freeze() const;
+    // Writes the tree to path as a binary image (see tree_image.h). Key and
+    // Value must be trivially copyable. Throws std::runtime_error if the
+    // file cannot be written.
+    void save(const std::string& path) const;
+    // Replaces the contents with the image at path, saved by the same kind
+    // of tree with the same Key and Value types. Throws std::runtime_error
+    // if the file cannot be read or is not such an image, leaving the tree
+    // unchanged, or empty if the image is cut short or malformed.
+    void load(const std::string& path);
+    // Hot-path counters: search comparisons and depths, rotations, node
+    // swaps and allocations. All zero unless compiled with -DBST_STATS,
+    // in which case they cost one atomic add per event (see tree_stats.h).
+    TreeStats stats() const;
+    void resetStats();
+
+    template<typename PPKey, typename PPValue, typename PPCompare, typename PPAlloc>
+    friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue, PPCompare, PPAlloc> & tree);
 public:
     /**
-    * An internal iterator class for traversing the BST.
+    * An internal iterator class for traversing the BST in either direction.
+    * Item is the pair type it yields, const for a const_iterator. Along
+    * with the node it remembers the tree, so that end() can be stepped back.
     */
-    class iterator
+    template<typename Item>
+    class Iterator
     {
     public:
-        iterator();
-
-        std::pair<const Key,Value>& operator*() const;
-        std::pair<const Key,Value>* operator->() const;
-
-        bool operator==(const iterator& rhs) const;
-        bool operator!=(const iterator& rhs) const;
-
-        iterator& operator++();
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef typename std::remove_const<Item>::type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef Item* pointer;
+        typedef Item& reference;
+
+        Iterator();
+        // An iterator converts to a const_iterator.
+        template<typename OtherItem, typename = typename std::enable_if<std::is_convertible<OtherItem*, Item*>::value>::type>
+        Iterator(const Iterator<OtherItem>& other);
+
+        Item& operator*() const;
+        Item* operator->() const;
+
+        template<typename OtherItem>
+        bool operator==(const Iterator<OtherItem>& rhs) const;
+        template<typename OtherItem>
+        bool operator!=(const Iterator<OtherItem>& rhs) const;
+
+        Iterator& operator++();
+        Iterator operator++(int);
+        Iterator& operator--();
+        Iterator operator--(int);
 
     protected:
-        friend class BinarySearchTree<Key, Value>;
-        iterator(Node<Key,Value>* ptr);
+        friend class BinarySearchTree<Key, Value, Compare, Alloc>;
+        template<typename OtherItem> friend class Iterator;
+        Iterator(Node<Key,Value>* ptr, const BinarySearchTree* tree);
         Node<Key, Value>* current_;
+        const BinarySearchTree* tree_;
     };
+    typedef Iterator<std::pair<const Key, Value> > iterator;
+    typedef Iterator<const std::pair<const Key, Value> > const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
 
 public:
-    iterator begin() const;
-    iterator end() const;
-    iterator find(const Key& key) const;
+    // begin() is O(1): the tree keeps track of its smallest node.
+    iterator begin();
+    iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+    reverse_iterator rbegin();
+    reverse_iterator rend();
+    const_reverse_iterator rbegin() const;
+    const_reverse_iterator rend() const;
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    // Heterogeneous lookup, available when Compare is transparent.
+    template<typename LookupKey, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(const LookupKey& key);
+    template<typename LookupKey, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator find(const LookupKey& key) const;
+    // Hinted lookup for clustered keys: the search climbs from hint only
+    // to the lowest node whose subtree spans key, then descends. A key d
+    // places from the hint typically costs O(log d) rather than O(log n),
+    // though a pair that straddles a high node climbs up to it. Any
+    // iterator into this tree is a valid hint, end() standing for the
+    // largest node. A key between the hint and its neighbour costs
+    // amortized O(1), as in std::map.
+    iterator find(const_iterator hint, const Key& key);
+    const_iterator find(const_iterator hint, const Key& key) const;
+    // Batched lookup: out[i] becomes find(keys[i]) for every i. The
+    // searches run FIND_MANY_LANES at a time, interleaved a level at a
+    // step, so their cache misses overlap instead of coming one after
+    // another. Pays off on trees too large for the cache. Never reshapes
+    // the tree, not even a SplayTree.
+    void find_many(const std::vector<Key>& keys, std::vector<iterator>& out);
+    void find_many(const std::vector<Key>& keys, std::vector<const_iterator>& out) const;
     Value& operator[](const Key& key);
     Value const & operator[](const Key& key) const;
 
+    // In-place insertion. Unlike insert, emplace and try_emplace leave an
+    // existing value alone; the bool is true if a new node was added.
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(const Key& key, M&& value);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(Key&& key, M&& value);
+    // Hinted insertion, searching from hint as the hinted find does. As
+    // with std::map, a key next to hint (after the largest node, for end())
+    // is linked in amortized O(1), so sorted runs insert in linear time. As
+    // with insert, an existing key's value is replaced. Returns the item.
+    iterator insert(const_iterator hint, const std::pair<const Key, Value>& keyValuePair);
+    iterator insert(const_iterator hint, std::pair<const Key, Value>&& keyValuePair);
+
+    // Ordered queries: O(log n) to find the start, then O(1) amortized per step.
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key);
+    const_iterator upper_bound(const Key& key) const;
+    std::pair<iterator, iterator> equal_range(const Key& key);
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const;
+    template<typename Function>
+    void for_each_in_range(const Key& lo, const Key& hi, Function fn) const;
+
 protected:
     // Mandatory helper functions
-    Node<Key, Value>* internalFind(const Key& k) const;
+    template<typename LookupKey>
+    Node<Key, Value>* internalFind(const LookupKey& k) const;
+    // internalFind's descent: by reference with branches in general, and by
+    // value with selects for a SmallKey of the tree's own Key type.
+    template<typename LookupKey>
+    Node<Key, Value>* findDescent(const LookupKey& key, std::false_type) const;
+    Node<Key, Value>* findDescent(Key key, std::true_type) const;
+    // How many searches find_many keeps in flight: enough to cover a
+    // memory access with the steps of the others.
+    static const size_t FIND_MANY_LANES = 16;
+    // Runs internalFind for keys[0, count) in lockstep, calling
+    // found(i, node) as the search for keys[i] ends, in no set order.
+    template<typename Found>
+    void findEach(const Key* keys, size_t count, Found found) const;
+    // Wraps a node (or nullptr for end()) in an iterator, for subclasses.
+    iterator iteratorAt(Node<Key, Value>* node) const;
+    // Finds the smallest and largest nodes again after a change that may
+    // have replaced them wholesale; single inserts and removes keep
+    // leftmost_ and rightmost_ themselves.
+    void resetEnds();
+    // First node whose key is not less than / greater than key, or nullptr.
+    Node<Key, Value>* lowerBoundNode(const Key& key) const;
+    Node<Key, Value>* upperBoundNode(const Key& key) const;
+    // Finds key, or the link where it would be inserted.
+    Node<Key, Value>* findSlot(const Key& key, Node<Key, Value>*& parent, bool& isLeft) const;
+    // The same, searching only the subtree of start.
+    Node<Key, Value>* findSlotFrom(Node<Key, Value>* start, const Key& key, Node<Key, Value>*& parent, bool& isLeft) const;
+    // Where to start searching for key given finger, a node whose key is
+    // less than key, or greater if fromAbove (or nullptr): finger's lowest
+    // ancestor-or-self whose subtree spans key.
+    Node<Key, Value>* fingerStart(Node<Key, Value>* finger, const Key& key, bool fromAbove = false) const;
+    // findSlot for a search that starts from hint, a node of this tree or
+    // nullptr for end(), climbing only as far as fingerStart needs to.
+    Node<Key, Value>* findSlotNear(Node<Key, Value>* hint, const Key& key, Node<Key, Value>*& parent, bool& isLeft) const;
     Node<Key, Value>* getSmallestNode() const;
     static Node<Key, Value>* predecessor(Node<Key, Value>* current);
     static Node<Key, Value>* successor(Node<Key, Value>* current);
@@ -242,12 +601,91 @@ protected:
     // Helper function to check subtree height (returns -1 if unbalanced)
     int checkHeight(Node<Key, Value>* node) const;
 
+    // Calls visit(node, leftHeight, rightHeight) for every node of the
+    // subtree in post-order and returns the subtree's height. Iterative,
+    // so it is safe on degenerate trees; visit returns false to stop early,
+    // in which case -1 is returned.
+    template<typename Visit>
+    static int postOrderHeights(Node<Key, Value>* root, Visit visit);
+
+    // Called by validate for every node once its subtrees' heights are
+    // known; returns the TreeReport problem bits for it. A plain BST has
+    // no balancing state, so this returns 0.
+    virtual unsigned checkNode(const Node<Key, Value>* node, int leftHeight, int rightHeight) const;
+    // The rank validate carries up from node, given its left child's rank
+    // (0 for a missing child). The two children of a node must rank the
+    // same, or it has a BALANCE_ERROR, so a tree whose invariant counts
+    // something along every path, as a red-black tree counts black nodes,
+    // is checked in the same pass. A plain BST ranks every node 0.
+    virtual int nodeRank(const Node<Key, Value>* node, int childRank) const;
+
     // Provided helper functions
     virtual void printRoot(Node<Key, Value>* r) const;
+    void printSubtree(std::ostream& out, Node<Key, Value>* r, unsigned maxHeight) const;
     virtual void nodeSwap(Node<Key, Value>* n1, Node<Key, Value>* n2);
 
+    // Node storage. Nodes are placement-constructed in memory obtained from
+    // alloc_ and must be given back through destroyNode/releaseNode.
+    template<typename NodeType, typename KeyArg, typename ValueArg>
+    NodeType* createNode(KeyArg&& key, ValueArg&& value, NodeType* parent);
+    template<typename NodeType>
+    void releaseNode(NodeType* node);
+
+    // Moves key and value into a new node of this tree's node type, links it
+    // in as the isLeft child of parent (or as the root if parent is null),
+    // and restores the tree's invariants. Used by every in-place insertion;
+    // subclasses with their own node type override it.
+    virtual Node<Key, Value>* linkNewNode(Node<Key, Value>* parent, bool isLeft, Key&& key, Value&& value);
+
+    // Called after an existing node's value is replaced in place by insert
+    // or insert_or_assign, for subclasses whose per-node summaries read the
+    // value. A plain BST keeps none, so this does nothing.
+    virtual void valueChanged(Node<Key, Value>* node);
+
+    // Destroys a node of this tree's node type. Subclasses that use their own
+    // node type override this, and must clear() in their own destructor.
+    virtual void destroyNode(Node<Key, Value>* node);
+
+    // Destroys every node in the given subtree.
+    void clearHelper(Node<Key, Value>* node);
+    // Unlinks and destroys node, swapping it with its predecessor first
+    // if it has two children, and keeps leftmost_, rightmost_ and size_.
+    void removeNode(Node<Key, Value>* node);
+
+    // Copying. copyNodes fills the (empty) tree with a structural copy of
+    // other; subclasses with their own node type override it to call
+    // cloneNodes with that type.
+    virtual void copyNodes(const BinarySearchTree& other);
+    template<typename NodeType>
+    void cloneNodes(const BinarySearchTree& other);
+
+    // Loading. loadNodes fills the (empty) tree from count image records;
+    // subclasses with their own node type override it to call readNodes
+    // with that type, and imageKind to say which kind of tree they are.
+    virtual void loadNodes(const char* records, size_t count);
+    template<typename NodeType>
+    void readNodes(const char* records, size_t count);
+    virtual uint32_t imageKind() const;
+
+    // Bulk loading. assignSorted replaces the (empty) tree with items, whose
+    // keys are strictly increasing; subclasses with their own node type
+    // override it to call buildSubtree with that type.
+    virtual void assignSorted(const std::vector<std::pair<Key, Value> >& items);
+    // Batch normalization shared by assign and the batch operations.
+    void sortItems(std::vector<std::pair<Key, Value> >& items) const;
+    void sortKeys(std::vector<Key>& keys) const;
+    template<typename NodeType>
+    int buildSubtree(const std::vector<std::pair<Key, Value> >& items,
+                     size_t lo, size_t hi, NodeType* parent, bool isLeft);
+
 protected:
     Node<Key, Value>* root_;
+    Node<Key, Value>* leftmost_;  // smallest node, or nullptr when empty
+    Node<Key, Value>* rightmost_;  // largest node, or nullptr when empty
+    size_t size_;  // number of nodes, kept by every insert and remove
+    Compare comp_;
+    Alloc alloc_;
+    mutable TreeCounters stats_;  // empty unless BST_STATS is defined
 };
 
 /*
@@ -259,26 +697,43 @@ Begin implementations for the BinarySearchTree::iterator class.
 /**
 * Constructs an iterator from a given node pointer.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator(Node<Key,Value>* ptr)
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+BinarySearchTree<Key, Value, Compare, Alloc>::Iterator<Item>::Iterator(Node<Key,Value>* ptr, const BinarySearchTree* tree)
 {
     current_ = ptr;
+    tree_ = tree;
 }
 
 /**
 * Default constructor for an iterator.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator() 
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+BinarySearchTree<Key, Value, Compare, Alloc>::Iterator<Item>::Iterator()
 {
     current_ = nullptr;
+    tree_ = nullptr;
+}
+
+/**
+* Conversion from an iterator to a const_iterator.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+template<typename OtherItem, typename>
+BinarySearchTree<Key, Value, Compare, Alloc>::Iterator<Item>::Iterator(const Iterator<OtherItem>& other)
+{
+    current_ = other.current_;
+    tree_ = other.tree_;
 }
 
 /**
 * Dereference operator.
 */
-template<class Key, class Value>
-std::pair<const Key,Value>& BinarySearchTree<Key, Value>::iterator::operator*() const
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+Item& BinarySearchTree<Key, Value, Compare, Alloc>::Iterator<Item>::operator*() const
 {
     return current_->getItem();
 }
@@ -286,8 +741,9 @@ std::pair<const Key,Value>& BinarySearchTree<Key, Value>::iterator::operator*()
 /**
 * Arrow operator.
 */
-template<class Key, class Value>
-std::pair<const Key,Value>* BinarySearchTree<Key, Value>::iterator::operator->() const
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+Item* BinarySearchTree<Key, Value, Compare, Alloc>::Iterator<Item>::operator->() const
 {
     return &(current_->getItem());
 }
@@ -295,8 +751,10 @@ std::pair<const Key,Value>* BinarySearchTree<Key, Value>::iterator::operator->()
 /**
 * Equality operator.
 */
-template<class Key, class Value>
-bool BinarySearchTree<Key, Value>::iterator::operator==(const BinarySearchTree<Key, Value>::iterator& rhs) const
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+template<typename OtherItem>
+bool BinarySearchTree<Key, Value, Compare, Alloc>::Iterator<Item>::operator==(const Iterator<OtherItem>& rhs) const
 {
     return current_ == rhs.current_;
 }
@@ -304,8 +762,10 @@ bool BinarySearchTree<Key, Value>::iterator::operator==(const BinarySearchTree<K
 /**
 * Inequality operator.
 */
-template<class Key, class Value>
-bool BinarySearchTree<Key, Value>::iterator::operator!=(const BinarySearchTree<Key, Value>::iterator& rhs) const
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+template<typename OtherItem>
+bool BinarySearchTree<Key, Value, Compare, Alloc>::Iterator<Item>::operator!=(const Iterator<OtherItem>& rhs) const
 {
     return current_ != rhs.current_;
 }
@@ -313,13 +773,53 @@ bool BinarySearchTree<Key, Value>::iterator::operator!=(const BinarySearchTree<K
 /**
 * Pre-increment operator (in-order traversal).
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator& BinarySearchTree<Key, Value>::iterator::operator++()
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::template Iterator<Item>& BinarySearchTree<Key, Value, Compare, Alloc>::Iterator<Item>::operator++()
+{
+    current_ = BinarySearchTree<Key, Value, Compare, Alloc>::successor(current_);
+    return *this;
+}
+
+/**
+* Post-increment operator.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::template Iterator<Item> BinarySearchTree<Key, Value, Compare, Alloc>::Iterator<Item>::operator++(int)
+{
+    Iterator old(*this);
+    ++*this;
+    return old;
+}
+
+/**
+* Pre-decrement operator. Stepping back from end() lands on the largest
+* node, which the tree keeps at hand.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::template Iterator<Item>& BinarySearchTree<Key, Value, Compare, Alloc>::Iterator<Item>::operator--()
 {
-    current_ = BinarySearchTree<Key, Value>::successor(current_);
+    if(current_ == nullptr)
+         current_ = tree_->rightmost_;
+    else
+         current_ = BinarySearchTree<Key, Value, Compare, Alloc>::predecessor(current_);
     return *this;
 }
 
+/**
+* Post-decrement operator.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::template Iterator<Item> BinarySearchTree<Key, Value, Compare, Alloc>::Iterator<Item>::operator--(int)
+{
+    Iterator old(*this);
+    --*this;
+    return old;
+}
+
 /*
 -------------------------------------------------------------
 End implementations for the BinarySearchTree::iterator class.
@@ -335,236 +835,1178 @@ Begin implementations for the BinarySearchTree class.
 /**
 * Constructor initializes the tree as empty.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::BinarySearchTree() 
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::BinarySearchTree() 
 {
     root_ = nullptr;
+    leftmost_ = nullptr;
+    rightmost_ = nullptr;
+    size_ = 0;
 }
 
 /**
-* Destructor clears the tree.
+* Constructor for an empty tree ordered by the given comparator.
 */
-template<typename Key, typename Value>
-BinarySearchTree<Key, Value>::~BinarySearchTree()
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::BinarySearchTree(const Compare& comp) :
+    comp_(comp)
 {
-    clear();
+    root_ = nullptr;
+    leftmost_ = nullptr;
+    rightmost_ = nullptr;
+    size_ = 0;
 }
 
 /**
- * Returns true if the tree is empty.
+* Constructs a height-balanced tree from a range of key/value pairs.
 */
-template<class Key, class Value>
-bool BinarySearchTree<Key, Value>::empty() const
+template<class Key, class Value, class Compare, class Alloc>
+template<typename InputIterator>
+BinarySearchTree<Key, Value, Compare, Alloc>::BinarySearchTree(InputIterator first, InputIterator last)
 {
-    return root_ == nullptr;
+    root_ = nullptr;
+    leftmost_ = nullptr;
+    rightmost_ = nullptr;
+    size_ = 0;
+    assign(first, last);
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::print() const
+/**
+* Copy constructor: copies other's shape node for node, with no comparisons.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::BinarySearchTree(const BinarySearchTree& other) :
+    root_(nullptr),
+    leftmost_(nullptr),
+    rightmost_(nullptr),
+    size_(0),
+    comp_(other.comp_)
 {
-    printRoot(root_);
-    std::cout << "\n";
+    copyNodes(other);
 }
 
 /**
-* Returns an iterator to the smallest item in the tree.
+* Move constructor: takes over other's nodes and leaves it empty.
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator BinarySearchTree<Key, Value>::begin() const
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::BinarySearchTree(BinarySearchTree&& other) :
+    root_(other.root_),
+    leftmost_(other.leftmost_),
+    rightmost_(other.rightmost_),
+    size_(other.size_),
+    comp_(std::move(other.comp_)),
+    alloc_(std::move(other.alloc_))
 {
-    BinarySearchTree<Key, Value>::iterator begin(getSmallestNode());
-    return begin;
+    other.root_ = nullptr;
+    other.leftmost_ = nullptr;
+    other.rightmost_ = nullptr;
+    other.size_ = 0;
 }
 
 /**
-* Returns an iterator representing the end.
+* Copy assignment: frees this tree's nodes, then copies other's.
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator BinarySearchTree<Key, Value>::end() const
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>& BinarySearchTree<Key, Value, Compare, Alloc>::operator=(const BinarySearchTree& other)
 {
-    BinarySearchTree<Key, Value>::iterator end(nullptr);
-    return end;
+    if(this != &other) {
+         clear();
+         comp_ = other.comp_;
+         copyNodes(other);
+    }
+    return *this;
 }
 
 /**
-* Finds the node with the given key and returns an iterator to it.
+* Returns an independent copy of the tree in O(n).
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator BinarySearchTree<Key, Value>::find(const Key & k) const
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc> BinarySearchTree<Key, Value, Compare, Alloc>::clone() const
 {
-    Node<Key, Value>* curr = internalFind(k);
-    BinarySearchTree<Key, Value>::iterator it(curr);
-    return it;
+    return BinarySearchTree(*this);
 }
 
 /**
- * Returns the value associated with the given key.
- * Throws std::out_of_range if the key is not found.
- */
-template<class Key, class Value>
-Value& BinarySearchTree<Key, Value>::operator[](const Key& key)
+* Move assignment: frees this tree's nodes, then takes over other's.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>& BinarySearchTree<Key, Value, Compare, Alloc>::operator=(BinarySearchTree&& other)
 {
-    Node<Key, Value>* curr = internalFind(key);
-    if(curr == nullptr) throw std::out_of_range("Invalid key");
-    return curr->getValue();
+    if(this != &other) {
+         clear();
+         root_ = other.root_;
+         leftmost_ = other.leftmost_;
+         rightmost_ = other.rightmost_;
+         size_ = other.size_;
+         comp_ = std::move(other.comp_);
+         alloc_ = std::move(other.alloc_);
+         other.root_ = nullptr;
+         other.leftmost_ = nullptr;
+         other.rightmost_ = nullptr;
+         other.size_ = 0;
+    }
+    return *this;
 }
 
-template<class Key, class Value>
-Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
+/**
+* Destructor clears the tree.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::~BinarySearchTree()
 {
-    Node<Key, Value>* curr = internalFind(key);
-    if(curr == nullptr) throw std::out_of_range("Invalid key");
-    return curr->getValue();
+    clear();
 }
 
 /**
-* Inserts a key/value pair into the BST.
-* If the key already exists, updates its value.
+ * Returns true if the tree is empty.
 */
-template<class Key, class Value>
-void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+template<class Key, class Value, class Compare, class Alloc>
+bool BinarySearchTree<Key, Value, Compare, Alloc>::empty() const
 {
-    if(root_ == nullptr) {
-         root_ = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, nullptr);
-         return;
-    }
-    Node<Key, Value>* current = root_;
-    Node<Key, Value>* parent = nullptr;
-    while(current != nullptr) {
-         parent = current;
-         if(keyValuePair.first < current->getKey())
-              current = current->getLeft();
-         else if(keyValuePair.first > current->getKey())
-              current = current->getRight();
-         else {
-              // Key exists; update the value.
-              current->setValue(keyValuePair.second);
-              return;
-         }
-    }
-    Node<Key, Value>* newNode = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, parent);
-    if(keyValuePair.first < parent->getKey())
-         parent->setLeft(newNode);
-    else
-         parent->setRight(newNode);
+    return root_ == nullptr;
 }
 
 /**
-* Removes the node with the given key from the BST.
-* If the node has two children, swaps it with its predecessor before removal.
+ * Returns the number of key/value pairs in the tree, in O(1).
 */
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::remove(const Key& key)
+template<class Key, class Value, class Compare, class Alloc>
+size_t BinarySearchTree<Key, Value, Compare, Alloc>::size() const
 {
-    Node<Key, Value>* nodeToRemove = internalFind(key);
-    if(nodeToRemove == nullptr)
-         return;  // Key not found
+    return size_;
+}
 
-    // If node has two children, swap with its predecessor.
-    if(nodeToRemove->getLeft() != nullptr && nodeToRemove->getRight() != nullptr) {
-         Node<Key, Value>* pred = predecessor(nodeToRemove);
-         nodeSwap(nodeToRemove, pred);
-    }
+/**
+ * Copies the items into a FrozenTree in O(n). Later changes to this tree
+ * do not affect the snapshot.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+FrozenTree<Key, Value, Compare> BinarySearchTree<Key, Value, Compare, Alloc>::freeze() const
+{
+    return FrozenTree<Key, Value, Compare>(begin(), end(), comp_);
+}
 
-    // Now nodeToRemove has at most one child.
-    Node<Key, Value>* child = (nodeToRemove->getLeft() != nullptr) ? nodeToRemove->getLeft() : nodeToRemove->getRight();
-    Node<Key, Value>* parent = nodeToRemove->getParent();
+template<typename Key, typename Value, typename Compare, typename Alloc>
+TreeStats BinarySearchTree<Key, Value, Compare, Alloc>::stats() const
+{
+    return stats_.snapshot();
+}
 
-    if(child != nullptr)
-         child->setParent(parent);
-    if(parent == nullptr)
-         root_ = child;
-    else {
-         if(parent->getLeft() == nodeToRemove)
-              parent->setLeft(child);
-         else
-              parent->setRight(child);
-    }
-    delete nodeToRemove;
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::resetStats()
+{
+    stats_.reset();
 }
 
-/**
-* Removes all nodes from the BST.
-*/
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::clear()
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::print() const
 {
-    // clearHelper is defined below.
-    clearHelper(root_);
-    root_ = nullptr;
+    printRoot(root_);
+    std::cout << "\n";
 }
 
 /**
-* Returns true if the BST is balanced.
-* (A balanced tree has the height difference between left and right subtrees ≤ 1 at every node.)
+* Returns an iterator to the smallest item in the tree.
 */
-template<typename Key, typename Value>
-bool BinarySearchTree<Key, Value>::isBalanced() const
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator BinarySearchTree<Key, Value, Compare, Alloc>::begin()
 {
-    return (checkHeight(root_) != -1);
+    return iterator(leftmost_, this);
 }
 
 /**
-* Returns the smallest node in the BST.
+* Returns an iterator representing the end.
 */
-template<typename Key, typename Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::getSmallestNode() const
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator BinarySearchTree<Key, Value, Compare, Alloc>::end()
 {
-    Node<Key, Value>* current = root_;
-    if(current == nullptr)
-         return nullptr;
-    while(current->getLeft() != nullptr)
-         current = current->getLeft();
-    return current;
+    return iterator(nullptr, this);
 }
 
-/**
-* Finds and returns the node with the given key.
-* Returns nullptr if not found.
-*/
-template<typename Key, typename Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::internalFind(const Key& key) const
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator BinarySearchTree<Key, Value, Compare, Alloc>::begin() const
 {
-    Node<Key, Value>* current = root_;
-    while(current != nullptr) {
-         if(key < current->getKey())
-              current = current->getLeft();
-         else if(key > current->getKey())
-              current = current->getRight();
-         else
-              return current;
-    }
-    return nullptr;
+    return const_iterator(leftmost_, this);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator BinarySearchTree<Key, Value, Compare, Alloc>::end() const
+{
+    return const_iterator(nullptr, this);
 }
 
 /**
-* Returns the predecessor of the given node (in-order).
+* Reverse iteration, from the largest item down.
 */
-template<class Key, class Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::reverse_iterator BinarySearchTree<Key, Value, Compare, Alloc>::rbegin()
 {
-    if(current == nullptr)
-         return nullptr;
-    if(current->getLeft() != nullptr) {
-         Node<Key, Value>* temp = current->getLeft();
-         while(temp->getRight() != nullptr)
-              temp = temp->getRight();
-         return temp;
-    } else {
-         Node<Key, Value>* parent = current->getParent();
-         while(parent != nullptr && current == parent->getLeft()) {
-              current = parent;
-              parent = parent->getParent();
-         }
-         return parent;
-    }
+    return reverse_iterator(end());
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::reverse_iterator BinarySearchTree<Key, Value, Compare, Alloc>::rend()
+{
+    return reverse_iterator(begin());
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_reverse_iterator BinarySearchTree<Key, Value, Compare, Alloc>::rbegin() const
+{
+    return const_reverse_iterator(end());
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_reverse_iterator BinarySearchTree<Key, Value, Compare, Alloc>::rend() const
+{
+    return const_reverse_iterator(begin());
 }
 
 /**
-* Returns the successor of the given node (in-order).
+* Finds the node with the given key and returns an iterator to it.
 */
-template<class Key, class Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::successor(Node<Key, Value>* current)
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator BinarySearchTree<Key, Value, Compare, Alloc>::find(const Key & k)
+{
+    return iteratorAt(internalFind(k));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator BinarySearchTree<Key, Value, Compare, Alloc>::find(const Key & k) const
+{
+    return const_iterator(internalFind(k), this);
+}
+
+/**
+* Finds key, starting the search from hint (see findSlotNear).
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::find(const_iterator hint, const Key& key)
+{
+    Node<Key, Value>* parent = nullptr;
+    bool isLeft = false;
+    return iteratorAt(findSlotNear(hint.current_, key, parent, isLeft));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::find(const_iterator hint, const Key& key) const
+{
+    return const_cast<BinarySearchTree*>(this)->find(hint, key);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator BinarySearchTree<Key, Value, Compare, Alloc>::iteratorAt(Node<Key, Value>* node) const
+{
+    return iterator(node, this);
+}
+
+/**
+* Finds the node whose key is equivalent to k under the transparent comparator.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename LookupKey, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator BinarySearchTree<Key, Value, Compare, Alloc>::find(const LookupKey & k)
+{
+    return iteratorAt(internalFind(k));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename LookupKey, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator BinarySearchTree<Key, Value, Compare, Alloc>::find(const LookupKey & k) const
+{
+    return const_iterator(internalFind(k), this);
+}
+
+/**
+ * Returns the value associated with the given key.
+ * Throws std::out_of_range if the key is not found.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+Value& BinarySearchTree<Key, Value, Compare, Alloc>::operator[](const Key& key)
+{
+    Node<Key, Value>* curr = internalFind(key);
+    if(curr == nullptr) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+Value const & BinarySearchTree<Key, Value, Compare, Alloc>::operator[](const Key& key) const
+{
+    Node<Key, Value>* curr = internalFind(key);
+    if(curr == nullptr) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+
+/**
+* Returns an iterator to the first item whose key is not less than key,
+* or end() if there is none.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator BinarySearchTree<Key, Value, Compare, Alloc>::lower_bound(const Key& key)
+{
+    return iteratorAt(lowerBoundNode(key));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator BinarySearchTree<Key, Value, Compare, Alloc>::lower_bound(const Key& key) const
+{
+    return const_iterator(lowerBoundNode(key), this);
+}
+
+/**
+* Returns an iterator to the first item whose key is greater than key,
+* or end() if there is none.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator BinarySearchTree<Key, Value, Compare, Alloc>::upper_bound(const Key& key)
+{
+    return iteratorAt(upperBoundNode(key));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator BinarySearchTree<Key, Value, Compare, Alloc>::upper_bound(const Key& key) const
+{
+    return const_iterator(upperBoundNode(key), this);
+}
+
+/**
+* Returns the range of items whose key is equivalent to key; since keys
+* are unique it holds at most one item.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator>
+BinarySearchTree<Key, Value, Compare, Alloc>::equal_range(const Key& key)
+{
+    Node<Key, Value>* first = lowerBoundNode(key);
+    Node<Key, Value>* last = first;
+    if(last != nullptr && !comp_(key, last->getKey()))
+         last = successor(last);
+    return std::make_pair(iteratorAt(first), iteratorAt(last));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator, typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator>
+BinarySearchTree<Key, Value, Compare, Alloc>::equal_range(const Key& key) const
+{
+    std::pair<iterator, iterator> range = const_cast<BinarySearchTree*>(this)->equal_range(key);
+    return std::make_pair(const_iterator(range.first), const_iterator(range.second));
+}
+
+/**
+* Calls fn with each item whose key is in [lo, hi), in order.
+* Costs O(log n + k) for k visited items.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Function>
+void BinarySearchTree<Key, Value, Compare, Alloc>::for_each_in_range(const Key& lo, const Key& hi, Function fn) const
+{
+    for(Node<Key, Value>* current = lowerBoundNode(lo);
+        current != nullptr && comp_(current->getKey(), hi);
+        current = successor(current)) {
+         fn(current->getItem());
+    }
+}
+
+/**
+* Inserts a key/value pair into the BST.
+* If the key already exists, updates its value.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    Node<Key, Value>* parent = nullptr;
+    bool isLeft = false;
+    Node<Key, Value>* existing = findSlot(keyValuePair.first, parent, isLeft);
+    if(existing != nullptr) {
+         // Key exists; update the value.
+         existing->setValue(keyValuePair.second);
+         valueChanged(existing);
+         return;
+    }
+    Node<Key, Value>* newNode = createNode(keyValuePair.first, keyValuePair.second, parent);
+    ++size_;
+    if(parent == nullptr)
+         root_ = newNode;
+    else if(isLeft)
+         parent->setLeft(newNode);
+    else
+         parent->setRight(newNode);
+    if(parent == leftmost_ && isLeft == (parent != nullptr))
+         leftmost_ = newNode;
+    if(parent == rightmost_ && !isLeft)
+         rightmost_ = newNode;
+}
+
+/**
+* Inserts a key/value pair, moving the value into the tree.
+* If the key already exists, its value is replaced.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::insert(std::pair<const Key, Value>&& keyValuePair)
+{
+    insert_or_assign(keyValuePair.first, std::move(keyValuePair.second));
+}
+
+/**
+* Constructs a key/value pair from args and inserts it if its key is not
+* already present. The pair is moved into the new node.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::emplace(Args&&... args)
+{
+    std::pair<Key, Value> item(std::forward<Args>(args)...);
+    return try_emplace(std::move(item.first), std::move(item.second));
+}
+
+/**
+* Inserts key with a value constructed from args, unless key is already
+* present, in which case nothing (not even the value) is constructed.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::try_emplace(const Key& key, Args&&... args)
+{
+    Node<Key, Value>* parent = nullptr;
+    bool isLeft = false;
+    Node<Key, Value>* existing = findSlot(key, parent, isLeft);
+    if(existing != nullptr)
+         return std::make_pair(iteratorAt(existing), false);
+    Node<Key, Value>* newNode = linkNewNode(parent, isLeft, Key(key), Value(std::forward<Args>(args)...));
+    return std::make_pair(iteratorAt(newNode), true);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::try_emplace(Key&& key, Args&&... args)
+{
+    Node<Key, Value>* parent = nullptr;
+    bool isLeft = false;
+    Node<Key, Value>* existing = findSlot(key, parent, isLeft);
+    if(existing != nullptr)
+         return std::make_pair(iteratorAt(existing), false);
+    Node<Key, Value>* newNode = linkNewNode(parent, isLeft, std::move(key), Value(std::forward<Args>(args)...));
+    return std::make_pair(iteratorAt(newNode), true);
+}
+
+/**
+* Inserts key with the given value, or assigns the value to an existing key.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename M>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::insert_or_assign(const Key& key, M&& value)
+{
+    Node<Key, Value>* parent = nullptr;
+    bool isLeft = false;
+    Node<Key, Value>* existing = findSlot(key, parent, isLeft);
+    if(existing != nullptr) {
+         existing->getValue() = std::forward<M>(value);
+         valueChanged(existing);
+         return std::make_pair(iteratorAt(existing), false);
+    }
+    Node<Key, Value>* newNode = linkNewNode(parent, isLeft, Key(key), Value(std::forward<M>(value)));
+    return std::make_pair(iteratorAt(newNode), true);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename M>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::insert_or_assign(Key&& key, M&& value)
+{
+    Node<Key, Value>* parent = nullptr;
+    bool isLeft = false;
+    Node<Key, Value>* existing = findSlot(key, parent, isLeft);
+    if(existing != nullptr) {
+         existing->getValue() = std::forward<M>(value);
+         valueChanged(existing);
+         return std::make_pair(iteratorAt(existing), false);
+    }
+    Node<Key, Value>* newNode = linkNewNode(parent, isLeft, std::move(key), Value(std::forward<M>(value)));
+    return std::make_pair(iteratorAt(newNode), true);
+}
+
+/**
+* Inserts a key/value pair, searching from hint, or updates the value if
+* the key already exists.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::insert(const_iterator hint, const std::pair<const Key, Value>& keyValuePair)
+{
+    Node<Key, Value>* parent = nullptr;
+    bool isLeft = false;
+    Node<Key, Value>* existing = findSlotNear(hint.current_, keyValuePair.first, parent, isLeft);
+    if(existing != nullptr) {
+         existing->setValue(keyValuePair.second);
+         valueChanged(existing);
+         return iteratorAt(existing);
+    }
+    return iteratorAt(linkNewNode(parent, isLeft, Key(keyValuePair.first), Value(keyValuePair.second)));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::insert(const_iterator hint, std::pair<const Key, Value>&& keyValuePair)
+{
+    Node<Key, Value>* parent = nullptr;
+    bool isLeft = false;
+    Node<Key, Value>* existing = findSlotNear(hint.current_, keyValuePair.first, parent, isLeft);
+    if(existing != nullptr) {
+         existing->setValue(std::move(keyValuePair.second));
+         valueChanged(existing);
+         return iteratorAt(existing);
+    }
+    return iteratorAt(linkNewNode(parent, isLeft, Key(keyValuePair.first), std::move(keyValuePair.second)));
+}
+
+/**
+* Removes the node with the given key from the BST.
+* If the node has two children, swaps it with its predecessor before removal.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::remove(const Key& key)
+{
+    Node<Key, Value>* nodeToRemove = internalFind(key);
+    if(nodeToRemove == nullptr)
+         return;  // Key not found
+    removeNode(nodeToRemove);
+}
+
+/**
+* Unlinks and destroys a node of this tree.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::removeNode(Node<Key, Value>* nodeToRemove)
+{
+    // If node has two children, swap with its predecessor.
+    if(nodeToRemove->getLeft() != nullptr && nodeToRemove->getRight() != nullptr) {
+         Node<Key, Value>* pred = predecessor(nodeToRemove);
+         nodeSwap(nodeToRemove, pred);
+    }
+
+    // Now nodeToRemove has at most one child.
+    if(nodeToRemove == leftmost_)
+         leftmost_ = successor(nodeToRemove);
+    if(nodeToRemove == rightmost_)
+         rightmost_ = predecessor(nodeToRemove);
+    Node<Key, Value>* child = (nodeToRemove->getLeft() != nullptr) ? nodeToRemove->getLeft() : nodeToRemove->getRight();
+    Node<Key, Value>* parent = nodeToRemove->getParent();
+
+    if(child != nullptr)
+         child->setParent(parent);
+    if(parent == nullptr)
+         root_ = child;
+    else {
+         if(parent->getLeft() == nodeToRemove)
+              parent->setLeft(child);
+         else
+              parent->setRight(child);
+    }
+    destroyNode(nodeToRemove);
+    --size_;
+}
+
+/**
+* Replaces the contents of the tree with the key/value pairs in [first, last),
+* building a height-balanced tree directly in O(n) when the keys are sorted.
+* Unsorted input is sorted first. As with insert, a later pair with the same
+* key as an earlier one overrides its value.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename InputIterator>
+void BinarySearchTree<Key, Value, Compare, Alloc>::assign(InputIterator first, InputIterator last)
+{
+    std::vector<std::pair<Key, Value> > items(first, last);
+    sortItems(items);
+    clear();
+    try {
+         assignSorted(items);
+         size_ = items.size();
+         resetEnds();
+    }
+    catch(...) {
+         clear();
+         throw;
+    }
+}
+
+/**
+* Sorts items by key unless they already are strictly increasing, and drops
+* duplicate keys, keeping the last value given for each as insert would.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::sortItems(std::vector<std::pair<Key, Value> >& items) const
+{
+    bool sorted = true;
+    for(size_t i = 1; i < items.size() && sorted; ++i) {
+         if(!comp_(items[i - 1].first, items[i].first))
+              sorted = false;
+    }
+    if(sorted)
+         return;
+    // Stable, so equal keys stay in input order and the last one wins.
+    const Compare& comp = comp_;
+    std::stable_sort(items.begin(), items.end(),
+         [&comp](const std::pair<Key, Value>& a, const std::pair<Key, Value>& b) { return comp(a.first, b.first); });
+    size_t kept = 0;
+    for(size_t i = 0; i < items.size(); ++i) {
+         if(kept > 0 && !comp_(items[kept - 1].first, items[i].first))
+              items[kept - 1].second = std::move(items[i].second);
+         else if(kept++ != i)
+              items[kept - 1] = std::move(items[i]);
+    }
+    items.resize(kept);
+}
+
+/**
+* Sorts keys unless they already are strictly increasing, and drops duplicates.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::sortKeys(std::vector<Key>& keys) const
+{
+    bool sorted = true;
+    for(size_t i = 1; i < keys.size() && sorted; ++i) {
+         if(!comp_(keys[i - 1], keys[i]))
+              sorted = false;
+    }
+    if(sorted)
+         return;
+    std::sort(keys.begin(), keys.end(), comp_);
+    size_t kept = 0;
+    for(size_t i = 0; i < keys.size(); ++i) {
+         if(kept == 0 || comp_(keys[kept - 1], keys[i])) {
+              if(kept != i)
+                   keys[kept] = std::move(keys[i]);
+              ++kept;
+         }
+    }
+    keys.erase(keys.begin() + kept, keys.end());
+}
+
+/**
+* Removes all nodes from the BST and hands the allocator's memory back.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::clear()
+{
+    clearHelper(root_);
+    root_ = nullptr;
+    leftmost_ = nullptr;
+    rightmost_ = nullptr;
+    size_ = 0;
+    alloc_.release();
+}
+
+/**
+* Returns true if the BST is balanced.
+* (A balanced tree has the height difference between left and right subtrees ≤ 1 at every node.)
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+bool BinarySearchTree<Key, Value, Compare, Alloc>::isBalanced() const
+{
+    return (checkHeight(root_) != -1);
+}
+
+/**
+* Walks down from the root along child pointers only, with an explicit
+* stack, so a bad parent pointer is reported rather than followed and a
+* degenerate tree cannot overflow the call stack. Each node is seen in
+* order, once its left subtree is done, to check it against its
+* predecessor, and again once its right subtree is done, to check it
+* against the heights. The walk stops after size() + 1 nodes, which it can
+* only reach if the links are corrupt.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+TreeReport BinarySearchTree<Key, Value, Compare, Alloc>::validate() const
+{
+    enum Stage { GO_LEFT, GO_RIGHT, FINISH };
+    struct Frame
+    {
+        const Node<Key, Value>* node;
+        Stage stage;
+        bool badLink;       // its parent pointer is wrong
+        size_t position;    // in-order position, known from GO_RIGHT on
+        int leftHeight;
+        int rightHeight;
+        int leftRank;
+        int rightRank;
+    };
+    TreeReport report;
+    std::vector<Frame> stack;
+    const Node<Key, Value>* previous = nullptr;
+    size_t position = 0;
+    if(root_ != nullptr) {
+         Frame frame = { root_, GO_LEFT, root_->getParent() != nullptr, 0, 0, 0, 0, 0 };
+         stack.push_back(frame);
+         report.nodes = 1;
+    }
+    while(!stack.empty() && !report.truncated) {
+         Frame& frame = stack.back();
+         const Node<Key, Value>* node = frame.node;
+         const Node<Key, Value>* child = nullptr;
+         if(frame.stage == GO_LEFT) {
+              frame.stage = GO_RIGHT;
+              child = node->getLeft();
+         }
+         else if(frame.stage == GO_RIGHT) {
+              frame.stage = FINISH;
+              frame.position = position++;
+              if(frame.badLink) {
+                   ++report.linkErrors;
+                   report.firstError = std::min(report.firstError, frame.position);
+              }
+              if(previous == nullptr)
+                   report.leftmostMismatch = (node != leftmost_);
+              else if(!comp_(previous->getKey(), node->getKey())) {
+                   ++report.orderErrors;
+                   report.firstError = std::min(report.firstError, frame.position);
+              }
+              previous = node;
+              child = node->getRight();
+         }
+         else {
+              unsigned problems = checkNode(node, frame.leftHeight, frame.rightHeight);
+              if(frame.leftRank != frame.rightRank)
+                   problems |= TreeReport::BALANCE_ERROR;
+              int rank = nodeRank(node, frame.leftRank);
+              if(problems & TreeReport::STATE_ERROR)
+                   ++report.stateErrors;
+              if(problems & TreeReport::BALANCE_ERROR)
+                   ++report.balanceErrors;
+              if(problems != 0)
+                   report.firstError = std::min(report.firstError, frame.position);
+              int height = std::max(frame.leftHeight, frame.rightHeight) + 1;
+              stack.pop_back();
+              if(stack.empty())
+                   report.height = height;
+              else if(stack.back().stage == GO_RIGHT) {
+                   stack.back().leftHeight = height;
+                   stack.back().leftRank = rank;
+              }
+              else {
+                   stack.back().rightHeight = height;
+                   stack.back().rightRank = rank;
+              }
+              continue;
+         }
+         if(child != nullptr) {
+              if(report.nodes == size_) {
+                   report.truncated = true;
+                   continue;
+              }
+              ++report.nodes;
+              Frame next = { child, GO_LEFT, child->getParent() != node, 0, 0, 0, 0, 0 };
+              stack.push_back(next);
+         }
+    }
+    if(root_ == nullptr)
+         report.leftmostMismatch = (leftmost_ != nullptr);
+    if(!report.truncated)
+         report.rightmostMismatch = (previous != rightmost_);
+    report.sizeMismatch = report.truncated || report.nodes != size_;
+    return report;
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+unsigned BinarySearchTree<Key, Value, Compare, Alloc>::checkNode(const Node<Key, Value>*, int, int) const
+{
+    return 0;
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+int BinarySearchTree<Key, Value, Compare, Alloc>::nodeRank(const Node<Key, Value>*, int) const
+{
+    return 0;
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::resetEnds()
+{
+    leftmost_ = getSmallestNode();
+    rightmost_ = root_;
+    while(rightmost_ != nullptr && rightmost_->getRight() != nullptr)
+         rightmost_ = rightmost_->getRight();
+}
+
+/**
+* Returns the smallest node in the BST.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::getSmallestNode() const
+{
+    Node<Key, Value>* current = root_;
+    if(current == nullptr)
+         return nullptr;
+    while(current->getLeft() != nullptr)
+         current = current->getLeft();
+    return current;
+}
+
+/**
+* Finds and returns the node with the given key.
+* Returns nullptr if not found.
+*
+* Makes one comparison per level: since comp_ only answers "less than",
+* telling less, equal and greater apart would take two calls. Instead the
+* search goes right whenever key is not less than the node, remembering
+* the last such node, and checks that candidate for equality once at the
+* bottom.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename LookupKey>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::internalFind(const LookupKey& key) const
+{
+    typedef std::integral_constant<bool, std::is_same<LookupKey, Key>::value && SmallKey<Key>::value> Small;
+    return findDescent(key, Small());
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename LookupKey>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::findDescent(const LookupKey& key, std::false_type) const
+{
+    Node<Key, Value>* current = root_;
+    Node<Key, Value>* candidate = nullptr;
+    size_t depth = 0;
+    while(current != nullptr) {
+         ++depth;
+         if(comp_(key, current->getKey()))
+              current = current->getLeft();
+         else {
+              candidate = current;
+              current = current->getRight();
+         }
+    }
+    stats_.countSearch(depth, depth + (candidate != nullptr));
+    if(candidate != nullptr && !comp_(candidate->getKey(), key))
+         return candidate;
+    return nullptr;
+}
+
+/**
+* The same descent with the comparison turned into a mask that picks the
+* next node and the candidate, so the loop has no branch that depends on
+* the keys and a random search is never mispredicted. Compilers will not
+* reliably turn the ternaries of the general version into conditional
+* moves, so the selects are written out in integer arithmetic.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::findDescent(Key key, std::true_type) const
+{
+    uintptr_t current = (uintptr_t)root_;
+    uintptr_t candidate = 0;
+    size_t depth = 0;
+    while(current != 0) {
+         ++depth;
+         Node<Key, Value>* node = (Node<Key, Value>*)current;
+         // all ones when the search goes left, zero when it goes right
+         uintptr_t goLeft = (uintptr_t)0 - (uintptr_t)static_cast<bool>(comp_(key, node->getKey()));
+         candidate = (candidate & goLeft) | (current & ~goLeft);
+         current = ((uintptr_t)node->getLeft() & goLeft) | ((uintptr_t)node->getRight() & ~goLeft);
+    }
+    Node<Key, Value>* match = (Node<Key, Value>*)candidate;
+    stats_.countSearch(depth, depth + (match != nullptr));
+    if(match != nullptr && !comp_(match->getKey(), key))
+         return match;
+    return nullptr;
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::find_many(const std::vector<Key>& keys, std::vector<iterator>& out)
+{
+    out.resize(keys.size());
+    findEach(keys.data(), keys.size(), [&](size_t i, Node<Key, Value>* node) {
+         out[i] = iteratorAt(node);
+    });
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::find_many(const std::vector<Key>& keys, std::vector<const_iterator>& out) const
+{
+    out.resize(keys.size());
+    findEach(keys.data(), keys.size(), [&](size_t i, Node<Key, Value>* node) {
+         out[i] = const_iterator(node, this);
+    });
+}
+
+/**
+* Each lane holds one search, making the same one comparison per level as
+* internalFind. A round takes every lane one level down and prefetches
+* the node it lands on, which is not read again until the other lanes
+* have had their turn. A lane whose search has ended takes the next key,
+* so lanes stay busy however the search depths differ; once the keys run
+* out, the last lane moves into its place.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename Found>
+void BinarySearchTree<Key, Value, Compare, Alloc>::findEach(const Key* keys, size_t count, Found found) const
+{
+    Node<Key, Value>* current[FIND_MANY_LANES];
+    Node<Key, Value>* candidate[FIND_MANY_LANES];
+    size_t index[FIND_MANY_LANES];
+    size_t depth[FIND_MANY_LANES];
+    size_t lanes = (count < FIND_MANY_LANES) ? count : FIND_MANY_LANES;
+    size_t next = 0;
+    for(size_t lane = 0; lane < lanes; ++lane) {
+         current[lane] = root_;
+         candidate[lane] = nullptr;
+         index[lane] = next++;
+         depth[lane] = 0;
+    }
+    while(lanes > 0) {
+         for(size_t lane = 0; lane < lanes; ) {
+              Node<Key, Value>* node = current[lane];
+              const Key& key = keys[index[lane]];
+              if(node != nullptr) {
+                   ++depth[lane];
+                   if(comp_(key, node->getKey()))
+                        node = node->getLeft();
+                   else {
+                        candidate[lane] = node;
+                        node = node->getRight();
+                   }
+#if defined(__GNUC__)
+                   // Prefetching a null child is a harmless hint.
+                   __builtin_prefetch(node);
+#endif
+                   current[lane] = node;
+                   ++lane;
+                   continue;
+              }
+              Node<Key, Value>* match = candidate[lane];
+              stats_.countSearch(depth[lane], depth[lane] + (match != nullptr));
+              if(match != nullptr && comp_(match->getKey(), key))
+                   match = nullptr;
+              found(index[lane], match);
+              if(next < count) {
+                   current[lane] = root_;
+                   candidate[lane] = nullptr;
+                   index[lane] = next++;
+                   depth[lane] = 0;
+                   ++lane;
+              }
+              else {
+                   --lanes;
+                   current[lane] = current[lanes];
+                   candidate[lane] = candidate[lanes];
+                   index[lane] = index[lanes];
+                   depth[lane] = depth[lanes];
+              }
+         }
+    }
+}
+
+/**
+* Descends from the root to the first node whose key is not less than key,
+* using one comparison per level.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::lowerBoundNode(const Key& key) const
+{
+    Node<Key, Value>* current = root_;
+    Node<Key, Value>* result = nullptr;
+    while(current != nullptr) {
+         if(comp_(current->getKey(), key))
+              current = current->getRight();
+         else {
+              result = current;
+              current = current->getLeft();
+         }
+    }
+    return result;
+}
+
+/**
+* Descends from the root to the first node whose key is greater than key.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::upperBoundNode(const Key& key) const
+{
+    Node<Key, Value>* current = root_;
+    Node<Key, Value>* result = nullptr;
+    while(current != nullptr) {
+         if(comp_(key, current->getKey())) {
+              result = current;
+              current = current->getLeft();
+         }
+         else
+              current = current->getRight();
+    }
+    return result;
+}
+
+/**
+* Like internalFind, but when key is absent also reports where it belongs:
+* parent is the node a new node would hang from (nullptr for an empty tree)
+* and isLeft tells on which side.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::findSlot(const Key& key, Node<Key, Value>*& parent, bool& isLeft) const
+{
+    return findSlotFrom(root_, key, parent, isLeft);
+}
+
+/**
+* Like findSlot, but starts the descent at start, whose subtree must be
+* where key belongs.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::findSlotFrom(Node<Key, Value>* start, const Key& key, Node<Key, Value>*& parent, bool& isLeft) const
+{
+    // The descent works on locals, which stay in registers even where this
+    // is not inlined, and only stores the slot once it is found.
+    Node<Key, Value>* current = start;
+    Node<Key, Value>* candidate = nullptr;
+    Node<Key, Value>* last = nullptr;
+    bool left = false;
+    size_t depth = 0;
+    while(current != nullptr) {
+         ++depth;
+         last = current;
+         left = comp_(key, current->getKey());
+         if(left) {
+              current = current->getLeft();
+         }
+         else {
+              candidate = current;
+              current = current->getRight();
+         }
+    }
+    parent = last;
+    isLeft = left;
+    stats_.countSearch(depth, depth + (candidate != nullptr));
+    if(candidate != nullptr && !comp_(candidate->getKey(), key))
+         return candidate;
+    return nullptr;
+}
+
+/**
+* A node's subtree spans every key between its lower and its upper bound.
+* The lower bounds of finger and its ancestors are all below finger's key,
+* so only the upper bounds matter. All nodes on a chain of right-child
+* links share one upper bound, the key of the parent above the chain's top
+* (none if the chain reaches the root), and the node the climb entered the
+* chain at is the lowest on it. So the climb goes on while the parents'
+* keys are not above key, moving the entry up at every left-child link,
+* and the first parent above key bounds the chain the entry is on. That
+* parent is always reached from its left, so the loop's one test, whose
+* answer only changes once, decides it. From above, the same holds with
+* left and right, and upper and lower, swapped.
+*
+* Before any of that comes the check std::map makes, since it costs one
+* comparison: a key no later than finger's right child's is bounded by
+* finger's own subtree, whose bound is above that child. Without a right
+* child the climb itself meets finger's successor first, at the top of the
+* chain, and stops there if key comes before it; that climb is the
+* amortized O(1) step std::map pays to find the successor.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::fingerStart(Node<Key, Value>* finger, const Key& key, bool fromAbove) const
+{
+    if(finger == nullptr)
+         return root_;
+    Node<Key, Value>* near = fromAbove ? finger->getLeft() : finger->getRight();
+    if(near != nullptr && (fromAbove ? !comp_(key, near->getKey()) : !comp_(near->getKey(), key)))
+         return finger;
+    Node<Key, Value>* entry = finger;
+    Node<Key, Value>* node = finger;
+    Node<Key, Value>* parent = node->getParent();
+    if(fromAbove) {
+         while(parent != nullptr && !comp_(parent->getKey(), key)) {
+              entry = (parent->getRight() == node) ? parent : entry;
+              node = parent;
+              parent = node->getParent();
+         }
+    }
+    else {
+         while(parent != nullptr && !comp_(key, parent->getKey())) {
+              entry = (parent->getLeft() == node) ? parent : entry;
+              node = parent;
+              parent = node->getParent();
+         }
+    }
+    return entry;
+}
+
+/**
+* A hint holding key itself is answered without a descent; otherwise the
+* search starts as low as the hint's side of key allows. A key past either
+* end of the tree, next to leftmost_ or rightmost_, is linked directly: an
+* end() hint stands for the rightmost node, which would otherwise climb
+* its whole right spine, and in a tree built by appending, that spine is
+* the whole tree.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::findSlotNear(Node<Key, Value>* hint, const Key& key, Node<Key, Value>*& parent, bool& isLeft) const
+{
+    if(hint == nullptr) {
+         if(rightmost_ == nullptr) {
+              parent = nullptr;
+              isLeft = false;
+              return nullptr;
+         }
+         hint = rightmost_;
+    }
+    Node<Key, Value>* start = nullptr;
+    if(comp_(hint->getKey(), key)) {
+         if(hint == rightmost_) {
+              stats_.countSearch(0, 1);
+              parent = hint;
+              isLeft = false;
+              return nullptr;
+         }
+         start = fingerStart(hint, key, false);
+    }
+    else if(comp_(key, hint->getKey())) {
+         if(hint == leftmost_) {
+              stats_.countSearch(0, 2);
+              parent = hint;
+              isLeft = true;
+              return nullptr;
+         }
+         start = fingerStart(hint, key, true);
+    }
+    else {
+         stats_.countSearch(0, 2);
+         parent = hint->getParent();
+         isLeft = parent != nullptr && parent->getLeft() == hint;
+         return hint;
+    }
+    return findSlotFrom(start, key, parent, isLeft);
+}
+
+/**
+* Returns the predecessor of the given node (in-order).
+*/
+template<class Key, class Value, class Compare, class Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::predecessor(Node<Key, Value>* current)
+{
+    if(current == nullptr)
+         return nullptr;
+    if(current->getLeft() != nullptr) {
+         Node<Key, Value>* temp = current->getLeft();
+         while(temp->getRight() != nullptr)
+              temp = temp->getRight();
+         return temp;
+    } else {
+         Node<Key, Value>* parent = current->getParent();
+         while(parent != nullptr && current == parent->getLeft()) {
+              current = parent;
+              parent = parent->getParent();
+         }
+         return parent;
+    }
+}
+
+/**
+* Returns the successor of the given node (in-order).
+*/
+template<class Key, class Value, class Compare, class Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::successor(Node<Key, Value>* current)
 {
     if(current == nullptr)
          return nullptr;
@@ -584,32 +2026,75 @@ Node<Key, Value>* BinarySearchTree<Key, Value>::successor(Node<Key, Value>* curr
 }
 
 /**
- * Recursively computes the height of the subtree.
+ * Computes the height of the subtree.
  * Returns -1 if the subtree is unbalanced.
  */
-template<typename Key, typename Value>
-int BinarySearchTree<Key, Value>::checkHeight(Node<Key, Value>* node) const {
-    if(node == nullptr)
-        return 0;
-    int leftHeight = checkHeight(node->getLeft());
-    if(leftHeight == -1)
-        return -1;
-    int rightHeight = checkHeight(node->getRight());
-    if(rightHeight == -1)
-        return -1;
-    if(std::abs(leftHeight - rightHeight) > 1)
-        return -1;
-    return std::max(leftHeight, rightHeight) + 1;
+template<typename Key, typename Value, typename Compare, typename Alloc>
+int BinarySearchTree<Key, Value, Compare, Alloc>::checkHeight(Node<Key, Value>* node) const {
+    return postOrderHeights(node, [](Node<Key, Value>*, int leftHeight, int rightHeight) {
+        return std::abs(leftHeight - rightHeight) <= 1;
+    });
+}
+
+/**
+ * Walks the subtree in post-order by following parent pointers, so the
+ * only extra memory is a stack of the heights of finished subtrees whose
+ * siblings are still being walked.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename Visit>
+int BinarySearchTree<Key, Value, Compare, Alloc>::postOrderHeights(Node<Key, Value>* root, Visit visit)
+{
+    if(root == nullptr)
+         return 0;
+    std::vector<int> heights;
+    Node<Key, Value>* prev = nullptr;
+    Node<Key, Value>* node = root;
+    while(true) {
+         Node<Key, Value>* left = node->getLeft();
+         Node<Key, Value>* right = node->getRight();
+         bool fromAbove = (node == root) ? (prev == nullptr) : (prev == node->getParent());
+         if(fromAbove && left != nullptr) {
+              prev = node;
+              node = left;
+              continue;
+         }
+         if(right != nullptr && prev != right) {
+              prev = node;
+              node = right;
+              continue;
+         }
+         // Both subtrees are done; their heights are on top of the stack.
+         int rightHeight = 0;
+         if(right != nullptr) {
+              rightHeight = heights.back();
+              heights.pop_back();
+         }
+         int leftHeight = 0;
+         if(left != nullptr) {
+              leftHeight = heights.back();
+              heights.pop_back();
+         }
+         if(!visit(node, leftHeight, rightHeight))
+              return -1;
+         int height = std::max(leftHeight, rightHeight) + 1;
+         if(node == root)
+              return height;
+         heights.push_back(height);
+         prev = node;
+         node = node->getParent();
+    }
 }
 
 /**
  * Swaps two nodes in the BST.
  */
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::nodeSwap(Node<Key, Value>* n1, Node<Key, Value>* n2)
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::nodeSwap(Node<Key, Value>* n1, Node<Key, Value>* n2)
 {
     if((n1 == n2) || (n1 == nullptr) || (n2 == nullptr))
         return;
+    stats_.countNodeSwap();
     Node<Key, Value>* n1p = n1->getParent();
     Node<Key, Value>* n1r = n1->getRight();
     Node<Key, Value>* n1lt = n1->getLeft();
@@ -677,20 +2162,371 @@ void BinarySearchTree<Key, Value>::nodeSwap(Node<Key, Value>* n1, Node<Key, Valu
          this->root_ = n1;
 }
 
+/**
+ * Allocates memory for a node from alloc_ and constructs it in place.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename NodeType, typename KeyArg, typename ValueArg>
+NodeType* BinarySearchTree<Key, Value, Compare, Alloc>::createNode(KeyArg&& key, ValueArg&& value, NodeType* parent)
+{
+    void* mem = alloc_.allocate(sizeof(NodeType), alignof(NodeType));
+    try {
+        NodeType* node = new (mem) NodeType(std::forward<KeyArg>(key), std::forward<ValueArg>(value), parent);
+        stats_.countAllocation();
+        return node;
+    }
+    catch(...) {
+        alloc_.deallocate(mem, sizeof(NodeType), alignof(NodeType));
+        throw;
+    }
+}
+
+/**
+ * Destroys a node created by createNode and returns its memory to alloc_.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename NodeType>
+void BinarySearchTree<Key, Value, Compare, Alloc>::releaseNode(NodeType* node)
+{
+    node->~NodeType();
+    alloc_.deallocate(node, sizeof(NodeType), alignof(NodeType));
+    stats_.countDeallocation();
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::destroyNode(Node<Key, Value>* node)
+{
+    releaseNode(node);
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::linkNewNode(Node<Key, Value>* parent, bool isLeft, Key&& key, Value&& value)
+{
+    Node<Key, Value>* newNode = createNode(std::move(key), std::move(value), parent);
+    ++size_;
+    if(parent == nullptr)
+         root_ = newNode;
+    else if(isLeft)
+         parent->setLeft(newNode);
+    else
+         parent->setRight(newNode);
+    if(parent == leftmost_ && isLeft == (parent != nullptr))
+         leftmost_ = newNode;
+    if(parent == rightmost_ && !isLeft)
+         rightmost_ = newNode;
+    return newNode;
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::valueChanged(Node<Key, Value>*)
+{
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::assignSorted(const std::vector<std::pair<Key, Value> >& items)
+{
+    buildSubtree<Node<Key, Value> >(items, 0, items.size(), nullptr, true);
+}
+
+/**
+ * Builds items[lo, hi) as a perfectly balanced subtree below parent (on the
+ * side given by isLeft, or as the root when parent is null) and returns its
+ * height. Nodes are linked in as soon as they are created, so a partially
+ * built tree can always be cleared.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename NodeType>
+int BinarySearchTree<Key, Value, Compare, Alloc>::buildSubtree(const std::vector<std::pair<Key, Value> >& items,
+                                                       size_t lo, size_t hi, NodeType* parent, bool isLeft)
+{
+    if(lo == hi)
+         return 0;
+    size_t mid = lo + (hi - lo) / 2;
+    NodeType* node = createNode(items[mid].first, items[mid].second, parent);
+    if(parent == nullptr)
+         root_ = node;
+    else if(isLeft)
+         parent->setLeft(node);
+    else
+         parent->setRight(node);
+    int leftHeight = buildSubtree(items, lo, mid, node, true);
+    int rightHeight = buildSubtree(items, mid + 1, hi, node, false);
+    node->setSubtreeHeights(leftHeight, rightHeight);
+    return std::max(leftHeight, rightHeight) + 1;
+}
+
+/**
+ * Destroys all nodes in the subtree in O(1) extra space. Whenever the
+ * current node has a left child it is rotated right, so the doomed nodes
+ * form a right spine that is destroyed from the top. The subtree's parent
+ * is left pointing at freed memory, so this is only for whole subtrees
+ * that are being thrown away.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::clearHelper(Node<Key, Value>* node)
+{
+    while(node != nullptr) {
+         Node<Key, Value>* left = node->getLeft();
+         if(left != nullptr) {
+              node->setLeft(left->getRight());
+              left->setRight(node);
+              node = left;
+         }
+         else {
+              Node<Key, Value>* right = node->getRight();
+              destroyNode(node);
+              node = right;
+         }
+    }
+}
+
+/**
+ * Copies other's nodes into this (empty) tree using nodes of this tree's type.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::copyNodes(const BinarySearchTree& other)
+{
+    cloneNodes<Node<Key, Value> >(other);
+}
+
+/**
+ * Copies other's nodes as NodeType, keeping their shape and balancing state.
+ * The source is walked in pre-order along its parent pointers with the copy
+ * walked in step, each copy being linked in as soon as it is made; a copied
+ * child's slot being filled is what marks that side as done. If a node
+ * cannot be made, the partial copy is cleared and the exception rethrown.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename NodeType>
+void BinarySearchTree<Key, Value, Compare, Alloc>::cloneNodes(const BinarySearchTree& other)
+{
+    if(other.root_ == nullptr)
+         return;
+    try {
+         NodeType* src = static_cast<NodeType*>(other.root_);
+         NodeType* dst = createNode(src->getKey(), src->getValue(), static_cast<NodeType*>(nullptr));
+         dst->copyState(*src);
+         root_ = dst;
+         while(true) {
+              if(src->getLeft() != nullptr && dst->getLeft() == nullptr) {
+                   src = static_cast<NodeType*>(src->getLeft());
+                   NodeType* copy = createNode(src->getKey(), src->getValue(), dst);
+                   copy->copyState(*src);
+                   dst->setLeft(copy);
+                   dst = copy;
+              }
+              else if(src->getRight() != nullptr && dst->getRight() == nullptr) {
+                   src = static_cast<NodeType*>(src->getRight());
+                   NodeType* copy = createNode(src->getKey(), src->getValue(), dst);
+                   copy->copyState(*src);
+                   dst->setRight(copy);
+                   dst = copy;
+              }
+              else if(src == other.root_) {
+                   break;
+              }
+              else {
+                   src = static_cast<NodeType*>(src->getParent());
+                   dst = static_cast<NodeType*>(dst->getParent());
+              }
+         }
+         size_ = other.size_;
+         resetEnds();
+    }
+    catch(...) {
+         clear();
+         throw;
+    }
+}
+
 /*
 ---------------------------------------------------
 End implementations for the BinarySearchTree class.
 ---------------------------------------------------
 */
 
-// A free helper function to recursively delete all nodes in the BST.
-template<typename Key, typename Value>
-void clearHelper(Node<Key, Value>* node) {
-    if(node == nullptr)
-         return;
-    clearHelper(node->getLeft());
-    clearHelper(node->getRight());
-    delete node;
+/**
+ * Writes the header, then one record per node in pre-order, walking along
+ * the parent pointers as cloneNodes does. Records are gathered in a buffer
+ * of a few thousand and written together.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::save(const std::string& path) const
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "save() needs trivially copyable Key and Value types");
+    TreeImageHeader header;
+    std::memcpy(header.magic, TREE_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = TREE_IMAGE_VERSION;
+    header.byteOrder = TREE_IMAGE_BYTE_ORDER;
+    header.keySize = sizeof(Key);
+    header.valueSize = sizeof(Value);
+    header.recordSize = sizeof(Key) + sizeof(Value) + 1;
+    header.treeKind = imageKind();
+    header.count = size_;
+
+    std::FILE* out = std::fopen(path.c_str(), "wb");
+    if(out == nullptr)
+         throw std::runtime_error("cannot create " + path);
+    bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1;
+    const size_t recordSize = header.recordSize;
+    const size_t bufferRecords = std::max((size_t)1, (size_t)65536 / recordSize);
+    std::vector<char> buffer(bufferRecords * recordSize);
+    size_t buffered = 0;
+    Node<Key, Value>* node = root_;
+    while(ok && node != nullptr) {
+         char* record = &buffer[buffered * recordSize];
+         std::memcpy(record, &node->getKey(), sizeof(Key));
+         std::memcpy(record + sizeof(Key), &node->getValue(), sizeof(Value));
+         unsigned shape = node->saveState() << TREE_IMAGE_STATE_SHIFT;
+         if(node->getLeft() != nullptr)
+              shape |= TREE_IMAGE_HAS_LEFT;
+         if(node->getRight() != nullptr)
+              shape |= TREE_IMAGE_HAS_RIGHT;
+         record[sizeof(Key) + sizeof(Value)] = (char)shape;
+         if(++buffered == bufferRecords) {
+              ok = std::fwrite(&buffer[0], recordSize, buffered, out) == buffered;
+              buffered = 0;
+         }
+
+         // Next in pre-order: a child, or the right child of the nearest
+         // ancestor reached from its left that has one.
+         if(node->getLeft() != nullptr) {
+              node = node->getLeft();
+              continue;
+         }
+         if(node->getRight() != nullptr) {
+              node = node->getRight();
+              continue;
+         }
+         while(node != root_) {
+              Node<Key, Value>* parent = node->getParent();
+              if(node == parent->getLeft() && parent->getRight() != nullptr) {
+                   node = parent->getRight();
+                   break;
+              }
+              node = parent;
+         }
+         if(node == root_)
+              node = nullptr;
+    }
+    if(ok && buffered > 0)
+         ok = std::fwrite(&buffer[0], recordSize, buffered, out) == buffered;
+    if(std::fclose(out) != 0)
+         ok = false;
+    if(!ok)
+         throw std::runtime_error("cannot write " + path);
+}
+
+/**
+ * Maps the file and checks the header before touching the tree. The keys
+ * are trusted to be in order; only the shape of the records is checked.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::load(const std::string& path)
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "load() needs trivially copyable Key and Value types");
+    MappedFile file(path);
+    TreeImageHeader header;
+    if(file.size() < sizeof(header))
+         throw std::runtime_error(path + " is not a tree image");
+    std::memcpy(&header, file.data(), sizeof(header));
+    if(std::memcmp(header.magic, TREE_IMAGE_MAGIC, sizeof(header.magic)) != 0)
+         throw std::runtime_error(path + " is not a tree image");
+    if(header.version != TREE_IMAGE_VERSION)
+         throw std::runtime_error(path + " has an unsupported image version");
+    if(header.byteOrder != TREE_IMAGE_BYTE_ORDER || header.keySize != sizeof(Key) ||
+       header.valueSize != sizeof(Value) || header.recordSize != sizeof(Key) + sizeof(Value) + 1 ||
+       header.treeKind != imageKind())
+         throw std::runtime_error(path + " was saved by a different kind of tree");
+    size_t records = (file.size() - sizeof(header)) / header.recordSize;
+    if(header.count != records || (file.size() - sizeof(header)) % header.recordSize != 0)
+         throw std::runtime_error(path + " is truncated");
+
+    clear();
+    try {
+         loadNodes(file.data() + sizeof(header), records);
+         size_ = records;
+         resetEnds();
+    }
+    catch(...) {
+         clear();
+         throw;
+    }
+}
+
+/**
+ * Loads the records as plain Nodes.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::loadNodes(const char* records, size_t count)
+{
+    readNodes<Node<Key, Value> >(records, count);
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+uint32_t BinarySearchTree<Key, Value, Compare, Alloc>::imageKind() const
+{
+    return TREE_IMAGE_BST;
+}
+
+/**
+ * Rebuilds the tree from pre-order records in one pass with no comparisons.
+ * Each new node is linked in where the previous record's shape says the
+ * next node goes: under the previous node if it has children, otherwise as
+ * the right child of the nearest node still waiting for one. The nodes
+ * waiting for a right child are kept on a stack, which happens at most once
+ * per node with two children. Throws std::runtime_error if the shapes do
+ * not describe exactly count nodes, leaving the partial tree to the caller.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename NodeType>
+void BinarySearchTree<Key, Value, Compare, Alloc>::readNodes(const char* records, size_t count)
+{
+    const size_t recordSize = sizeof(Key) + sizeof(Value) + 1;
+    typename std::aligned_storage<sizeof(Key), alignof(Key)>::type key;
+    typename std::aligned_storage<sizeof(Value), alignof(Value)>::type value;
+    std::vector<NodeType*> pendingRight;
+    NodeType* parent = nullptr;
+    bool isLeft = true;
+    for(size_t i = 0; i < count; ++i, records += recordSize) {
+         if(i > 0 && parent == nullptr)
+              throw std::runtime_error("malformed tree image");
+         std::memcpy(&key, records, sizeof(Key));
+         std::memcpy(&value, records + sizeof(Key), sizeof(Value));
+         unsigned shape = (unsigned char)records[sizeof(Key) + sizeof(Value)];
+         NodeType* node = createNode(*reinterpret_cast<const Key*>(&key),
+                                     *reinterpret_cast<const Value*>(&value), parent);
+         node->loadState(shape >> TREE_IMAGE_STATE_SHIFT);
+         if(parent == nullptr)
+              root_ = node;
+         else if(isLeft)
+              parent->setLeft(node);
+         else
+              parent->setRight(node);
+
+         if(shape & TREE_IMAGE_HAS_LEFT) {
+              if(shape & TREE_IMAGE_HAS_RIGHT)
+                   pendingRight.push_back(node);
+              parent = node;
+              isLeft = true;
+         }
+         else if(shape & TREE_IMAGE_HAS_RIGHT) {
+              parent = node;
+              isLeft = false;
+         }
+         else if(!pendingRight.empty()) {
+              parent = pendingRight.back();
+              pendingRight.pop_back();
+              isLeft = false;
+         }
+         else {
+              parent = nullptr;
+         }
+    }
+    if(parent != nullptr)
+         throw std::runtime_error("malformed tree image");
 }
 
 // include print function (assumed to be in a separate file)
@@ -0,0 +1,858 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/**
+ * Counting compares for a node's sorted key array, used by BTreeMap to find
+ * a key's position within a node.
+ *
+ * The general version is a binary search with the tree's comparator. For
+ * 32- and 64-bit integers ordered by std::less, every key in the node is
+ * compared at once with vector instructions and the matching lanes are
+ * counted; with at most a cache line or four of keys this beats a chain of
+ * unpredictable branches. AVX2 is used when the compiler targets it
+ * (e.g. -mavx2 or -march=native), otherwise SSE2 (32-bit keys) or SSE4.2
+ * (64-bit keys) on x86-64 and NEON on AArch64, and plain loops elsewhere.
+ */
+template <class Key, class Compare>
+struct BTreeSearch
+{
+    // Number of keys[0..n) less than key.
+    static size_t countLess(const Key* keys, size_t n, const Key& key, const Compare& comp)
+    {
+        return std::lower_bound(keys, keys + n, key, comp) - keys;
+    }
+    // Number of keys[0..n) not greater than key.
+    static size_t countNotGreater(const Key* keys, size_t n, const Key& key, const Compare& comp)
+    {
+        return std::upper_bound(keys, keys + n, key, comp) - keys;
+    }
+};
+
+/**
+ * The vectorized counts. count<false> counts the keys below key and
+ * count<true> the keys above it. A matching lane compares to all ones,
+ * i.e. -1, so subtracting the comparison results adds up the matches per
+ * lane; the lanes are summed at the end, and the keys after the last full
+ * vector are counted one by one.
+ */
+struct SimdKeyCount
+{
+    template<bool Above>
+    static size_t count(const int32_t* keys, size_t n, int32_t key);
+    template<bool Above>
+    static size_t count(const int64_t* keys, size_t n, int64_t key);
+};
+
+template<bool Above>
+inline size_t SimdKeyCount::count(const int32_t* keys, size_t n, int32_t key)
+{
+    size_t count = 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i k = _mm256_set1_epi32(key);
+    __m256i total = _mm256_setzero_si256();
+    for(; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        total = _mm256_sub_epi32(total, Above ? _mm256_cmpgt_epi32(v, k) : _mm256_cmpgt_epi32(k, v));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    count = _mm_cvtsi128_si32(sum);
+#elif defined(__SSE2__)
+    __m128i k = _mm_set1_epi32(key);
+    __m128i total = _mm_setzero_si128();
+    for(; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        total = _mm_sub_epi32(total, Above ? _mm_cmpgt_epi32(v, k) : _mm_cmpgt_epi32(k, v));
+    }
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, _MM_SHUFFLE(1, 0, 3, 2)));
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, _MM_SHUFFLE(2, 3, 0, 1)));
+    count = _mm_cvtsi128_si32(total);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    int32x4_t k = vdupq_n_s32(key);
+    uint32x4_t total = vdupq_n_u32(0);
+    for(; i + 4 <= n; i += 4) {
+        int32x4_t v = vld1q_s32(keys + i);
+        total = vsubq_u32(total, Above ? vcgtq_s32(v, k) : vcltq_s32(v, k));
+    }
+    count = vaddvq_u32(total);
+#endif
+    for(; i < n; ++i) {
+        count += Above ? (keys[i] > key) : (keys[i] < key);
+    }
+    return count;
+}
+
+template<bool Above>
+inline size_t SimdKeyCount::count(const int64_t* keys, size_t n, int64_t key)
+{
+    size_t count = 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i k = _mm256_set1_epi64x(key);
+    __m256i total = _mm256_setzero_si256();
+    for(; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        total = _mm256_sub_epi64(total, Above ? _mm256_cmpgt_epi64(v, k) : _mm256_cmpgt_epi64(k, v));
+    }
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+    sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+    count = (size_t)_mm_cvtsi128_si64(sum);
+#elif defined(__SSE4_2__)
+    __m128i k = _mm_set1_epi64x(key);
+    __m128i total = _mm_setzero_si128();
+    for(; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        total = _mm_sub_epi64(total, Above ? _mm_cmpgt_epi64(v, k) : _mm_cmpgt_epi64(k, v));
+    }
+    total = _mm_add_epi64(total, _mm_unpackhi_epi64(total, total));
+    count = (size_t)_mm_cvtsi128_si64(total);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    int64x2_t k = vdupq_n_s64(key);
+    uint64x2_t total = vdupq_n_u64(0);
+    for(; i + 2 <= n; i += 2) {
+        int64x2_t v = vld1q_s64(keys + i);
+        total = vsubq_u64(total, Above ? vcgtq_s64(v, k) : vcltq_s64(v, k));
+    }
+    count = vaddvq_u64(total);
+#endif
+    for(; i < n; ++i) {
+        count += Above ? (keys[i] > key) : (keys[i] < key);
+    }
+    return count;
+}
+
+template <>
+struct BTreeSearch<int32_t, std::less<int32_t> >
+{
+    static size_t countLess(const int32_t* keys, size_t n, int32_t key, const std::less<int32_t>&)
+    {
+        return SimdKeyCount::count<false>(keys, n, key);
+    }
+    static size_t countNotGreater(const int32_t* keys, size_t n, int32_t key, const std::less<int32_t>&)
+    {
+        return n - SimdKeyCount::count<true>(keys, n, key);
+    }
+};
+
+template <>
+struct BTreeSearch<int64_t, std::less<int64_t> >
+{
+    static size_t countLess(const int64_t* keys, size_t n, int64_t key, const std::less<int64_t>&)
+    {
+        return SimdKeyCount::count<false>(keys, n, key);
+    }
+    static size_t countNotGreater(const int64_t* keys, size_t n, int64_t key, const std::less<int64_t>&)
+    {
+        return n - SimdKeyCount::count<true>(keys, n, key);
+    }
+};
+
+/**
+ * An ordered map stored as a B+ tree: wide nodes holding up to NODE_KEYS
+ * keys, all items in the leaves, and the leaves linked in key order. A
+ * lookup visits one node per level, a handful of levels even for millions
+ * of keys, and each node's keys sit in one contiguous array that the search
+ * scans with BTreeSearch. It offers the lookup, iteration and update API of
+ * BinarySearchTree for code where lookup throughput is what matters.
+ *
+ * Keys and values are stored in separate arrays, so an iterator yields a
+ * pair of references rather than a reference to a pair; it->first and
+ * it->second work as usual. Key and Value must be default constructible
+ * and move assignable. Inserts and removes invalidate iterators.
+ *
+ * Every node other than the root is at least half full: inserts split full
+ * nodes in two, and removes refill a node that drops below half from a
+ * sibling or merge it into one.
+ */
+template <class Key, class Value, class Compare = std::less<Key> >
+class BTreeMap
+{
+public:
+    // 256 bytes of keys per node: 64 ints, 32 int64s, 16 of anything bigger.
+    static const size_t NODE_KEYS = sizeof(Key) <= 4 ? 64 : (sizeof(Key) <= 8 ? 32 : 16);
+
+    BTreeMap();
+    explicit BTreeMap(const Compare& comp);
+    BTreeMap(const BTreeMap& other);
+    BTreeMap(BTreeMap&& other);
+    ~BTreeMap();
+    BTreeMap& operator=(const BTreeMap& other);
+    BTreeMap& operator=(BTreeMap&& other);
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    bool empty() const;
+    size_t size() const;
+
+private:
+    struct Leaf;
+
+public:
+    /**
+    * An iterator over the items in key order.
+    */
+    class iterator
+    {
+    public:
+        typedef std::pair<const Key&, Value&> reference;
+        // What operator-> returns: holds the pair that -> then reaches into.
+        class pointer
+        {
+        public:
+            explicit pointer(const reference& ref) : ref_(ref) {}
+            reference* operator->() { return &ref_; }
+        private:
+            reference ref_;
+        };
+
+        iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+
+    protected:
+        friend class BTreeMap<Key, Value, Compare>;
+        iterator(Leaf* leaf, size_t index);
+        Leaf* leaf_;
+        size_t index_;
+    };
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key) const;
+    // Throw std::out_of_range if the key is not present.
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+private:
+    static const size_t MIN_KEYS = NODE_KEYS / 2;
+    // Enough levels for any tree that fits in memory.
+    static const int MAX_DEPTH = 32;
+
+    struct NodeBase
+    {
+        size_t count;
+        bool isLeaf;
+    };
+    struct Leaf : NodeBase
+    {
+        Key keys[NODE_KEYS];
+        Value values[NODE_KEYS];
+        Leaf* next;
+    };
+    // Child i holds the keys from keys[i - 1] (inclusive) up to keys[i].
+    struct Inner : NodeBase
+    {
+        Key keys[NODE_KEYS];
+        NodeBase* children[NODE_KEYS + 1];
+    };
+    // The inner nodes and child indices on the way down to a leaf.
+    struct Path
+    {
+        Inner* nodes[MAX_DEPTH];
+        size_t slots[MAX_DEPTH];
+        int depth;
+    };
+
+    static Leaf* newLeaf();
+    static Inner* newInner();
+    size_t countLess(const Key* keys, size_t n, const Key& key) const;
+    size_t countNotGreater(const Key* keys, size_t n, const Key& key) const;
+    // The leaf whose range includes key, recording the way down if path is given.
+    Leaf* findLeaf(const Key& key, Path* path) const;
+    // Adds separator and the node right of it at slot of path's innermost
+    // node, splitting upward as needed.
+    void insertIntoParents(Path& path, const Key& separator, NodeBase* right);
+    // Refills or merges node, path's child at depth, if it is under half full.
+    void rebalance(Path& path, NodeBase* node);
+    void rebalanceLeaf(Inner* parent, size_t slot, Leaf* leaf);
+    void rebalanceInner(Inner* parent, size_t slot, Inner* node);
+    static void removeChild(Inner* parent, size_t slot);
+    static void destroy(NodeBase* node);
+    // Copies the subtree at node; last is the leaf copied before it.
+    static NodeBase* copyNode(const NodeBase* node, Leaf*& last);
+
+    NodeBase* root_;
+    size_t size_;
+    Compare comp_;
+};
+
+/* --- iterator implementations --- */
+
+template<class Key, class Value, class Compare>
+BTreeMap<Key, Value, Compare>::iterator::iterator() :
+    leaf_(nullptr),
+    index_(0)
+{
+}
+
+template<class Key, class Value, class Compare>
+BTreeMap<Key, Value, Compare>::iterator::iterator(Leaf* leaf, size_t index) :
+    leaf_(leaf),
+    index_(index)
+{
+}
+
+template<class Key, class Value, class Compare>
+typename BTreeMap<Key, Value, Compare>::iterator::reference
+BTreeMap<Key, Value, Compare>::iterator::operator*() const
+{
+    return reference(leaf_->keys[index_], leaf_->values[index_]);
+}
+
+template<class Key, class Value, class Compare>
+typename BTreeMap<Key, Value, Compare>::iterator::pointer
+BTreeMap<Key, Value, Compare>::iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+template<class Key, class Value, class Compare>
+bool BTreeMap<Key, Value, Compare>::iterator::operator==(const iterator& rhs) const
+{
+    return leaf_ == rhs.leaf_ && index_ == rhs.index_;
+}
+
+template<class Key, class Value, class Compare>
+bool BTreeMap<Key, Value, Compare>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+template<class Key, class Value, class Compare>
+typename BTreeMap<Key, Value, Compare>::iterator&
+BTreeMap<Key, Value, Compare>::iterator::operator++()
+{
+    if(++index_ == leaf_->count) {
+        leaf_ = leaf_->next;
+        index_ = 0;
+    }
+    return *this;
+}
+
+/* --- BTreeMap implementations --- */
+
+template<class Key, class Value, class Compare>
+BTreeMap<Key, Value, Compare>::BTreeMap() :
+    root_(nullptr),
+    size_(0)
+{
+}
+
+template<class Key, class Value, class Compare>
+BTreeMap<Key, Value, Compare>::BTreeMap(const Compare& comp) :
+    root_(nullptr),
+    size_(0),
+    comp_(comp)
+{
+}
+
+template<class Key, class Value, class Compare>
+BTreeMap<Key, Value, Compare>::BTreeMap(const BTreeMap& other) :
+    root_(nullptr),
+    size_(other.size_),
+    comp_(other.comp_)
+{
+    Leaf* last = nullptr;
+    root_ = copyNode(other.root_, last);
+}
+
+template<class Key, class Value, class Compare>
+BTreeMap<Key, Value, Compare>::BTreeMap(BTreeMap&& other) :
+    root_(other.root_),
+    size_(other.size_),
+    comp_(other.comp_)
+{
+    other.root_ = nullptr;
+    other.size_ = 0;
+}
+
+template<class Key, class Value, class Compare>
+BTreeMap<Key, Value, Compare>::~BTreeMap()
+{
+    clear();
+}
+
+template<class Key, class Value, class Compare>
+BTreeMap<Key, Value, Compare>& BTreeMap<Key, Value, Compare>::operator=(const BTreeMap& other)
+{
+    if(this != &other) {
+        BTreeMap copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+BTreeMap<Key, Value, Compare>& BTreeMap<Key, Value, Compare>::operator=(BTreeMap&& other)
+{
+    if(this != &other) {
+        clear();
+        root_ = other.root_;
+        size_ = other.size_;
+        comp_ = other.comp_;
+        other.root_ = nullptr;
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename BTreeMap<Key, Value, Compare>::Leaf* BTreeMap<Key, Value, Compare>::newLeaf()
+{
+    Leaf* leaf = new Leaf;
+    leaf->count = 0;
+    leaf->isLeaf = true;
+    leaf->next = nullptr;
+    return leaf;
+}
+
+template<class Key, class Value, class Compare>
+typename BTreeMap<Key, Value, Compare>::Inner* BTreeMap<Key, Value, Compare>::newInner()
+{
+    Inner* inner = new Inner;
+    inner->count = 0;
+    inner->isLeaf = false;
+    return inner;
+}
+
+template<class Key, class Value, class Compare>
+size_t BTreeMap<Key, Value, Compare>::countLess(const Key* keys, size_t n, const Key& key) const
+{
+    return BTreeSearch<Key, Compare>::countLess(keys, n, key, comp_);
+}
+
+template<class Key, class Value, class Compare>
+size_t BTreeMap<Key, Value, Compare>::countNotGreater(const Key* keys, size_t n, const Key& key) const
+{
+    return BTreeSearch<Key, Compare>::countNotGreater(keys, n, key, comp_);
+}
+
+template<class Key, class Value, class Compare>
+typename BTreeMap<Key, Value, Compare>::Leaf* BTreeMap<Key, Value, Compare>::findLeaf(const Key& key, Path* path) const
+{
+    NodeBase* node = root_;
+    if(path != nullptr)
+        path->depth = 0;
+    while(!node->isLeaf) {
+        Inner* inner = static_cast<Inner*>(node);
+        size_t slot = countNotGreater(inner->keys, inner->count, key);
+        if(path != nullptr) {
+            path->nodes[path->depth] = inner;
+            path->slots[path->depth] = slot;
+            ++path->depth;
+        }
+        node = inner->children[slot];
+    }
+    return static_cast<Leaf*>(node);
+}
+
+/**
+ * Replaces the value if the key is already present. A full leaf is split
+ * into two halves, and the first key of the right half is added to the
+ * parent, which may split in turn; a split root gets a new root above it.
+ */
+template<class Key, class Value, class Compare>
+void BTreeMap<Key, Value, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    const Key& key = keyValuePair.first;
+    if(root_ == nullptr)
+        root_ = newLeaf();
+    Path path;
+    Leaf* leaf = findLeaf(key, &path);
+    size_t pos = countLess(leaf->keys, leaf->count, key);
+    if(pos < leaf->count && !comp_(key, leaf->keys[pos])) {
+        leaf->values[pos] = keyValuePair.second;
+        return;
+    }
+
+    Leaf* target = leaf;
+    Leaf* right = nullptr;
+    if(leaf->count == NODE_KEYS) {
+        size_t mid = NODE_KEYS / 2;
+        right = newLeaf();
+        std::move(leaf->keys + mid, leaf->keys + NODE_KEYS, right->keys);
+        std::move(leaf->values + mid, leaf->values + NODE_KEYS, right->values);
+        right->count = NODE_KEYS - mid;
+        leaf->count = mid;
+        right->next = leaf->next;
+        leaf->next = right;
+        if(pos > mid) {
+            target = right;
+            pos -= mid;
+        }
+    }
+    std::move_backward(target->keys + pos, target->keys + target->count, target->keys + target->count + 1);
+    std::move_backward(target->values + pos, target->values + target->count, target->values + target->count + 1);
+    target->keys[pos] = key;
+    target->values[pos] = keyValuePair.second;
+    ++target->count;
+    ++size_;
+
+    if(right != nullptr)
+        insertIntoParents(path, right->keys[0], right);
+}
+
+/**
+ * A full inner node is split around its middle key, which moves up.
+ */
+template<class Key, class Value, class Compare>
+void BTreeMap<Key, Value, Compare>::insertIntoParents(Path& path, const Key& separator, NodeBase* right)
+{
+    Key up = separator;
+    NodeBase* child = right;
+    for(int level = path.depth - 1; level >= 0; --level) {
+        Inner* inner = path.nodes[level];
+        size_t slot = path.slots[level];
+        if(inner->count < NODE_KEYS) {
+            std::move_backward(inner->keys + slot, inner->keys + inner->count, inner->keys + inner->count + 1);
+            std::move_backward(inner->children + slot + 1, inner->children + inner->count + 1, inner->children + inner->count + 2);
+            inner->keys[slot] = std::move(up);
+            inner->children[slot + 1] = child;
+            ++inner->count;
+            return;
+        }
+
+        // Lay out all NODE_KEYS + 1 keys, then deal them out to two nodes.
+        Key keys[NODE_KEYS + 1];
+        NodeBase* children[NODE_KEYS + 2];
+        std::move(inner->keys, inner->keys + slot, keys);
+        keys[slot] = std::move(up);
+        std::move(inner->keys + slot, inner->keys + NODE_KEYS, keys + slot + 1);
+        std::copy(inner->children, inner->children + slot + 1, children);
+        children[slot + 1] = child;
+        std::copy(inner->children + slot + 1, inner->children + NODE_KEYS + 1, children + slot + 2);
+
+        size_t mid = (NODE_KEYS + 1) / 2;
+        Inner* sibling = newInner();
+        std::move(keys, keys + mid, inner->keys);
+        std::copy(children, children + mid + 1, inner->children);
+        inner->count = mid;
+        std::move(keys + mid + 1, keys + NODE_KEYS + 1, sibling->keys);
+        std::copy(children + mid + 1, children + NODE_KEYS + 2, sibling->children);
+        sibling->count = NODE_KEYS - mid;
+        up = std::move(keys[mid]);
+        child = sibling;
+    }
+
+    Inner* root = newInner();
+    root->keys[0] = std::move(up);
+    root->children[0] = root_;
+    root->children[1] = child;
+    root->count = 1;
+    root_ = root;
+}
+
+/**
+ * Separators are left alone when a leaf loses its first key: they only
+ * have to route searches, and the keys right of them are still not less.
+ */
+template<class Key, class Value, class Compare>
+void BTreeMap<Key, Value, Compare>::remove(const Key& key)
+{
+    if(root_ == nullptr)
+        return;
+    Path path;
+    Leaf* leaf = findLeaf(key, &path);
+    size_t pos = countLess(leaf->keys, leaf->count, key);
+    if(pos == leaf->count || comp_(key, leaf->keys[pos]))
+        return; // key not found
+
+    std::move(leaf->keys + pos + 1, leaf->keys + leaf->count, leaf->keys + pos);
+    std::move(leaf->values + pos + 1, leaf->values + leaf->count, leaf->values + pos);
+    --leaf->count;
+    --size_;
+    rebalance(path, leaf);
+}
+
+template<class Key, class Value, class Compare>
+void BTreeMap<Key, Value, Compare>::rebalance(Path& path, NodeBase* node)
+{
+    for(int level = path.depth - 1; level >= 0 && node->count < MIN_KEYS; --level) {
+        Inner* parent = path.nodes[level];
+        if(node->isLeaf)
+            rebalanceLeaf(parent, path.slots[level], static_cast<Leaf*>(node));
+        else
+            rebalanceInner(parent, path.slots[level], static_cast<Inner*>(node));
+        node = parent;
+    }
+    // The root may be nearly empty, but not empty.
+    if(root_->count == 0) {
+        NodeBase* old = root_;
+        root_ = root_->isLeaf ? nullptr : static_cast<Inner*>(root_)->children[0];
+        if(old->isLeaf)
+            delete static_cast<Leaf*>(old);
+        else
+            delete static_cast<Inner*>(old);
+    }
+}
+
+/**
+ * Borrows one item from a sibling that has one to spare, or else merges
+ * the leaf with a sibling, always the right one of the pair into the left.
+ */
+template<class Key, class Value, class Compare>
+void BTreeMap<Key, Value, Compare>::rebalanceLeaf(Inner* parent, size_t slot, Leaf* leaf)
+{
+    Leaf* left = (slot > 0) ? static_cast<Leaf*>(parent->children[slot - 1]) : nullptr;
+    Leaf* right = (slot < parent->count) ? static_cast<Leaf*>(parent->children[slot + 1]) : nullptr;
+    if(left != nullptr && left->count > MIN_KEYS) {
+        std::move_backward(leaf->keys, leaf->keys + leaf->count, leaf->keys + leaf->count + 1);
+        std::move_backward(leaf->values, leaf->values + leaf->count, leaf->values + leaf->count + 1);
+        --left->count;
+        leaf->keys[0] = std::move(left->keys[left->count]);
+        leaf->values[0] = std::move(left->values[left->count]);
+        ++leaf->count;
+        parent->keys[slot - 1] = leaf->keys[0];
+    }
+    else if(right != nullptr && right->count > MIN_KEYS) {
+        leaf->keys[leaf->count] = std::move(right->keys[0]);
+        leaf->values[leaf->count] = std::move(right->values[0]);
+        ++leaf->count;
+        std::move(right->keys + 1, right->keys + right->count, right->keys);
+        std::move(right->values + 1, right->values + right->count, right->values);
+        --right->count;
+        parent->keys[slot] = right->keys[0];
+    }
+    else {
+        if(left == nullptr) {
+            left = leaf;
+            ++slot;
+        }
+        else {
+            right = leaf;
+        }
+        std::move(right->keys, right->keys + right->count, left->keys + left->count);
+        std::move(right->values, right->values + right->count, left->values + left->count);
+        left->count += right->count;
+        left->next = right->next;
+        delete right;
+        removeChild(parent, slot);
+    }
+}
+
+/**
+ * Like rebalanceLeaf, except that keys rotate through the parent: the
+ * separator comes down into the node and the sibling's end key goes up.
+ */
+template<class Key, class Value, class Compare>
+void BTreeMap<Key, Value, Compare>::rebalanceInner(Inner* parent, size_t slot, Inner* node)
+{
+    Inner* left = (slot > 0) ? static_cast<Inner*>(parent->children[slot - 1]) : nullptr;
+    Inner* right = (slot < parent->count) ? static_cast<Inner*>(parent->children[slot + 1]) : nullptr;
+    if(left != nullptr && left->count > MIN_KEYS) {
+        std::move_backward(node->keys, node->keys + node->count, node->keys + node->count + 1);
+        std::move_backward(node->children, node->children + node->count + 1, node->children + node->count + 2);
+        node->keys[0] = std::move(parent->keys[slot - 1]);
+        node->children[0] = left->children[left->count];
+        ++node->count;
+        parent->keys[slot - 1] = std::move(left->keys[left->count - 1]);
+        --left->count;
+    }
+    else if(right != nullptr && right->count > MIN_KEYS) {
+        node->keys[node->count] = std::move(parent->keys[slot]);
+        node->children[node->count + 1] = right->children[0];
+        ++node->count;
+        parent->keys[slot] = std::move(right->keys[0]);
+        std::move(right->keys + 1, right->keys + right->count, right->keys);
+        std::move(right->children + 1, right->children + right->count + 1, right->children);
+        --right->count;
+    }
+    else {
+        if(left == nullptr) {
+            left = node;
+            ++slot;
+        }
+        else {
+            right = node;
+        }
+        left->keys[left->count] = std::move(parent->keys[slot - 1]);
+        std::move(right->keys, right->keys + right->count, left->keys + left->count + 1);
+        std::copy(right->children, right->children + right->count + 1, left->children + left->count + 1);
+        left->count += right->count + 1;
+        delete right;
+        removeChild(parent, slot);
+    }
+}
+
+/**
+ * Drops child slot of parent and the separator left of it.
+ */
+template<class Key, class Value, class Compare>
+void BTreeMap<Key, Value, Compare>::removeChild(Inner* parent, size_t slot)
+{
+    std::move(parent->keys + slot, parent->keys + parent->count, parent->keys + slot - 1);
+    std::copy(parent->children + slot + 1, parent->children + parent->count + 1, parent->children + slot);
+    --parent->count;
+}
+
+template<class Key, class Value, class Compare>
+void BTreeMap<Key, Value, Compare>::clear()
+{
+    destroy(root_);
+    root_ = nullptr;
+    size_ = 0;
+}
+
+/**
+ * Recursion depth is the height of the tree, which stays tiny.
+ */
+template<class Key, class Value, class Compare>
+void BTreeMap<Key, Value, Compare>::destroy(NodeBase* node)
+{
+    if(node == nullptr)
+        return;
+    if(node->isLeaf) {
+        delete static_cast<Leaf*>(node);
+        return;
+    }
+    Inner* inner = static_cast<Inner*>(node);
+    for(size_t i = 0; i <= inner->count; ++i) {
+        destroy(inner->children[i]);
+    }
+    delete inner;
+}
+
+/**
+ * Leaves are copied left to right, so each is linked to as the next of
+ * the one copied before it.
+ */
+template<class Key, class Value, class Compare>
+typename BTreeMap<Key, Value, Compare>::NodeBase*
+BTreeMap<Key, Value, Compare>::copyNode(const NodeBase* node, Leaf*& last)
+{
+    if(node == nullptr)
+        return nullptr;
+    if(node->isLeaf) {
+        const Leaf* leaf = static_cast<const Leaf*>(node);
+        Leaf* copy = newLeaf();
+        std::copy(leaf->keys, leaf->keys + leaf->count, copy->keys);
+        std::copy(leaf->values, leaf->values + leaf->count, copy->values);
+        copy->count = leaf->count;
+        if(last != nullptr)
+            last->next = copy;
+        last = copy;
+        return copy;
+    }
+    const Inner* inner = static_cast<const Inner*>(node);
+    Inner* copy = newInner();
+    std::copy(inner->keys, inner->keys + inner->count, copy->keys);
+    copy->count = inner->count;
+    for(size_t i = 0; i <= inner->count; ++i) {
+        copy->children[i] = copyNode(inner->children[i], last);
+    }
+    return copy;
+}
+
+template<class Key, class Value, class Compare>
+bool BTreeMap<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+template<class Key, class Value, class Compare>
+size_t BTreeMap<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+template<class Key, class Value, class Compare>
+typename BTreeMap<Key, Value, Compare>::iterator BTreeMap<Key, Value, Compare>::begin() const
+{
+    if(root_ == nullptr)
+        return end();
+    NodeBase* node = root_;
+    while(!node->isLeaf) {
+        node = static_cast<Inner*>(node)->children[0];
+    }
+    return iterator(static_cast<Leaf*>(node), 0);
+}
+
+template<class Key, class Value, class Compare>
+typename BTreeMap<Key, Value, Compare>::iterator BTreeMap<Key, Value, Compare>::end() const
+{
+    return iterator(nullptr, 0);
+}
+
+template<class Key, class Value, class Compare>
+typename BTreeMap<Key, Value, Compare>::iterator BTreeMap<Key, Value, Compare>::find(const Key& key) const
+{
+    iterator it = lower_bound(key);
+    if(it != end() && comp_(key, it.leaf_->keys[it.index_]))
+        return end();
+    return it;
+}
+
+/**
+ * The answer is in the leaf whose range holds key, or is the first item of
+ * the next leaf if every key in that leaf is smaller.
+ */
+template<class Key, class Value, class Compare>
+typename BTreeMap<Key, Value, Compare>::iterator BTreeMap<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    if(root_ == nullptr)
+        return end();
+    Leaf* leaf = findLeaf(key, nullptr);
+    size_t pos = countLess(leaf->keys, leaf->count, key);
+    if(pos == leaf->count)
+        return iterator(leaf->next, 0);
+    return iterator(leaf, pos);
+}
+
+template<class Key, class Value, class Compare>
+typename BTreeMap<Key, Value, Compare>::iterator BTreeMap<Key, Value, Compare>::upper_bound(const Key& key) const
+{
+    if(root_ == nullptr)
+        return end();
+    Leaf* leaf = findLeaf(key, nullptr);
+    size_t pos = countNotGreater(leaf->keys, leaf->count, key);
+    if(pos == leaf->count)
+        return iterator(leaf->next, 0);
+    return iterator(leaf, pos);
+}
+
+template<class Key, class Value, class Compare>
+Value& BTreeMap<Key, Value, Compare>::operator[](const Key& key)
+{
+    iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it.leaf_->values[it.index_];
+}
+
+template<class Key, class Value, class Compare>
+Value const & BTreeMap<Key, Value, Compare>::operator[](const Key& key) const
+{
+    iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it.leaf_->values[it.index_];
+}
+
+#endif
@@ -0,0 +1,165 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include "concurrent_avlbst.h"
+
+using namespace std;
+
+// Contention benchmark for read-mostly sharing of one tree.
+// Reader threads look up random keys while zero or one writer thread
+// keeps inserting and removing keys, once with an AVLTree behind a global
+// mutex and once with a ConcurrentAVLTree. Every 64th lookup is timed, and
+// the median and 99th percentile of those samples are reported. With the
+// concurrent tree the read latency should barely move when the writer runs.
+
+static const int KEYS = 1 << 16;
+static const int RUN_MS = 300;
+
+// An AVLTree behind one mutex, the baseline being replaced.
+class LockedTree
+{
+public:
+    bool find(int key, int& value) const
+    {
+        lock_guard<mutex> lock(mutex_);
+        AVLTree<int, int>::const_iterator it = tree_.find(key);
+        if(it == tree_.end())
+            return false;
+        value = it->second;
+        return true;
+    }
+    void insert(const pair<const int, int>& kv)
+    {
+        lock_guard<mutex> lock(mutex_);
+        tree_.insert(kv);
+    }
+    void remove(int key)
+    {
+        lock_guard<mutex> lock(mutex_);
+        tree_.remove(key);
+    }
+private:
+    AVLTree<int, int> tree_;
+    mutable mutex mutex_;
+};
+
+struct Result
+{
+    double mopsPerSec;
+    double p50Ns;
+    double p99Ns;
+    double hitRate;
+};
+
+template<class TreeType>
+static Result run(TreeType& tree, int readers, bool withWriter)
+{
+    atomic<bool> stop(false);
+    vector<vector<double> > samples(readers);
+    vector<long> counts(readers, 0);
+    vector<long> hits(readers, 0);  // keeps the lookups from being optimized away
+    vector<thread> threads;
+
+    for(int r = 0; r < readers; ++r) {
+        threads.push_back(thread([&, r]() {
+            mt19937 rng(r + 1);
+            long n = 0;
+            long found = 0;
+            int value = 0;
+            while(!stop.load(memory_order_relaxed)) {
+                int key = (int)(rng() % (2 * KEYS));
+                if((n & 63) == 0) {
+                    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                    found += tree.find(key, value);
+                    samples[r].push_back((double)chrono::duration_cast<chrono::nanoseconds>(
+                            chrono::steady_clock::now() - start).count());
+                }
+                else {
+                    found += tree.find(key, value);
+                }
+                ++n;
+            }
+            counts[r] = n;
+            hits[r] = found;
+        }));
+    }
+    if(withWriter) {
+        threads.push_back(thread([&]() {
+            mt19937 rng(104);
+            while(!stop.load(memory_order_relaxed)) {
+                int key = (int)(rng() % (2 * KEYS));
+                if(rng() & 1)
+                    tree.insert(make_pair(key, key));
+                else
+                    tree.remove(key);
+            }
+        }));
+    }
+
+    this_thread::sleep_for(chrono::milliseconds(RUN_MS));
+    stop.store(true);
+    for(size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+
+    vector<double> all;
+    long total = 0;
+    long found = 0;
+    for(int r = 0; r < readers; ++r) {
+        all.insert(all.end(), samples[r].begin(), samples[r].end());
+        total += counts[r];
+        found += hits[r];
+    }
+    sort(all.begin(), all.end());
+    Result result;
+    result.mopsPerSec = total / (RUN_MS * 1000.0);
+    result.p50Ns = all.empty() ? 0 : all[all.size() / 2];
+    result.p99Ns = all.empty() ? 0 : all[all.size() * 99 / 100];
+    result.hitRate = total ? (double)found / total : 0;
+    return result;
+}
+
+template<class TreeType>
+static void report(const char* name, int readers)
+{
+    for(int w = 0; w < 2; ++w) {
+        TreeType tree;
+        for(int i = 0; i < KEYS; ++i) {
+            tree.insert(make_pair(2 * i, i));
+        }
+        Result r = run(tree, readers, w == 1);
+        cout << setw(14) << name
+             << setw(8) << readers
+             << setw(8) << (w ? "yes" : "no")
+             << fixed << setprecision(1)
+             << setw(14) << r.mopsPerSec
+             << setw(10) << r.p50Ns
+             << setw(10) << r.p99Ns
+             << setw(8) << r.hitRate << endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int maxReaders = (argc > 1) ? atoi(argv[1]) : 32;
+
+    cout << setw(14) << "tree"
+         << setw(8) << "readers"
+         << setw(8) << "writer"
+         << setw(14) << "lookups M/s"
+         << setw(10) << "p50 ns"
+         << setw(10) << "p99 ns"
+         << setw(8) << "hits" << endl;
+    for(int readers = 1; readers <= maxReaders; readers *= 2) {
+        report<LockedTree>("mutex", readers);
+        report<ConcurrentAVLTree<int, int> >("left-right", readers);
+    }
+    return 0;
+}
@@ -0,0 +1,247 @@
+#ifndef CONCURRENT_AVLBST_H
+#define CONCURRENT_AVLBST_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <cstddef>
+#include <utility>
+#include "avlbst.h"
+
+/**
+ * A thread-safe AVLTree for read-mostly workloads, built on the Left-Right
+ * technique. Two identical AVLTrees are kept. Readers always use the one
+ * that is currently published and never block or retry. A writer applies
+ * its change to the other tree, publishes it, waits for the readers still
+ * on the old tree to leave, and then replays the change there. Lookups
+ * therefore run in parallel with each other and with a write, and their
+ * latency does not depend on how often writes happen.
+ *
+ * Writes are serialized by a mutex and cost two tree updates plus a wait
+ * for in-flight lookups, and the tree is stored twice. Readers announce
+ * themselves on one of READ_SLOTS cache-line-sized counters chosen by
+ * thread id, so they do not contend on a single shared line.
+ *
+ * Lookups hand back copies, since iterators into either tree become unsafe
+ * as soon as the reader leaves; read() runs a function against the
+ * published tree for anything more involved.
+ */
+template <class Key, class Value, class Compare = std::less<Key>, class Alloc = NodePool, class Augment = NoAugment>
+class ConcurrentAVLTree
+{
+public:
+    typedef AVLTree<Key, Value, Compare, Alloc, Augment> Tree;
+
+    ConcurrentAVLTree();
+
+    // Lookups; safe to call from any number of threads during writes.
+    bool find(const Key& key, Value& value) const;
+    bool contains(const Key& key) const;
+    size_t size() const;
+    bool empty() const;
+    // Calls fn(const Tree&) with the published tree and returns its result.
+    // fn must not keep iterators or references past its return.
+    template<typename Function>
+    typename std::result_of<Function(const Tree&)>::type read(Function fn) const;
+
+    // Updates; serialized against each other.
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+
+private:
+    static const size_t READ_SLOTS = 16;
+
+    // A reader count padded to its own cache line.
+    struct alignas(64) ReadSlot
+    {
+        std::atomic<long> count;
+    };
+
+    // Registers the calling thread as a reader of one version for the
+    // lifetime of the guard.
+    class ReadGuard
+    {
+    public:
+        explicit ReadGuard(const ConcurrentAVLTree& owner);
+        ~ReadGuard();
+        const Tree& tree() const;
+    private:
+        ReadGuard(const ReadGuard&);
+        ReadGuard& operator=(const ReadGuard&);
+
+        const ConcurrentAVLTree& owner_;
+        std::atomic<long>& slot_;
+    };
+
+    // Runs change on the hidden tree, publishes it, waits out the readers
+    // of the old one and runs change on it too.
+    template<typename Change>
+    void write(Change change);
+    void waitForReaders(int version) const;
+    static size_t slotIndex();
+
+    Tree trees_[2];
+    std::atomic<int> published_;   // index of the tree readers use
+    std::atomic<int> version_;     // which set of read slots new readers join
+    mutable ReadSlot readers_[2][READ_SLOTS];
+    std::mutex writeMutex_;
+
+    // Not copyable.
+    ConcurrentAVLTree(const ConcurrentAVLTree&);
+    ConcurrentAVLTree& operator=(const ConcurrentAVLTree&);
+};
+
+/* --- ReadGuard implementations --- */
+
+/**
+ * Joins the current version's read slots and then picks the published tree.
+ * A writer only touches a tree after both the tree has been unpublished and
+ * every reader that might have seen it published has left, so the tree read
+ * here stays unchanged until the guard is destroyed.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::ReadGuard::ReadGuard(const ConcurrentAVLTree& owner) :
+    owner_(owner),
+    slot_(owner.readers_[owner.version_.load()][slotIndex()].count)
+{
+    slot_.fetch_add(1);
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::ReadGuard::~ReadGuard()
+{
+    slot_.fetch_sub(1, std::memory_order_release);
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+const typename ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::Tree&
+ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::ReadGuard::tree() const
+{
+    return owner_.trees_[owner_.published_.load()];
+}
+
+/* --- ConcurrentAVLTree implementations --- */
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::ConcurrentAVLTree() :
+    published_(0),
+    version_(0)
+{
+    for(int v = 0; v < 2; ++v) {
+        for(size_t i = 0; i < READ_SLOTS; ++i) {
+            readers_[v][i].count.store(0);
+        }
+    }
+}
+
+/**
+ * Copies the value for key into value and returns true, or returns false
+ * if the key is not present.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+bool ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::find(const Key& key, Value& value) const
+{
+    ReadGuard guard(*this);
+    typename Tree::const_iterator it = guard.tree().find(key);
+    if(it == guard.tree().end())
+        return false;
+    value = it->second;
+    return true;
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+bool ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::contains(const Key& key) const
+{
+    ReadGuard guard(*this);
+    return guard.tree().find(key) != guard.tree().end();
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+size_t ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::size() const
+{
+    ReadGuard guard(*this);
+    return guard.tree().size();
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+bool ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::empty() const
+{
+    ReadGuard guard(*this);
+    return guard.tree().empty();
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+template<typename Function>
+typename std::result_of<Function(const typename ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::Tree&)>::type
+ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::read(Function fn) const
+{
+    ReadGuard guard(*this);
+    return fn(guard.tree());
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    write([&keyValuePair](Tree& tree) { tree.insert(keyValuePair); });
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::remove(const Key& key)
+{
+    write([&key](Tree& tree) { tree.remove(key); });
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::clear()
+{
+    write([](Tree& tree) { tree.clear(); });
+}
+
+/**
+ * The Left-Right write protocol. Readers that joined before the version
+ * flip may still be on the old tree, and readers of the new version see
+ * the new tree, so once the old version's slots drain the old tree is
+ * private to the writer. The previous writer already drained the other
+ * version, so waiting for it first only covers readers that joined it
+ * late, before the flip below was visible to them.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+template<typename Change>
+void ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::write(Change change)
+{
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    int current = published_.load();
+    change(trees_[1 - current]);
+    published_.store(1 - current);
+
+    int oldVersion = version_.load();
+    int newVersion = 1 - oldVersion;
+    waitForReaders(newVersion);
+    version_.store(newVersion);
+    waitForReaders(oldVersion);
+
+    change(trees_[current]);
+}
+
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+void ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::waitForReaders(int version) const
+{
+    for(size_t i = 0; i < READ_SLOTS; ++i) {
+        while(readers_[version][i].count.load() != 0) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+/**
+ * Spreads threads over the read slots by thread id.
+ */
+template<class Key, class Value, class Compare, class Alloc, class Augment>
+size_t ConcurrentAVLTree<Key, Value, Compare, Alloc, Augment>::slotIndex()
+{
+    return std::hash<std::thread::id>()(std::this_thread::get_id()) % READ_SLOTS;
+}
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef FROZEN_BST_H
+#define FROZEN_BST_H
+
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/**
+ * An immutable, read-only snapshot of a search tree, made by freeze().
+ *
+ * The keys are stored in one flat array in Eytzinger (breadth-first) order:
+ * the root is at index 1 and the children of index k are at 2k and 2k + 1,
+ * so there are no pointers to chase and the top levels of every search
+ * share the same few cache lines. The descent needs no branch on the
+ * comparison result, and it prefetches the keys four levels below the
+ * current one, which for small keys is a single cache line; by the time
+ * the search gets there the memory access has already been overlapped with
+ * the comparisons in between.
+ *
+ * The items themselves are kept separately in key order, so iteration is a
+ * plain array walk and a search only touches the items at its very end.
+ * Each key is stored twice.
+ */
+template <class Key, class Value, class Compare = std::less<Key> >
+class FrozenTree
+{
+public:
+    typedef typename std::vector<std::pair<const Key, Value> >::const_iterator iterator;
+
+    FrozenTree();
+    explicit FrozenTree(const Compare& comp);
+    // Builds the snapshot from items in strictly increasing key order.
+    template<typename InputIterator>
+    FrozenTree(InputIterator first, InputIterator last, const Compare& comp = Compare());
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key) const;
+    std::pair<iterator, iterator> equal_range(const Key& key) const;
+    // Throws std::out_of_range if the key is not present.
+    const Value& operator[](const Key& key) const;
+    bool empty() const;
+    size_t size() const;
+
+private:
+    // Fills keys_[k - 1] for the subtree rooted at Eytzinger index k from
+    // items_, starting at sorted position next. Recursion depth is log2 n.
+    void layOut(size_t k, size_t& next);
+    // Eytzinger index of the first key for which goRight is false, or 0.
+    template<typename GoRight>
+    size_t search(GoRight goRight) const;
+
+    std::vector<std::pair<const Key, Value> > items_;  // in key order
+    std::vector<Key> keys_;       // Eytzinger order, index k at keys_[k - 1]
+    std::vector<size_t> ranks_;   // position in items_ of each key in keys_
+    Compare comp_;
+};
+
+/* --- FrozenTree implementations --- */
+
+template<class Key, class Value, class Compare>
+FrozenTree<Key, Value, Compare>::FrozenTree()
+{
+}
+
+template<class Key, class Value, class Compare>
+FrozenTree<Key, Value, Compare>::FrozenTree(const Compare& comp) :
+    comp_(comp)
+{
+}
+
+template<class Key, class Value, class Compare>
+template<typename InputIterator>
+FrozenTree<Key, Value, Compare>::FrozenTree(InputIterator first, InputIterator last, const Compare& comp) :
+    comp_(comp)
+{
+    for(; first != last; ++first) {
+        items_.push_back(*first);
+        keys_.push_back(first->first);
+    }
+    ranks_.resize(items_.size());
+    size_t next = 0;
+    layOut(1, next);
+}
+
+template<class Key, class Value, class Compare>
+void FrozenTree<Key, Value, Compare>::layOut(size_t k, size_t& next)
+{
+    if(k > items_.size())
+        return;
+    layOut(2 * k, next);
+    keys_[k - 1] = items_[next].first;
+    ranks_[k - 1] = next++;
+    layOut(2 * k + 1, next);
+}
+
+/**
+ * The descent always runs to the bottom, going right while goRight holds.
+ * The answer is the last node where it went left: the index with its
+ * trailing right turns (one bits) and the left turn before them removed.
+ */
+template<class Key, class Value, class Compare>
+template<typename GoRight>
+size_t FrozenTree<Key, Value, Compare>::search(GoRight goRight) const
+{
+    const size_t n = keys_.size();
+    const Key* keys = keys_.data();
+    size_t k = 1;
+    while(k <= n) {
+#if defined(__GNUC__)
+        // Out-of-range prefetches are harmless hints.
+        __builtin_prefetch(keys + (16 * k - 1));
+#endif
+        k = 2 * k + (goRight(keys[k - 1]) ? 1 : 0);
+    }
+    while(k & 1) {
+        k >>= 1;
+    }
+    return k >> 1;
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenTree<Key, Value, Compare>::iterator FrozenTree<Key, Value, Compare>::begin() const
+{
+    return items_.begin();
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenTree<Key, Value, Compare>::iterator FrozenTree<Key, Value, Compare>::end() const
+{
+    return items_.end();
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenTree<Key, Value, Compare>::iterator FrozenTree<Key, Value, Compare>::find(const Key& key) const
+{
+    iterator it = lower_bound(key);
+    if(it != end() && comp_(key, it->first))
+        return end();
+    return it;
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenTree<Key, Value, Compare>::iterator FrozenTree<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    const Compare& comp = comp_;
+    size_t k = search([&comp, &key](const Key& probe) { return comp(probe, key); });
+    return (k == 0) ? end() : begin() + ranks_[k - 1];
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenTree<Key, Value, Compare>::iterator FrozenTree<Key, Value, Compare>::upper_bound(const Key& key) const
+{
+    const Compare& comp = comp_;
+    size_t k = search([&comp, &key](const Key& probe) { return !comp(key, probe); });
+    return (k == 0) ? end() : begin() + ranks_[k - 1];
+}
+
+template<class Key, class Value, class Compare>
+std::pair<typename FrozenTree<Key, Value, Compare>::iterator, typename FrozenTree<Key, Value, Compare>::iterator>
+FrozenTree<Key, Value, Compare>::equal_range(const Key& key) const
+{
+    iterator it = find(key);
+    if(it == end())
+        return std::make_pair(it, it);
+    return std::make_pair(it, it + 1);
+}
+
+template<class Key, class Value, class Compare>
+const Value& FrozenTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it->second;
+}
+
+template<class Key, class Value, class Compare>
+bool FrozenTree<Key, Value, Compare>::empty() const
+{
+    return items_.empty();
+}
+
+template<class Key, class Value, class Compare>
+size_t FrozenTree<Key, Value, Compare>::size() const
+{
+    return items_.size();
+}
+
+#endif
@@ -0,0 +1,270 @@
+#ifndef INTERVAL_TREE_H
+#define INTERVAL_TREE_H
+
+#include <functional>
+#include <utility>
+#include "avlbst.h"
+
+/**
+ * Reads an interval's end from a value with an end member, such as
+ *
+ *   struct Interval { int64_t end; std::string owner; };
+ *   IntervalTree<int64_t, Interval> leases;
+ */
+struct IntervalEndMember
+{
+    template<typename Value>
+    auto operator()(const Value& value) const -> decltype(value.end)
+    {
+        return value.end;
+    }
+};
+
+/**
+ * For trees whose value is the interval's end itself.
+ */
+struct IntervalEndValue
+{
+    template<typename Value>
+    const Value& operator()(const Value& value) const
+    {
+        return value;
+    }
+};
+
+/**
+ * Interval mode for AVLTree: each node's key starts an interval, EndOf
+ * reads its end from the value, and each node keeps the largest end in
+ * its subtree. Ends are compared with a default-constructed Compare.
+ */
+template<typename Key, typename EndOf = IntervalEndMember, typename Compare = std::less<Key> >
+struct IntervalMaxEnd
+{
+    static const bool enabled = true;
+
+    struct NodeData
+    {
+        NodeData() : maxEnd() { }
+        Key maxEnd;
+    };
+
+    // The largest end among node and its children's subtrees.
+    template<typename NodeType>
+    static Key subtreeMax(const NodeType* node)
+    {
+        Key result = EndOf()(node->getValue());
+        if(node->getLeft() != nullptr && Compare()(result, node->getLeft()->maxEnd))
+            result = node->getLeft()->maxEnd;
+        if(node->getRight() != nullptr && Compare()(result, node->getRight()->maxEnd))
+            result = node->getRight()->maxEnd;
+        return result;
+    }
+
+    template<typename NodeType>
+    static void update(NodeType* node)
+    {
+        node->maxEnd = subtreeMax(node);
+    }
+
+    template<typename NodeType>
+    static bool isConsistent(const NodeType* node)
+    {
+        Key expected = subtreeMax(node);
+        return !Compare()(expected, node->maxEnd) && !Compare()(node->maxEnd, expected);
+    }
+};
+
+/**
+ * An AVLTree of half-open intervals [start, end), keyed by start, with
+ * overlap and stabbing queries. Keys are unique, so at most one interval
+ * is stored per start; one whose end is not after its start is empty and
+ * overlaps nothing.
+ *
+ * Each node knows the largest end in its subtree, so the queries skip
+ * every subtree that ends too early and stop at the first start that is
+ * too late. Finding the first match costs O(log n), plus the walk past
+ * any empty intervals that end after lo ahead of it; visiting all k costs
+ * O(log n + k log(n/k)), the size of the paths down to them, and nearer
+ * O(log n + k) when the matches sit close together in key order.
+ *
+ * The maximum is kept through inserts, removes, rotations, node swaps,
+ * value replacement by insert and insert_or_assign, bulk loads, copies,
+ * images, and the split, join and set operations. An end must not be
+ * changed through operator[] or an iterator: insert the new value instead.
+ */
+template <class Key, class Value, class EndOf = IntervalEndMember, class Compare = std::less<Key>, class Alloc = NodePool>
+class IntervalTree : public AVLTree<Key, Value, Compare, Alloc, IntervalMaxEnd<Key, EndOf, Compare> >
+{
+public:
+    typedef IntervalMaxEnd<Key, EndOf, Compare> Augment;
+    typedef AVLTree<Key, Value, Compare, Alloc, Augment> Base;
+    typedef typename Base::iterator iterator;
+
+    IntervalTree();
+    template<typename InputIterator>
+    IntervalTree(InputIterator first, InputIterator last);
+
+    // The interval with the smallest start that overlaps [lo, hi), or end(),
+    // as when [lo, hi) is empty.
+    iterator first_overlap(const Key& lo, const Key& hi) const;
+    // Calls fn with each item whose interval overlaps [lo, hi), in order.
+    template<typename Function>
+    void for_each_overlap(const Key& lo, const Key& hi, Function fn) const;
+    // Calls fn with each item whose interval contains point, in order.
+    template<typename Function>
+    void for_each_containing(const Key& point, Function fn) const;
+
+protected:
+    typedef AVLNode<Key, Value, Augment> IntervalNode;
+
+    // A query for the intervals that end after lo and start before hi, or
+    // also at hi when closed.
+    struct Query
+    {
+        const Key& lo;
+        const Key& hi;
+        bool closed;
+    };
+    bool endsAfter(const Key& end, const Query& query) const;
+    bool startsBefore(const IntervalNode* node, const Query& query) const;
+    // Whether node's own interval is a match: not empty, and ending late
+    // enough, given that it starts early enough.
+    bool matches(const IntervalNode* node, const Query& query) const;
+    // Whether node's subtree may hold a match, judging by its maximum end.
+    bool reaches(const IntervalNode* node, const Query& query) const;
+    // The first node in order from node's subtree that may hold a match,
+    // following left children for as long as they may.
+    const IntervalNode* descendLeft(const IntervalNode* node, const Query& query) const;
+    // Calls visit(node) for each match, in order, until it returns false.
+    template<typename Visit>
+    void visitOverlaps(const Query& query, Visit visit) const;
+
+    const IntervalNode* rootNode() const {
+        return static_cast<const IntervalNode*>(this->root_);
+    }
+};
+
+/* --- IntervalTree implementations --- */
+
+template<class Key, class Value, class EndOf, class Compare, class Alloc>
+IntervalTree<Key, Value, EndOf, Compare, Alloc>::IntervalTree()
+{
+}
+
+template<class Key, class Value, class EndOf, class Compare, class Alloc>
+template<typename InputIterator>
+IntervalTree<Key, Value, EndOf, Compare, Alloc>::IntervalTree(InputIterator first, InputIterator last) :
+    Base(first, last)
+{
+}
+
+template<class Key, class Value, class EndOf, class Compare, class Alloc>
+bool IntervalTree<Key, Value, EndOf, Compare, Alloc>::endsAfter(const Key& end, const Query& query) const
+{
+    return this->comp_(query.lo, end);
+}
+
+template<class Key, class Value, class EndOf, class Compare, class Alloc>
+bool IntervalTree<Key, Value, EndOf, Compare, Alloc>::startsBefore(const IntervalNode* node, const Query& query) const
+{
+    return query.closed ? !this->comp_(query.hi, node->getKey()) : this->comp_(node->getKey(), query.hi);
+}
+
+template<class Key, class Value, class EndOf, class Compare, class Alloc>
+bool IntervalTree<Key, Value, EndOf, Compare, Alloc>::matches(const IntervalNode* node, const Query& query) const
+{
+    Key end = EndOf()(node->getValue());
+    return endsAfter(end, query) && this->comp_(node->getKey(), end);
+}
+
+template<class Key, class Value, class EndOf, class Compare, class Alloc>
+bool IntervalTree<Key, Value, EndOf, Compare, Alloc>::reaches(const IntervalNode* node, const Query& query) const
+{
+    return node != nullptr && endsAfter(node->maxEnd, query);
+}
+
+template<class Key, class Value, class EndOf, class Compare, class Alloc>
+const typename IntervalTree<Key, Value, EndOf, Compare, Alloc>::IntervalNode*
+IntervalTree<Key, Value, EndOf, Compare, Alloc>::descendLeft(const IntervalNode* node, const Query& query) const
+{
+    while(reaches(node->getLeft(), query)) {
+        node = node->getLeft();
+    }
+    return node;
+}
+
+/**
+ * The walk usually ends at the first node it visits: a subtree reaching
+ * past lo holds a match unless every interval ending that late is empty.
+ */
+template<class Key, class Value, class EndOf, class Compare, class Alloc>
+typename IntervalTree<Key, Value, EndOf, Compare, Alloc>::iterator
+IntervalTree<Key, Value, EndOf, Compare, Alloc>::first_overlap(const Key& lo, const Key& hi) const
+{
+    Query query = { lo, hi, false };
+    const IntervalNode* first = nullptr;
+    if(this->comp_(lo, hi)) {
+        visitOverlaps(query, [&](const IntervalNode* node) -> bool {
+            first = node;
+            return false;
+        });
+    }
+    return this->iteratorAt(const_cast<IntervalNode*>(first));
+}
+
+template<class Key, class Value, class EndOf, class Compare, class Alloc>
+template<typename Function>
+void IntervalTree<Key, Value, EndOf, Compare, Alloc>::for_each_overlap(const Key& lo, const Key& hi, Function fn) const
+{
+    Query query = { lo, hi, false };
+    if(!this->comp_(lo, hi))
+        return;
+    visitOverlaps(query, [&](const IntervalNode* node) -> bool {
+        fn(node->getItem());
+        return true;
+    });
+}
+
+template<class Key, class Value, class EndOf, class Compare, class Alloc>
+template<typename Function>
+void IntervalTree<Key, Value, EndOf, Compare, Alloc>::for_each_containing(const Key& point, Function fn) const
+{
+    Query query = { point, point, true };
+    visitOverlaps(query, [&](const IntervalNode* node) -> bool {
+        fn(node->getItem());
+        return true;
+    });
+}
+
+/**
+ * An in-order walk along the parent pointers that only enters subtrees
+ * which reach past lo, and ends at the first start that is too late.
+ */
+template<class Key, class Value, class EndOf, class Compare, class Alloc>
+template<typename Visit>
+void IntervalTree<Key, Value, EndOf, Compare, Alloc>::visitOverlaps(const Query& query, Visit visit) const
+{
+    const IntervalNode* node = rootNode();
+    if(!reaches(node, query))
+        return;
+    node = descendLeft(node, query);
+    while(startsBefore(node, query)) {
+        if(matches(node, query) && !visit(node))
+            return;
+        if(reaches(node->getRight(), query)) {
+            node = descendLeft(node->getRight(), query);
+            continue;
+        }
+        // Climb to the nearest ancestor whose left subtree this was.
+        const IntervalNode* parent = node->getParent();
+        while(parent != nullptr && node == parent->getRight()) {
+            node = parent;
+            parent = parent->getParent();
+        }
+        if(parent == nullptr)
+            return;
+        node = parent;
+    }
+}
+
+#endif
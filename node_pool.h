@@ -0,0 +1,297 @@
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * Node allocators for the search trees.
+ *
+ * A tree asks its allocator for raw, suitably aligned memory for one node
+ * at a time and placement-constructs the node into it. An allocator must
+ * provide:
+ *
+ *   void* allocate(std::size_t bytes, std::size_t align);
+ *   void deallocate(void* p, std::size_t bytes, std::size_t align);
+ *   void release();
+ *   void absorb(Allocator& other);
+ *   void share(Allocator& other);
+ *
+ * release() is called by clear() after every node has been destroyed, so
+ * an allocator may drop all of its memory at once there. absorb() takes
+ * over everything other has handed out, which must afterwards be
+ * deallocated through this allocator; trees use it when nodes move from
+ * one tree to another. share() is for when the nodes of one tree end up
+ * in two: memory handed out by other may then be deallocated through
+ * either allocator, and stays valid until both have released it.
+ */
+
+/**
+ * An allocator that sends every node straight to the global heap.
+ */
+class HeapAllocator
+{
+public:
+    void* allocate(std::size_t bytes, std::size_t align);
+    void deallocate(void* p, std::size_t bytes, std::size_t align);
+    void release();
+    void absorb(HeapAllocator& other);
+    void share(HeapAllocator& other);
+};
+
+/**
+ * The default node allocator. Nodes are carved out of large slabs and freed
+ * nodes are kept on an intrusive free list, so churn does not reach malloc
+ * and nodes that are allocated together stay close together in memory.
+ * The block size is fixed by the first allocation (a tree only ever
+ * allocates one kind of node); requests of any other size go to the heap.
+ * release() gives whole slabs back at once.
+ *
+ * Slabs are kept in reference-counted groups so that pools can share them
+ * (see share()); a slab is freed when the last pool holding it releases it.
+ * Each pool still has its own free list and newest slab, so pools that
+ * share slabs can be used from different threads.
+ */
+class NodePool
+{
+public:
+    NodePool();
+    ~NodePool();
+
+    void* allocate(std::size_t bytes, std::size_t align);
+    void deallocate(void* p, std::size_t bytes, std::size_t align);
+    void release();
+    void absorb(NodePool& other);
+    void share(NodePool& other);
+
+    // Moving a pool hands over its slabs; the source is left empty.
+    NodePool(NodePool&& other);
+    NodePool& operator=(NodePool&& other);
+
+private:
+    // Pools own memory, so they are not copyable.
+    NodePool(const NodePool& other);
+    NodePool& operator=(const NodePool& other);
+
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    // Slabs that are freed together when no pool holds the group any more.
+    struct SlabGroup
+    {
+        std::vector<void*> slabs;
+        ~SlabGroup();
+    };
+
+    static const std::size_t FIRST_SLAB_BLOCKS = 32;
+    static const std::size_t MAX_SLAB_BLOCKS = 4096;
+
+    void addSlab();
+
+    std::vector<std::shared_ptr<SlabGroup> > groups_;  // new slabs go in the last, if not shared
+    FreeBlock* freeList_;
+    char* cursor_;     // next never-used block in the newest slab
+    char* limit_;      // end of the newest slab
+    std::size_t blockSize_;
+    std::size_t nextSlabBlocks_;
+};
+
+/* --- HeapAllocator implementations --- */
+
+inline void* HeapAllocator::allocate(std::size_t bytes, std::size_t)
+{
+    return ::operator new(bytes);
+}
+
+inline void HeapAllocator::deallocate(void* p, std::size_t, std::size_t)
+{
+    ::operator delete(p);
+}
+
+inline void HeapAllocator::release()
+{
+}
+
+inline void HeapAllocator::absorb(HeapAllocator&)
+{
+}
+
+inline void HeapAllocator::share(HeapAllocator&)
+{
+}
+
+/* --- NodePool implementations --- */
+
+inline NodePool::NodePool() :
+    freeList_(nullptr),
+    cursor_(nullptr),
+    limit_(nullptr),
+    blockSize_(0),
+    nextSlabBlocks_(FIRST_SLAB_BLOCKS)
+{
+}
+
+inline NodePool::~NodePool()
+{
+    release();
+}
+
+inline NodePool::NodePool(NodePool&& other) :
+    groups_(std::move(other.groups_)),
+    freeList_(other.freeList_),
+    cursor_(other.cursor_),
+    limit_(other.limit_),
+    blockSize_(other.blockSize_),
+    nextSlabBlocks_(other.nextSlabBlocks_)
+{
+    other.groups_.clear();
+    other.freeList_ = nullptr;
+    other.cursor_ = nullptr;
+    other.limit_ = nullptr;
+    other.nextSlabBlocks_ = FIRST_SLAB_BLOCKS;
+}
+
+inline NodePool& NodePool::operator=(NodePool&& other)
+{
+    if(this != &other) {
+        release();
+        groups_.swap(other.groups_);
+        freeList_ = other.freeList_;
+        cursor_ = other.cursor_;
+        limit_ = other.limit_;
+        blockSize_ = other.blockSize_;
+        nextSlabBlocks_ = other.nextSlabBlocks_;
+        other.freeList_ = nullptr;
+        other.cursor_ = nullptr;
+        other.limit_ = nullptr;
+        other.nextSlabBlocks_ = FIRST_SLAB_BLOCKS;
+    }
+    return *this;
+}
+
+/**
+ * Returns a free-listed block if there is one, otherwise the next unused
+ * block of the newest slab, starting a new slab when it is exhausted.
+ */
+inline void* NodePool::allocate(std::size_t bytes, std::size_t align)
+{
+    if(blockSize_ == 0) {
+        // Round up so every block in a slab stays aligned and can hold a free-list link.
+        std::size_t size = (bytes < sizeof(FreeBlock)) ? sizeof(FreeBlock) : bytes;
+        if(align < alignof(FreeBlock))
+            align = alignof(FreeBlock);
+        blockSize_ = (size + align - 1) / align * align;
+    }
+    if(bytes > blockSize_ || align > alignof(std::max_align_t))
+        return ::operator new(bytes);
+
+    if(freeList_ != nullptr) {
+        FreeBlock* block = freeList_;
+        freeList_ = block->next;
+        return block;
+    }
+    if(cursor_ == limit_)
+        addSlab();
+    void* block = cursor_;
+    cursor_ += blockSize_;
+    return block;
+}
+
+/**
+ * Pushes the block onto the free list for reuse by the next allocation.
+ */
+inline void NodePool::deallocate(void* p, std::size_t bytes, std::size_t align)
+{
+    if(bytes > blockSize_ || align > alignof(std::max_align_t)) {
+        ::operator delete(p);
+        return;
+    }
+    FreeBlock* block = static_cast<FreeBlock*>(p);
+    block->next = freeList_;
+    freeList_ = block;
+}
+
+/**
+ * Frees every slab that no other pool shares. All blocks handed out by
+ * this pool become invalid, except those of shared slabs.
+ */
+inline void NodePool::release()
+{
+    groups_.clear();
+    freeList_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+    nextSlabBlocks_ = FIRST_SLAB_BLOCKS;
+}
+
+/**
+ * Takes ownership of other's slabs and free blocks, leaving other empty.
+ * Both pools must hold blocks of the same size (or other none at all).
+ * The unused tail of other's newest slab is not reused, but is freed with
+ * the slab.
+ */
+inline void NodePool::absorb(NodePool& other)
+{
+    if(this == &other || other.blockSize_ == 0)
+        return;
+    if(blockSize_ == 0)
+        blockSize_ = other.blockSize_;
+    groups_.insert(groups_.end(), other.groups_.begin(), other.groups_.end());
+    while(other.freeList_ != nullptr) {
+        FreeBlock* block = other.freeList_;
+        other.freeList_ = block->next;
+        block->next = freeList_;
+        freeList_ = block;
+    }
+    other.groups_.clear();
+    other.cursor_ = nullptr;
+    other.limit_ = nullptr;
+    other.nextSlabBlocks_ = FIRST_SLAB_BLOCKS;
+}
+
+/**
+ * Makes this pool a co-owner of all of other's slabs, so blocks that other
+ * handed out may be given back to either pool. Costs O(number of groups),
+ * which only grows with the number of shares. Both pools must hold blocks
+ * of the same size (or one of them none at all).
+ */
+inline void NodePool::share(NodePool& other)
+{
+    if(this == &other || other.blockSize_ == 0)
+        return;
+    if(blockSize_ == 0)
+        blockSize_ = other.blockSize_;
+    groups_.insert(groups_.end(), other.groups_.begin(), other.groups_.end());
+}
+
+inline NodePool::SlabGroup::~SlabGroup()
+{
+    for(std::size_t i = 0; i < slabs.size(); ++i)
+        ::operator delete(slabs[i]);
+}
+
+/**
+ * Allocates a new slab, doubling the slab size each time up to MAX_SLAB_BLOCKS.
+ */
+inline void NodePool::addSlab()
+{
+    std::size_t bytes = blockSize_ * nextSlabBlocks_;
+    // A group another pool also holds must not change under it.
+    if(groups_.empty() || groups_.back().use_count() > 1)
+        groups_.push_back(std::make_shared<SlabGroup>());
+    std::vector<void*>& slabs = groups_.back()->slabs;
+    slabs.reserve(slabs.size() + 1);
+    char* slab = static_cast<char*>(::operator new(bytes));
+    slabs.push_back(slab);
+    cursor_ = slab;
+    limit_ = slab + bytes;
+    if(nextSlabBlocks_ < MAX_SLAB_BLOCKS)
+        nextSlabBlocks_ *= 2;
+}
+
+#endif
@@ -1,6 +1,7 @@
-#include <cmath>
-#include <iomanip>
-#include <map>
+#include <algorithm>
+#include <iterator>
+#include <ostream>
+#include <streambuf>
 #include <vector>
 #include <cstdint>
 
@@ -12,56 +13,9 @@
 
 // maximum depth of tree to actually print.
 #define PPBST_MAX_HEIGHT 6
-
-// Returns the node's distance from the given root.
-// 1 means that it is the root.
-// Returns -1 (not found) if the distance is more than PPBST_MAX_HEIGHT,
-// or -2 if the tree is inconsistent.
-template<typename Key, typename Value>
-int getNodeDepth(BinarySearchTree<Key, Value> const & tree, Node<Key, Value> * root, Node<Key, Value> * node)
-{
-    int dist = 1;
-
-    while(node != root)
-    {
-        if(node == nullptr)
-        {
-            return -2;
-        }
-
-        ++dist;
-        node = node->getParent();
-
-        if(dist > PPBST_MAX_HEIGHT)
-        {
-            return -1;
-        }
-    }
-
-    return dist;
-}
-
-// Returns the height of the subtree at root.
-// Uses recursion, not height values, so it is bulletproof
-// against incorrect heights.
-// Stops recursing after PPBST_MAX_HEIGHT calls.
-template<typename Key, typename Value>
-int getSubtreeHeight(Node<Key, Value> * root, int recursionDepth = 1)
-{
-    if(root == nullptr)
-    {
-        return 0;
-    }
-
-    if(recursionDepth > PPBST_MAX_HEIGHT)
-    {
-        // bail out to prevent infinite loops on bad trees
-        return 0;
-    }
-
-    return std::max(getSubtreeHeight(root->getLeft(), recursionDepth + 1),
-                    getSubtreeHeight(root->getRight(), recursionDepth + 1)) + 1;
-}
+// the most levels print(out, maxHeight) will lay out; each one doubles
+// the width of the picture, so anything deeper is only useful as DOT.
+#define PPBST_HEIGHT_LIMIT 20
 
 /* Function to prettily print a BST out to the terminal.
 
@@ -92,206 +46,369 @@ int getSubtreeHeight(Node<Key, Value> * root, int recursionDepth = 1)
 
     */
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::printRoot (Node<Key, Value>* root) const
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::printRoot (Node<Key, Value>* root) const
 {
-    // special case for empty trees:
-    if(root == nullptr)
+    printSubtree(std::cout, root, PPBST_MAX_HEIGHT);
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::print(std::ostream& out, unsigned maxHeight) const
+{
+    printSubtree(out, root_, maxHeight);
+    out << '\n';
+}
+
+// Writes count copies of the UTF-8 character c to out.
+inline void ppbstRepeat(std::ostream& out, const char* c, size_t count)
+{
+    size_t length = std::char_traits<char>::length(c);
+    for(size_t i = 0; i < count; ++i)
     {
-        std::cout << "<empty tree>" << std::endl;
-        return;
+        out.write(c, length);
     }
+}
 
-#define BOX_WIDTH 4
-#define PADDING 2 // distance between elements at bottom row
-#define ELEMENT_WIDTH (BOX_WIDTH + PADDING)
+// Writes item to out with its operator<<, or a '?' for a type that has
+// none, so that trees of any key and value type can be printed.
+template<typename T>
+auto ppbstWriteItem(std::ostream& out, const T& item, int) -> decltype(out << item, void())
+{
+    out << item;
+}
 
-    // save initial cout state (from https://stackoverflow.com/questions/2273330/restore-the-state-of-stdcout-after-manipulating-it)
-    std::ios::fmtflags origCoutState(std::cout.flags());
+template<typename T>
+void ppbstWriteItem(std::ostream& out, const T&, ...)
+{
+    out.put('?');
+}
 
-    // do some initial calculations
-    // ----------------------------------------------------------------------
-    uint32_t printedTreeHeight = getSubtreeHeight(root);
-    bool clippedFinalElements = false;
+// Writes value to out in decimal, zero-padded to width digits, without
+// touching (or depending on) the stream's formatting flags.
+inline void ppbstWriteNumber(std::ostream& out, uintmax_t value, size_t width = 1)
+{
+    char digits[24];
+    size_t length = 0;
+    do
+    {
+        digits[length++] = (char)('0' + value % 10);
+        value /= 10;
+    }
+    while(value != 0);
+    std::fill_n(std::ostreambuf_iterator<char>(out), width > length ? width - length : 0, '0');
+    std::reverse(digits, digits + length);
+    out.write(digits, length);
+}
 
-    // with the width of a standard terminal, we can only print 2^5 = 32 elements
-    if(printedTreeHeight > PPBST_MAX_HEIGHT)
+// Calls visit(node, level, index, placeholder) for the nodes on the top
+// height levels of root's subtree, in key order: index counts the node's
+// place in its level as if the level were full, and placeholder is its
+// 1-based position in the walk. The walk keeps its path in a fixed array,
+// so it allocates nothing.
+template<typename NodeType, typename Visit>
+void ppbstVisitTop(NodeType* root, size_t height, Visit visit)
+{
+    struct Step
+    {
+        NodeType* node;
+        size_t level;
+        size_t index;
+    };
+    // the nodes whose left subtree is being walked, one per level at most
+    Step pending[PPBST_HEIGHT_LIMIT];
+    size_t count = 0;
+    size_t placeholder = 0;
+    NodeType* node = root;
+    size_t level = 0;
+    size_t index = 0;
+    while(true)
     {
-        printedTreeHeight = PPBST_MAX_HEIGHT;
-        clippedFinalElements = true;
+        while(node != nullptr)
+        {
+            pending[count++] = Step{node, level, index};
+            node = (level + 1 < height) ? node->getLeft() : nullptr;
+            ++level;
+            index = 2 * index;
+        }
+        if(count == 0)
+        {
+            return;
+        }
+        Step step = pending[--count];
+        visit(step.node, step.level, step.index, ++placeholder);
+        node = (step.level + 1 < height) ? step.node->getRight() : nullptr;
+        level = step.level + 1;
+        index = 2 * step.index + 1;
+    }
+}
 
+/* Lays the tree out one level at a time, without allocating.
+
+   A first walk over the top maxHeight levels finds how many of them hold
+   nodes, whether the tree goes deeper, and how many nodes are printed.
+   Each row of boxes and each row of branches is then one more in-order
+   walk (see ppbstVisitTop) that draws only the nodes on its level: these
+   come left to right, and with their placeholders, which are numbered in
+   sorted order as the walk counts them off. Every drawing position is a
+   function of a node's level and index alone: a node is centred over the
+   bottom-row boxes its subtree would fill. The memory used is a path of
+   at most PPBST_HEIGHT_LIMIT steps; the price is a walk over the printed
+   nodes per row, O(height) walks in all, little next to the output.
+
+   Only child pointers are followed, and never below the last printed
+   level, so broken trees print as far as they can. Characters go
+   straight to out, and its formatting flags are only used for the keys
+   and values in the placeholder list. Keys and values without an
+   operator<< are listed as '?'.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::printSubtree(std::ostream& out, Node<Key, Value>* root, unsigned maxHeight) const
+{
+    // special case for empty trees:
+    if(root == nullptr)
+    {
+        out << "<empty tree>\n";
+        return;
     }
 
-    uint16_t finalRowNumElements = (uint16_t)std::pow(2, printedTreeHeight - 1);
-    uint16_t finalRowWidth = ((uint16_t)(ELEMENT_WIDTH * finalRowNumElements - PADDING));
+    maxHeight = std::max(1u, std::min(maxHeight, (unsigned)PPBST_HEIGHT_LIMIT));
 
-    // get placeholders
+    // measure the printed levels
     // ----------------------------------------------------------------------
-    std::map<Key, uint8_t> valuePlaceholders;
-
-    uint8_t nextPlaceHolderVal = 1;
-    for(typename BinarySearchTree<Key, Value>::iterator treeIter = this->begin(); treeIter != this->end(); ++treeIter)
+    size_t height = 1;
+    size_t count = 0;
+    bool clippedFinalElements = false;
+    ppbstVisitTop(root, maxHeight, [&](Node<Key, Value>* node, size_t level, size_t, size_t)
     {
-
-        if(getNodeDepth(*this, root, treeIter.current_) != -1)
+        ++count;
+        height = std::max(height, level + 1);
+        if(level + 1 == maxHeight && (node->getLeft() != nullptr || node->getRight() != nullptr))
         {
-            // note; the iterator will traverse in sorted order so values should get the same placeholders between
-            // different calls as long as the tree is the same
-            valuePlaceholders.insert(std::make_pair(treeIter->first, nextPlaceHolderVal++));
+            clippedFinalElements = true;
         }
+    });
 
+    size_t digits = 2;
+    for(size_t limit = 100; limit <= count; limit *= 10)
+    {
+        ++digits;
     }
+    const size_t boxWidth = digits + 2;
+    const size_t elementWidth = boxWidth + 2; // distance between elements at bottom row
+
+    // column of the middle of the box of the node at level and index
+    auto center = [&](size_t level, size_t index) -> size_t
+    {
+        size_t span = (size_t)1 << (height - 1 - level);
+        return (index * span + (index * span + span - 1)) * elementWidth / 2 + boxWidth / 2;
+    };
 
     // print tree
     // ----------------------------------------------------------------------
-
-    // space in front of the first element of the previous row
-    uint16_t firstElementMargin = ((uint16_t)(finalRowWidth/2 - (BOX_WIDTH/2))); // start in the middle of where the last row will be
-
-    uint16_t elementPadding = ((uint16_t)(finalRowWidth - 2));
-
-    std::vector<Node<Key, Value> *> currRowNodes; // contains the 2^levelIndex nodes in this row, or nullptr to mark nonexistant nodes
-    currRowNodes.push_back(root);
-
-    for(size_t levelIndex = 0; levelIndex < printedTreeHeight; ++levelIndex)
+    for(size_t level = 0; level < height; ++level)
     {
-        uint16_t numElements =(uint16_t)std::pow(2, levelIndex);
-
         // print elements themselves
-        std::cout << std::string(firstElementMargin, ' ');
-        for(size_t elementIndex = 0; elementIndex < numElements; ++elementIndex)
+        size_t column = 0;
+        ppbstVisitTop(root, height, [&](Node<Key, Value>*, size_t nodeLevel, size_t index, size_t placeholder)
         {
-            if(currRowNodes[elementIndex] == nullptr)
+            if(nodeLevel != level)
             {
-                std::cout << "    ";
+                return;
             }
-            else
-            {
-                uint16_t placeholder = valuePlaceholders[currRowNodes[elementIndex]->getItem().first];
-                std::cout << "[" << std::setfill('0') << std::setw(2) << placeholder << "]";
-            }
-
-            if(elementIndex != ((uint16_t)(numElements - 1)))
-            {
-                std::cout << std::string(elementPadding, ' ');
-            }
-        }
-        std::cout << std::endl;
-
-        // spacing values for next row (worked out on paper)
-        elementPadding = ((uint16_t)((elementPadding - BOX_WIDTH) / 2));
-        firstElementMargin = ((uint16_t)(firstElementMargin - (elementPadding / 2 + 2)));
+            size_t start = center(level, index) - boxWidth / 2;
+            std::fill_n(std::ostreambuf_iterator<char>(out), start - column, ' ');
+            out.put('[');
+            ppbstWriteNumber(out, placeholder, digits);
+            out.put(']');
+            column = start + boxWidth;
+        });
+        out.put('\n');
 
-        // calculate node lists for next iteration
+        // print connecting lines
         // ---------------------------------------------------------------------
-        std::vector<Node<Key, Value> *> prevRowNodes = currRowNodes;
-        currRowNodes.clear();
-        for(typename std::vector<Node<Key, Value> *>::iterator prevRowIter = prevRowNodes.begin(); prevRowIter != prevRowNodes.end() ; ++prevRowIter)
+        if(level == height - 1)
+        {
+            continue;
+        }
+        column = 0;
+        ppbstVisitTop(root, height, [&](Node<Key, Value>* node, size_t nodeLevel, size_t index, size_t)
         {
-            if(*prevRowIter == nullptr)
+            if(nodeLevel != level)
             {
-                currRowNodes.push_back(nullptr);
-                currRowNodes.push_back(nullptr);
+                return;
             }
-            else
+            // branches run from under the box's brackets to just above the
+            // middle of each child's box
+            size_t start = center(level, index) - boxWidth / 2;
+            if(node->getLeft() != nullptr)
             {
-                currRowNodes.push_back((*prevRowIter)->getLeft());
-                currRowNodes.push_back((*prevRowIter)->getRight());
+                size_t left = center(level + 1, 2 * index);
+                std::fill_n(std::ostreambuf_iterator<char>(out), left - column, ' ');
+                out << "\u250c";
+                ppbstRepeat(out, u8"\u2500", start - left - 1);
+                out << "\u2518";
+                column = start + 1;
             }
-        }
-
-        // print connecting lines
-        // ---------------------------------------------------------------------
-        if(levelIndex < printedTreeHeight - 1)
-        {
-            // start above middle side of first element
-            std::cout << std::string(firstElementMargin + 2, ' ');
-
-            for(size_t prevRowElementIndex = 0; prevRowElementIndex < prevRowNodes.size(); ++prevRowElementIndex)
+            if(node->getRight() != nullptr)
             {
-                Node<Key, Value> * currNode = prevRowNodes[prevRowElementIndex];
-
-                // print first branch
-                if(currNode == nullptr || currNode->getLeft() == nullptr)
-                {
-                    std::cout << std::string(elementPadding/2 + 3, ' ');
-                }
-                else
-                {
-                    std::cout << "\u250c";
-
-                    for(int numLines = 0; numLines < (elementPadding/2 - 1); ++numLines)
-                    {
-                        std::cout << u8"\u2500";
-                    }
-
-                    std::cout << "\u2518  ";
-                }
-
-                // print second branch
-                if(currNode == nullptr || currNode->getRight() == nullptr)
-                {
-                    std::cout << std::string(elementPadding/2 + 3, ' ');
-                }
-                else
-                {
-                    std::cout << "\u2514";
-
-                    for(int numLines = 0; numLines < (elementPadding/2 - 1); ++numLines)
-                    {
-                        std::cout << u8"\u2500";
-                    }
-
-                    std::cout << "\u2510  ";
-                }
-
-                std::cout << std::string(elementPadding + 2, ' ');
-
+                size_t right = center(level + 1, 2 * index + 1) - 1;
+                std::fill_n(std::ostreambuf_iterator<char>(out), start + boxWidth - 1 - column, ' ');
+                out << "\u2514";
+                ppbstRepeat(out, u8"\u2500", right - (start + boxWidth));
+                out << "\u2510";
+                column = right + 1;
             }
-
-
-            std::cout << std::endl;
-
-        }
+        });
+        out.put('\n');
     }
 
-    std::cout << std::endl;
+    out.put('\n');
     if(clippedFinalElements)
     {
-        std::cout << "(deeper levels omitted due to space limitations)" << std::endl;
+        out << "(deeper levels omitted due to space limitations)\n";
     }
 
-
     if(!std::is_same<Key, uint8_t>::value) // print placeholder explanations if needed:
     {
-        std::cout << "Tree Placeholders:------------------" << std::endl;
-        for(typename std::map<Key, uint8_t>::iterator placeholdersIter = valuePlaceholders.begin(); placeholdersIter != valuePlaceholders.end(); ++placeholdersIter)
+        out << "Tree Placeholders:------------------\n";
+        ppbstVisitTop(root, height, [&](Node<Key, Value>* node, size_t, size_t, size_t placeholder)
         {
-            std::cout << '[' << std::setfill('0') << std::setw(2) << ((uint16_t)placeholdersIter->second) << "] -> ";
+            out.put('[');
+            ppbstWriteNumber(out, placeholder, digits);
+            out << "] -> (";
+            ppbstWriteItem(out, node->getKey(), 0);
+            out << ", ";
+            ppbstWriteItem(out, node->getValue(), 0);
+            out << ")\n";
+        });
+    }
+}
 
-            // print element with original cout flags
-            std::cout.flags(origCoutState);
-            std::cout << '(' << placeholdersIter->first << ", ";
+/**
+ * Forwards to another stream buffer, putting a backslash in front of
+ * every quote and backslash, so that whatever a key prints as can go
+ * inside a quoted DOT string.
+ */
+class DotEscapeBuffer : public std::streambuf
+{
+public:
+    explicit DotEscapeBuffer(std::streambuf* target) :
+        target_(target)
+    {
+    }
 
-            typename BinarySearchTree<Key, Value>::iterator elementIter = this->find(placeholdersIter->first);
-            if(elementIter == this->end())
+protected:
+    int_type overflow(int_type c)
+    {
+        if(traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            return traits_type::not_eof(c);
+        }
+        if((c == '"' || c == '\\') && traits_type::eq_int_type(target_->sputc('\\'), traits_type::eof()))
+        {
+            return traits_type::eof();
+        }
+        return target_->sputc(traits_type::to_char_type(c));
+    }
+
+private:
+    std::streambuf* target_;
+};
+
+/* Writes the tree as a Graphviz digraph, one statement per line:
+
+   digraph BST {
+       node [shape=box];
+       n94269265747680 [label="5"];
+       n94269265747680 -> n94269265747744 [tailport=sw];
+       ...
+   }
+
+   Nodes are named after their addresses, so names mean nothing between
+   runs. Edges to left children leave from the bottom left corner and
+   edges to right children from the bottom right, which is what tells
+   them apart when one is missing. With a maxHeight only that many levels
+   are written (0 writes them all), and nodes whose children were cut off
+   are drawn dashed.
+
+   The walk goes down child pointers and back up parent pointers, in
+   pre-order as save() does, so it needs no memory of its own however
+   large or deep the tree is; the output is limited only by out. It
+   relies on the parent pointers, so check a suspect tree with validate()
+   first. Keys are written with out's formatting flags, or as '?' if they
+   have no operator<<.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::printDot(std::ostream& out, unsigned maxHeight) const
+{
+    DotEscapeBuffer escaped(out.rdbuf());
+    std::ostream label(&escaped);
+    label.copyfmt(out);
+
+    out << "digraph BST {\n    node [shape=box];\n";
+    Node<Key, Value>* node = root_;
+    size_t depth = 1;
+    while(node != nullptr)
+    {
+        bool expand = maxHeight == 0 || depth < maxHeight;
+        bool hasChildren = node->getLeft() != nullptr || node->getRight() != nullptr;
+        out << "    n";
+        ppbstWriteNumber(out, (uintptr_t)node);
+        out << " [label=\"";
+        ppbstWriteItem(label, node->getKey(), 0);
+        label.flush();
+        out << (expand || !hasChildren ? "\"];\n" : "\", style=dashed];\n");
+        if(expand)
+        {
+            if(node->getLeft() != nullptr)
             {
-                std::cout << "<error: lookup failed>";
+                out << "    n";
+                ppbstWriteNumber(out, (uintptr_t)node);
+                out << " -> n";
+                ppbstWriteNumber(out, (uintptr_t)node->getLeft());
+                out << " [tailport=sw];\n";
             }
-            else
+            if(node->getRight() != nullptr)
             {
-                std::cout << elementIter->second;
+                out << "    n";
+                ppbstWriteNumber(out, (uintptr_t)node);
+                out << " -> n";
+                ppbstWriteNumber(out, (uintptr_t)node->getRight());
+                out << " [tailport=se];\n";
             }
+        }
 
-            std::cout << ')' << std::endl;
-
-
+        // Next in pre-order: a child, or the right child of the nearest
+        // ancestor reached from its left that has one.
+        if(expand && node->getLeft() != nullptr)
+        {
+            node = node->getLeft();
+            ++depth;
+            continue;
+        }
+        if(expand && node->getRight() != nullptr)
+        {
+            node = node->getRight();
+            ++depth;
+            continue;
+        }
+        while(node != root_)
+        {
+            Node<Key, Value>* parent = node->getParent();
+            if(node == parent->getLeft() && parent->getRight() != nullptr)
+            {
+                node = parent->getRight();
+                break;
+            }
+            node = parent;
+            --depth;
+        }
+        if(node == root_)
+        {
+            node = nullptr;
         }
     }
-
-    // restore original cout flags
-    std::cout.flags(origCoutState);
-
+    out << "}\n";
 }
 
 #endif
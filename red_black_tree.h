@@ -0,0 +1,597 @@
+#ifndef RED_BLACK_TREE_H
+#define RED_BLACK_TREE_H
+
+#include <functional>
+#include <utility>
+#include <vector>
+#include "bst.h"
+
+/**
+ * A node of a RedBlackTree. The colour is kept in the low bit of the
+ * parent pointer, so a RBNode is exactly the size of a plain Node. New
+ * nodes are red.
+ */
+template <class Key, class Value>
+class RBNode : public Node<Key, Value>
+{
+public:
+    RBNode(const Key& key, const Value& value, RBNode<Key, Value>* parent);
+    RBNode(Key&& key, Value&& value, RBNode<Key, Value>* parent);
+    ~RBNode();
+
+    bool isRed() const;
+    void setRed(bool red);
+
+    // Bulk-load hook: the node starts out black (see assignSorted).
+    void setSubtreeHeights(int leftHeight, int rightHeight);
+
+    // Getters that return RBNode pointers; they hide the base versions.
+    RBNode<Key, Value>* getParent() const;
+    RBNode<Key, Value>* getLeft() const;
+    RBNode<Key, Value>* getRight() const;
+
+    // The tag values; the other two mean the node is corrupt.
+    static const unsigned BLACK = 0;
+    static const unsigned RED = 1;
+};
+
+/* --- RBNode implementations --- */
+
+template<class Key, class Value>
+RBNode<Key, Value>::RBNode(const Key& key, const Value& value, RBNode<Key, Value>* parent) :
+    Node<Key, Value>(key, value, parent)
+{
+    setRed(true);
+}
+
+template<class Key, class Value>
+RBNode<Key, Value>::RBNode(Key&& key, Value&& value, RBNode<Key, Value>* parent) :
+    Node<Key, Value>(std::move(key), std::move(value), parent)
+{
+    setRed(true);
+}
+
+template<class Key, class Value>
+RBNode<Key, Value>::~RBNode()
+{
+    static_assert(sizeof(RBNode<Key, Value>) == sizeof(Node<Key, Value>),
+                  "a RBNode must be as small as a Node");
+}
+
+template<class Key, class Value>
+bool RBNode<Key, Value>::isRed() const
+{
+    return this->getTag() == RED;
+}
+
+template<class Key, class Value>
+void RBNode<Key, Value>::setRed(bool red)
+{
+    this->setTag(red ? RED : BLACK);
+}
+
+template<class Key, class Value>
+void RBNode<Key, Value>::setSubtreeHeights(int, int)
+{
+    setRed(false);
+}
+
+template<class Key, class Value>
+RBNode<Key, Value>* RBNode<Key, Value>::getParent() const
+{
+    return static_cast<RBNode<Key, Value>*>(Node<Key, Value>::getParent());
+}
+
+template<class Key, class Value>
+RBNode<Key, Value>* RBNode<Key, Value>::getLeft() const
+{
+    return static_cast<RBNode<Key, Value>*>(this->left_);
+}
+
+template<class Key, class Value>
+RBNode<Key, Value>* RBNode<Key, Value>::getRight() const
+{
+    return static_cast<RBNode<Key, Value>*>(this->right_);
+}
+
+/**
+ * RedBlackTree extends BinarySearchTree with red-black balancing: no red
+ * node has a red child, and every path from a node down to a missing
+ * child passes the same number of black nodes, so the tree is at most
+ * 2 log2(n + 1) high. An insert makes at most two rotations and a remove
+ * at most three; the rest of the fixing up is recolouring, which walks up
+ * O(log n) nodes at worst but O(1) amortized. That is less restructuring
+ * than AVLTree, whose removes can rotate at every level, at the cost of
+ * a less tightly balanced tree and so somewhat longer searches.
+ *
+ * validate() checks the red-black invariants in its single linear pass,
+ * and isBalanced() tests them rather than the stricter AVL height rule,
+ * which a valid red-black tree need not meet.
+ */
+template <class Key, class Value, class Compare = std::less<Key>, class Alloc = NodePool>
+class RedBlackTree : public BinarySearchTree<Key, Value, Compare, Alloc>
+{
+public:
+    typedef BinarySearchTree<Key, Value, Compare, Alloc> Base;
+    typedef typename Base::iterator iterator;
+
+    RedBlackTree();
+    explicit RedBlackTree(const Compare& comp);
+    template<typename InputIterator>
+    RedBlackTree(InputIterator first, InputIterator last);
+    RedBlackTree(const RedBlackTree& other);
+    RedBlackTree(RedBlackTree&& other);
+    virtual ~RedBlackTree();
+    RedBlackTree& operator=(const RedBlackTree& other);
+    RedBlackTree& operator=(RedBlackTree&& other);
+    RedBlackTree clone() const;
+    // Whether the red-black invariants hold.
+    virtual bool isBalanced() const override;
+    using Base::insert;
+    virtual void insert(const std::pair<const Key, Value>& keyValuePair) override;
+    virtual void remove(const Key& key) override;
+
+protected:
+    // Swaps the positions of two nodes and their colours, so each position
+    // keeps its colour.
+    void nodeSwap(RBNode<Key, Value>* n1, RBNode<Key, Value>* n2);
+
+    void rotateLeft(RBNode<Key, Value>* n);
+    void rotateRight(RBNode<Key, Value>* n);
+
+    // Restores the invariants after node, which is red, was linked in.
+    void insertFix(RBNode<Key, Value>* node);
+    // Restores them after a black node was removed from below parent,
+    // leaving node (maybe nullptr) one black node short.
+    void removeFix(RBNode<Key, Value>* node, RBNode<Key, Value>* parent);
+    // Unlinks and destroys node, then rebalances.
+    void removeNode(RBNode<Key, Value>* node);
+    // Colours the nodes depth levels below node red.
+    static void colourLevel(RBNode<Key, Value>* node, int depth);
+
+    // Nodes of a RedBlackTree are RBNodes.
+    virtual Node<Key, Value>* linkNewNode(Node<Key, Value>* parent, bool isLeft, Key&& key, Value&& value) override;
+    virtual void destroyNode(Node<Key, Value>* node) override;
+    virtual void assignSorted(const std::vector<std::pair<Key, Value> >& items) override;
+    virtual void copyNodes(const Base& other) override;
+    virtual void loadNodes(const char* records, size_t count) override;
+    virtual uint32_t imageKind() const override;
+    virtual unsigned checkNode(const Node<Key, Value>* node, int leftHeight, int rightHeight) const override;
+    // A node ranks by its black height: the black nodes below it on any
+    // path, itself included.
+    virtual int nodeRank(const Node<Key, Value>* node, int childRank) const override;
+
+    static bool isRed(const RBNode<Key, Value>* node) {
+        return node != nullptr && node->isRed();
+    }
+    static RBNode<Key, Value>* asRB(Node<Key, Value>* node) {
+        return static_cast<RBNode<Key, Value>*>(node);
+    }
+};
+
+/* --- RedBlackTree implementations --- */
+
+template<class Key, class Value, class Compare, class Alloc>
+RedBlackTree<Key, Value, Compare, Alloc>::RedBlackTree()
+{
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+RedBlackTree<Key, Value, Compare, Alloc>::RedBlackTree(const Compare& comp) :
+    Base(comp)
+{
+}
+
+/**
+ * Bulk-load constructor. The base constructor cannot reach the
+ * assignSorted override, so the range is loaded here.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+template<typename InputIterator>
+RedBlackTree<Key, Value, Compare, Alloc>::RedBlackTree(InputIterator first, InputIterator last)
+{
+    this->assign(first, last);
+}
+
+/**
+ * Copy constructor. The copy is made here, where the copyNodes override
+ * can be reached, and keeps every colour.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+RedBlackTree<Key, Value, Compare, Alloc>::RedBlackTree(const RedBlackTree& other) :
+    Base(other.comp_)
+{
+    copyNodes(other);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+RedBlackTree<Key, Value, Compare, Alloc>::RedBlackTree(RedBlackTree&& other) :
+    Base(std::move(other))
+{
+}
+
+/**
+ * The base destructor can no longer reach destroyNode's override,
+ * so the nodes are destroyed here.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+RedBlackTree<Key, Value, Compare, Alloc>::~RedBlackTree()
+{
+    this->clear();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+RedBlackTree<Key, Value, Compare, Alloc>& RedBlackTree<Key, Value, Compare, Alloc>::operator=(const RedBlackTree& other)
+{
+    Base::operator=(other);
+    return *this;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+RedBlackTree<Key, Value, Compare, Alloc>& RedBlackTree<Key, Value, Compare, Alloc>::operator=(RedBlackTree&& other)
+{
+    Base::operator=(std::move(other));
+    return *this;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+RedBlackTree<Key, Value, Compare, Alloc> RedBlackTree<Key, Value, Compare, Alloc>::clone() const
+{
+    return RedBlackTree(*this);
+}
+
+/**
+ * Inserts a key/value pair as a red leaf and rebalances, or updates the
+ * value if the key already exists.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+void RedBlackTree<Key, Value, Compare, Alloc>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    Node<Key, Value>* parent = nullptr;
+    bool isLeft = false;
+    Node<Key, Value>* existing = this->findSlot(keyValuePair.first, parent, isLeft);
+    if(existing != nullptr) {
+        existing->setValue(keyValuePair.second);
+        this->valueChanged(existing);
+        return;
+    }
+    linkNewNode(parent, isLeft, Key(keyValuePair.first), Value(keyValuePair.second));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+void RedBlackTree<Key, Value, Compare, Alloc>::remove(const Key& key)
+{
+    RBNode<Key, Value>* node = asRB(this->internalFind(key));
+    if(node != nullptr)
+        removeNode(node);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+Node<Key, Value>* RedBlackTree<Key, Value, Compare, Alloc>::linkNewNode(Node<Key, Value>* slot, bool isLeft, Key&& key, Value&& value)
+{
+    RBNode<Key, Value>* parent = asRB(slot);
+    RBNode<Key, Value>* node = this->createNode(std::move(key), std::move(value), parent);
+    ++this->size_;
+    if(parent == nullptr) {
+        this->root_ = node;
+        this->leftmost_ = node;
+        this->rightmost_ = node;
+    }
+    else if(isLeft) {
+        parent->setLeft(node);
+        if(parent == this->leftmost_)
+            this->leftmost_ = node;
+    }
+    else {
+        parent->setRight(node);
+        if(parent == this->rightmost_)
+            this->rightmost_ = node;
+    }
+    insertFix(node);
+    return node;
+}
+
+/**
+ * The base swap moves the nodes, and each keeps its tag; the colours are
+ * then swapped, since they belong to the positions.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+void RedBlackTree<Key, Value, Compare, Alloc>::nodeSwap(RBNode<Key, Value>* n1, RBNode<Key, Value>* n2)
+{
+    Base::nodeSwap(n1, n2);
+    bool red = n1->isRed();
+    n1->setRed(n2->isRed());
+    n2->setRed(red);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+void RedBlackTree<Key, Value, Compare, Alloc>::rotateLeft(RBNode<Key, Value>* n)
+{
+    RBNode<Key, Value>* r = n->getRight();
+    n->setRight(r->getLeft());
+    if(r->getLeft() != nullptr)
+        r->getLeft()->setParent(n);
+    r->setParent(n->getParent());
+    if(n->getParent() == nullptr)
+        this->root_ = r;
+    else if(n == n->getParent()->getLeft())
+        n->getParent()->setLeft(r);
+    else
+        n->getParent()->setRight(r);
+    r->setLeft(n);
+    n->setParent(r);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+void RedBlackTree<Key, Value, Compare, Alloc>::rotateRight(RBNode<Key, Value>* n)
+{
+    RBNode<Key, Value>* l = n->getLeft();
+    n->setLeft(l->getRight());
+    if(l->getRight() != nullptr)
+        l->getRight()->setParent(n);
+    l->setParent(n->getParent());
+    if(n->getParent() == nullptr)
+        this->root_ = l;
+    else if(n == n->getParent()->getRight())
+        n->getParent()->setRight(l);
+    else
+        n->getParent()->setLeft(l);
+    l->setRight(n);
+    n->setParent(l);
+}
+
+/**
+ * While node and its parent are both red: a red uncle means the
+ * grandparent can pass its black down to both children and the problem
+ * moves up two levels; a black uncle is fixed for good by one rotation at
+ * the grandparent, or two if node is an inner grandchild.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+void RedBlackTree<Key, Value, Compare, Alloc>::insertFix(RBNode<Key, Value>* node)
+{
+    while(true) {
+        RBNode<Key, Value>* parent = node->getParent();
+        if(parent == nullptr) {
+            node->setRed(false);
+            return;
+        }
+        if(!parent->isRed())
+            return;
+        // A red parent is not the root, so the grandparent exists.
+        RBNode<Key, Value>* grandparent = parent->getParent();
+        bool parentIsLeft = (parent == grandparent->getLeft());
+        RBNode<Key, Value>* uncle = parentIsLeft ? grandparent->getRight() : grandparent->getLeft();
+        if(isRed(uncle)) {
+            parent->setRed(false);
+            uncle->setRed(false);
+            grandparent->setRed(true);
+            node = grandparent;
+            continue;
+        }
+        if(parentIsLeft) {
+            if(node == parent->getRight()) {
+                this->stats_.countRotation(TreeCounters::LR);
+                rotateLeft(parent);
+                parent = node;
+            }
+            else
+                this->stats_.countRotation(TreeCounters::LL);
+            rotateRight(grandparent);
+        }
+        else {
+            if(node == parent->getLeft()) {
+                this->stats_.countRotation(TreeCounters::RL);
+                rotateRight(parent);
+                parent = node;
+            }
+            else
+                this->stats_.countRotation(TreeCounters::RR);
+            rotateLeft(grandparent);
+        }
+        parent->setRed(false);
+        grandparent->setRed(true);
+        return;
+    }
+}
+
+/**
+ * A node with two children first trades places with its predecessor, as
+ * in the base class, so the one unlinked has at most one child. Removing
+ * a red node changes no black count. A black one with a child leaves a
+ * red child, which turns black; otherwise removeFix makes up the loss.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+void RedBlackTree<Key, Value, Compare, Alloc>::removeNode(RBNode<Key, Value>* node)
+{
+    if(node->getLeft() != nullptr && node->getRight() != nullptr)
+        nodeSwap(node, asRB(Base::predecessor(node)));
+    if(node == this->leftmost_)
+        this->leftmost_ = Base::successor(node);
+    if(node == this->rightmost_)
+        this->rightmost_ = Base::predecessor(node);
+
+    RBNode<Key, Value>* child = (node->getLeft() != nullptr) ? node->getLeft() : node->getRight();
+    RBNode<Key, Value>* parent = node->getParent();
+    if(child != nullptr)
+        child->setParent(parent);
+    if(parent == nullptr)
+        this->root_ = child;
+    else if(parent->getLeft() == node)
+        parent->setLeft(child);
+    else
+        parent->setRight(child);
+    bool wasBlack = !node->isRed();
+    this->releaseNode(node);
+    --this->size_;
+
+    if(!wasBlack)
+        return;
+    if(isRed(child))
+        child->setRed(false);
+    else
+        removeFix(child, parent);
+}
+
+/**
+ * node's side of parent is one black node short. A red sibling is rotated
+ * above parent first, so the sibling is black. If both its children are
+ * black it turns red, which evens the two sides and moves the shortage up
+ * to parent; otherwise one rotation at parent, or two if only the inner
+ * nephew is red, lends node's side a black node and ends the fix.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+void RedBlackTree<Key, Value, Compare, Alloc>::removeFix(RBNode<Key, Value>* node, RBNode<Key, Value>* parent)
+{
+    while(parent != nullptr && !isRed(node)) {
+        // The sibling holds at least one black node, so it is not null,
+        // and a null node is told apart from it.
+        if(node == parent->getLeft()) {
+            RBNode<Key, Value>* sibling = parent->getRight();
+            if(sibling->isRed()) {
+                this->stats_.countRotation(TreeCounters::RR);
+                sibling->setRed(false);
+                parent->setRed(true);
+                rotateLeft(parent);
+                sibling = parent->getRight();
+            }
+            if(!isRed(sibling->getLeft()) && !isRed(sibling->getRight())) {
+                sibling->setRed(true);
+                node = parent;
+                parent = node->getParent();
+                continue;
+            }
+            if(!isRed(sibling->getRight())) {
+                this->stats_.countRotation(TreeCounters::RL);
+                sibling->getLeft()->setRed(false);
+                sibling->setRed(true);
+                rotateRight(sibling);
+                sibling = parent->getRight();
+            }
+            else
+                this->stats_.countRotation(TreeCounters::RR);
+            sibling->setRed(parent->isRed());
+            parent->setRed(false);
+            sibling->getRight()->setRed(false);
+            rotateLeft(parent);
+        }
+        else {
+            RBNode<Key, Value>* sibling = parent->getLeft();
+            if(sibling->isRed()) {
+                this->stats_.countRotation(TreeCounters::LL);
+                sibling->setRed(false);
+                parent->setRed(true);
+                rotateRight(parent);
+                sibling = parent->getLeft();
+            }
+            if(!isRed(sibling->getLeft()) && !isRed(sibling->getRight())) {
+                sibling->setRed(true);
+                node = parent;
+                parent = node->getParent();
+                continue;
+            }
+            if(!isRed(sibling->getLeft())) {
+                this->stats_.countRotation(TreeCounters::LR);
+                sibling->getRight()->setRed(false);
+                sibling->setRed(true);
+                rotateLeft(sibling);
+                sibling = parent->getLeft();
+            }
+            else
+                this->stats_.countRotation(TreeCounters::LL);
+            sibling->setRed(parent->isRed());
+            parent->setRed(false);
+            sibling->getLeft()->setRed(false);
+            rotateRight(parent);
+        }
+        return;
+    }
+    if(node != nullptr)
+        node->setRed(false);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+void RedBlackTree<Key, Value, Compare, Alloc>::destroyNode(Node<Key, Value>* node)
+{
+    this->releaseNode(asRB(node));
+}
+
+/**
+ * A tree built by halving has all its missing children on its last two
+ * levels, so with every node black but those on the last level, every
+ * path passes the same number of black nodes and no red node has a child.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+void RedBlackTree<Key, Value, Compare, Alloc>::assignSorted(const std::vector<std::pair<Key, Value> >& items)
+{
+    int height = this->template buildSubtree<RBNode<Key, Value> >(items, 0, items.size(), nullptr, true);
+    if(height > 1)
+        colourLevel(asRB(this->root_), height - 1);
+}
+
+/**
+ * Recurses only as deep as the bulk-loaded tree, which is balanced.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+void RedBlackTree<Key, Value, Compare, Alloc>::colourLevel(RBNode<Key, Value>* node, int depth)
+{
+    if(node == nullptr)
+        return;
+    if(depth == 0) {
+        node->setRed(true);
+        return;
+    }
+    colourLevel(node->getLeft(), depth - 1);
+    colourLevel(node->getRight(), depth - 1);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+void RedBlackTree<Key, Value, Compare, Alloc>::copyNodes(const Base& other)
+{
+    this->template cloneNodes<RBNode<Key, Value> >(other);
+}
+
+/**
+ * The image holds every colour, so the tree is ready as read.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+void RedBlackTree<Key, Value, Compare, Alloc>::loadNodes(const char* records, size_t count)
+{
+    this->template readNodes<RBNode<Key, Value> >(records, count);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+uint32_t RedBlackTree<Key, Value, Compare, Alloc>::imageKind() const
+{
+    return TREE_IMAGE_RED_BLACK;
+}
+
+/**
+ * The tag must be a colour, and a red node must not be the root or have a
+ * red child. validate checks that both children rank the same, which
+ * makes every path below a node equally black.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+unsigned RedBlackTree<Key, Value, Compare, Alloc>::checkNode(const Node<Key, Value>* node, int, int) const
+{
+    const RBNode<Key, Value>* rbNode = static_cast<const RBNode<Key, Value>*>(node);
+    unsigned problems = 0;
+    if(rbNode->saveState() != RBNode<Key, Value>::RED && rbNode->saveState() != RBNode<Key, Value>::BLACK)
+        problems |= TreeReport::STATE_ERROR;
+    if(rbNode->isRed() && (rbNode->getParent() == nullptr || isRed(rbNode->getLeft()) || isRed(rbNode->getRight())))
+        problems |= TreeReport::BALANCE_ERROR;
+    return problems;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+int RedBlackTree<Key, Value, Compare, Alloc>::nodeRank(const Node<Key, Value>* node, int childRank) const
+{
+    return childRank + !static_cast<const RBNode<Key, Value>*>(node)->isRed();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+bool RedBlackTree<Key, Value, Compare, Alloc>::isBalanced() const
+{
+    return this->validate().balanceErrors == 0;
+}
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef SPLAY_TREE_H
+#define SPLAY_TREE_H
+
+#include <functional>
+#include <utility>
+#include "bst.h"
+
+/**
+ * A self-adjusting BinarySearchTree: find, insert and remove splay the
+ * node they reach to the root. Any sequence of operations costs amortized
+ * O(log n) each, and a key that is used often stays near the root, so a
+ * skewed workload costs about the entropy of its key distribution rather
+ * than log n per operation.
+ *
+ * Splaying is top-down, as in Sleator and Tarjan: a single pass from the
+ * root splits the nodes it passes into a tree of smaller keys and one of
+ * larger keys, rotating at every second step along a straight path, and
+ * hangs both under the last node reached. Nothing is walked twice and no
+ * stack is needed, however deep the tree has become.
+ *
+ * The nodes are plain Nodes with no balancing state, so copies, bulk
+ * loads and images are the base class's, and an image saved by a
+ * BinarySearchTree loads into a SplayTree and back. Only the non-const
+ * find(key), insert and remove splay; the const find and the other lookups
+ * leave the tree alone, and emplace, try_emplace, insert_or_assign and the
+ * hinted insert splay only a node they add. Because find changes the
+ * tree, a SplayTree must not be read by several threads at once.
+ */
+template <class Key, class Value, class Compare = std::less<Key>, class Alloc = NodePool>
+class SplayTree : public BinarySearchTree<Key, Value, Compare, Alloc>
+{
+public:
+    typedef BinarySearchTree<Key, Value, Compare, Alloc> Base;
+    typedef typename Base::iterator iterator;
+
+    SplayTree();
+    explicit SplayTree(const Compare& comp);
+    template<typename InputIterator>
+    SplayTree(InputIterator first, InputIterator last);
+    SplayTree clone() const;
+
+    using Base::insert;
+    virtual void insert(const std::pair<const Key, Value>& keyValuePair) override;
+    void insert(std::pair<const Key, Value>&& keyValuePair);
+    virtual void remove(const Key& key) override;
+    using Base::find;
+    // Splays key, or the last node on its search path, to the root.
+    iterator find(const Key& key);
+
+protected:
+    // Brings the node with key to the root and returns it, or brings the
+    // last node on key's search path (its predecessor or successor) there
+    // and returns nullptr. Does nothing to an empty tree.
+    Node<Key, Value>* splay(const Key& key);
+    // Makes node, which is new and not yet linked, the root: the old root,
+    // just splayed by node's key, goes below it on one side along with its
+    // subtree on that side, and its other subtree moves over to node.
+    void linkAtRoot(Node<Key, Value>* node);
+    // Nodes added in place are linked as a leaf and then splayed.
+    virtual Node<Key, Value>* linkNewNode(Node<Key, Value>* parent, bool isLeft, Key&& key, Value&& value) override;
+};
+
+/* --- SplayTree implementations --- */
+
+template<class Key, class Value, class Compare, class Alloc>
+SplayTree<Key, Value, Compare, Alloc>::SplayTree()
+{
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+SplayTree<Key, Value, Compare, Alloc>::SplayTree(const Compare& comp) :
+    Base(comp)
+{
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename InputIterator>
+SplayTree<Key, Value, Compare, Alloc>::SplayTree(InputIterator first, InputIterator last) :
+    Base(first, last)
+{
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+SplayTree<Key, Value, Compare, Alloc> SplayTree<Key, Value, Compare, Alloc>::clone() const
+{
+    return SplayTree(*this);
+}
+
+/**
+ * The left tree collects the nodes passed whose keys are smaller than key,
+ * each hung as the right child of the one before; the right tree collects
+ * the larger ones down its left side. A node's link to where the search
+ * went next is stale until the next node joins its tree or the two trees
+ * are hung under the last node, and so are the parent links of the nodes
+ * still on the path, until they join a tree or become the root.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+Node<Key, Value>* SplayTree<Key, Value, Compare, Alloc>::splay(const Key& key)
+{
+    Node<Key, Value>* node = this->root_;
+    if(node == nullptr)
+        return nullptr;
+    Node<Key, Value>* leftRoot = nullptr;
+    Node<Key, Value>* leftMax = nullptr;
+    Node<Key, Value>* rightRoot = nullptr;
+    Node<Key, Value>* rightMin = nullptr;
+    bool found = false;
+    size_t depth = 1;
+    size_t comparisons = 0;
+    while(true) {
+        bool goLeft = this->comp_(key, node->getKey());
+        ++comparisons;
+        if(!goLeft) {
+            ++comparisons;
+            if(!this->comp_(node->getKey(), key)) {
+                found = true;
+                break;
+            }
+        }
+        if(goLeft) {
+            Node<Key, Value>* child = node->getLeft();
+            if(child == nullptr)
+                break;
+            ++comparisons;
+            if(this->comp_(key, child->getKey())) {
+                // Two steps left: rotate right first.
+                node->setLeft(child->getRight());
+                if(child->getRight() != nullptr)
+                    child->getRight()->setParent(node);
+                child->setRight(node);
+                node->setParent(child);
+                node = child;
+                ++depth;
+                child = node->getLeft();
+                if(child == nullptr)
+                    break;
+            }
+            if(rightMin == nullptr)
+                rightRoot = node;
+            else {
+                rightMin->setLeft(node);
+                node->setParent(rightMin);
+            }
+            rightMin = node;
+            node = child;
+            ++depth;
+        }
+        else {
+            Node<Key, Value>* child = node->getRight();
+            if(child == nullptr)
+                break;
+            ++comparisons;
+            if(this->comp_(child->getKey(), key)) {
+                // Two steps right: rotate left first.
+                node->setRight(child->getLeft());
+                if(child->getLeft() != nullptr)
+                    child->getLeft()->setParent(node);
+                child->setLeft(node);
+                node->setParent(child);
+                node = child;
+                ++depth;
+                child = node->getRight();
+                if(child == nullptr)
+                    break;
+            }
+            if(leftMax == nullptr)
+                leftRoot = node;
+            else {
+                leftMax->setRight(node);
+                node->setParent(leftMax);
+            }
+            leftMax = node;
+            node = child;
+            ++depth;
+        }
+    }
+
+    if(leftMax != nullptr) {
+        leftMax->setRight(node->getLeft());
+        if(node->getLeft() != nullptr)
+            node->getLeft()->setParent(leftMax);
+        node->setLeft(leftRoot);
+        leftRoot->setParent(node);
+    }
+    if(rightMin != nullptr) {
+        rightMin->setLeft(node->getRight());
+        if(node->getRight() != nullptr)
+            node->getRight()->setParent(rightMin);
+        node->setRight(rightRoot);
+        rightRoot->setParent(node);
+    }
+    node->setParent(nullptr);
+    this->root_ = node;
+    this->stats_.countSearch(depth, comparisons);
+    return found ? node : nullptr;
+}
+
+/**
+ * The old root is key's successor or predecessor, so everything in its
+ * subtree on the near side is on that side of the new key too.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+void SplayTree<Key, Value, Compare, Alloc>::linkAtRoot(Node<Key, Value>* node)
+{
+    Node<Key, Value>* root = this->root_;
+    if(root != nullptr) {
+        if(this->comp_(node->getKey(), root->getKey())) {
+            node->setLeft(root->getLeft());
+            root->setLeft(nullptr);
+            node->setRight(root);
+        }
+        else {
+            node->setRight(root->getRight());
+            root->setRight(nullptr);
+            node->setLeft(root);
+        }
+        if(node->getLeft() != nullptr)
+            node->getLeft()->setParent(node);
+        if(node->getRight() != nullptr)
+            node->getRight()->setParent(node);
+    }
+    this->root_ = node;
+    ++this->size_;
+    if(node->getLeft() == nullptr)
+        this->leftmost_ = node;
+    if(node->getRight() == nullptr)
+        this->rightmost_ = node;
+}
+
+/**
+ * Inserts a key/value pair at the root, or updates the value if the key
+ * already exists, which also brings it to the root.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+void SplayTree<Key, Value, Compare, Alloc>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    Node<Key, Value>* existing = splay(keyValuePair.first);
+    if(existing != nullptr) {
+        existing->setValue(keyValuePair.second);
+        this->valueChanged(existing);
+        return;
+    }
+    linkAtRoot(this->createNode(keyValuePair.first, keyValuePair.second, static_cast<Node<Key, Value>*>(nullptr)));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+void SplayTree<Key, Value, Compare, Alloc>::insert(std::pair<const Key, Value>&& keyValuePair)
+{
+    Node<Key, Value>* existing = splay(keyValuePair.first);
+    if(existing != nullptr) {
+        existing->setValue(std::move(keyValuePair.second));
+        this->valueChanged(existing);
+        return;
+    }
+    linkAtRoot(this->createNode(Key(keyValuePair.first), std::move(keyValuePair.second),
+                                static_cast<Node<Key, Value>*>(nullptr)));
+}
+
+/**
+ * Splays the key to the root and removes it there, as the base class
+ * would: a root with two children trades places with its predecessor,
+ * which stays at the root.
+ */
+template<class Key, class Value, class Compare, class Alloc>
+void SplayTree<Key, Value, Compare, Alloc>::remove(const Key& key)
+{
+    Node<Key, Value>* node = splay(key);
+    if(node != nullptr)
+        this->removeNode(node);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename SplayTree<Key, Value, Compare, Alloc>::iterator SplayTree<Key, Value, Compare, Alloc>::find(const Key& key)
+{
+    return this->iteratorAt(splay(key));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+Node<Key, Value>* SplayTree<Key, Value, Compare, Alloc>::linkNewNode(Node<Key, Value>* parent, bool isLeft, Key&& key, Value&& value)
+{
+    Node<Key, Value>* node = Base::linkNewNode(parent, isLeft, std::move(key), std::move(value));
+    splay(node->getKey());
+    return node;
+}
+
+#endif
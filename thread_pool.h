@@ -0,0 +1,167 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads for fork-join parallelism, as used by the
+ * parallel tree operations. invoke(first, second) offers first to the
+ * workers, runs second on the calling thread, and returns when both are
+ * done. While it waits it runs other queued tasks itself, so recursive
+ * invokes from inside tasks never leave every thread blocked.
+ *
+ * A pool of zero threads is valid and runs everything on the caller.
+ */
+class ThreadPool
+{
+public:
+    explicit ThreadPool(std::size_t threads = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    // Number of worker threads, not counting callers of invoke.
+    std::size_t size() const;
+
+    // Runs first and second, possibly in parallel. If either throws, the
+    // exception is rethrown once both have finished.
+    template<typename First, typename Second>
+    void invoke(First first, Second second);
+
+private:
+    // A task offered to the workers; lives on the stack of invoke.
+    struct Job
+    {
+        std::function<void()> fn;
+        std::atomic<bool> done;
+        std::exception_ptr error;
+    };
+
+    void workerLoop();
+    // Takes one queued job and runs it; returns false if there was none.
+    bool runOne();
+    static void run(Job* job);
+
+    std::vector<std::thread> workers_;
+    std::deque<Job*> queue_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    bool stopping_;
+
+    // Not copyable.
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+};
+
+/* --- ThreadPool implementations --- */
+
+inline ThreadPool::ThreadPool(std::size_t threads) :
+    stopping_(false)
+{
+    for(std::size_t i = 0; i < threads; ++i) {
+        workers_.push_back(std::thread(&ThreadPool::workerLoop, this));
+    }
+}
+
+inline ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    ready_.notify_all();
+    for(std::size_t i = 0; i < workers_.size(); ++i) {
+        workers_[i].join();
+    }
+}
+
+inline std::size_t ThreadPool::size() const
+{
+    return workers_.size();
+}
+
+template<typename First, typename Second>
+void ThreadPool::invoke(First first, Second second)
+{
+    if(workers_.empty()) {
+        first();
+        second();
+        return;
+    }
+    Job job;
+    job.fn = first;
+    job.done.store(false);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(&job);
+    }
+    ready_.notify_one();
+
+    std::exception_ptr error;
+    try {
+        second();
+    }
+    catch(...) {
+        error = std::current_exception();
+    }
+    // The job may still be queued; help out rather than block.
+    while(!job.done.load()) {
+        if(!runOne())
+            std::this_thread::yield();
+    }
+    if(error)
+        std::rethrow_exception(error);
+    if(job.error)
+        std::rethrow_exception(job.error);
+}
+
+inline void ThreadPool::workerLoop()
+{
+    while(true) {
+        Job* job = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while(queue_.empty() && !stopping_) {
+                ready_.wait(lock);
+            }
+            if(queue_.empty())
+                return;
+            job = queue_.front();
+            queue_.pop_front();
+        }
+        run(job);
+    }
+}
+
+inline bool ThreadPool::runOne()
+{
+    Job* job = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(queue_.empty())
+            return false;
+        job = queue_.back();
+        queue_.pop_back();
+    }
+    run(job);
+    return true;
+}
+
+inline void ThreadPool::run(Job* job)
+{
+    try {
+        job->fn();
+    }
+    catch(...) {
+        job->error = std::current_exception();
+    }
+    job->done.store(true);
+}
+
+#endif
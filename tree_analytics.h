@@ -0,0 +1,414 @@
+#ifndef TREE_ANALYTICS_H
+#define TREE_ANALYTICS_H
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <vector>
+#include "equal-paths.h"
+#include "thread_pool.h"
+
+/**
+ * Leaf-depth statistics for the Node trees of equal-paths.h, computed in
+ * parallel over a ThreadPool.
+ *
+ * Depths count edges from the root, so a lone root is a leaf at depth 0.
+ * The top levels of the tree are split into tasks with ThreadPool::invoke,
+ * a few levels more than there are threads, and a waiting task runs other
+ * queued ones itself, so uneven subtrees even out. Below the split each
+ * task walks its subtree with a Morris traversal, which needs no stack at
+ * any depth: it temporarily links the rightmost node of each left subtree
+ * back up to the subtree's parent, and removes every such link before it
+ * returns. The tree is therefore modified while a walk is running and
+ * must not be read by anything else at the same time.
+ */
+
+/**
+ * The depths of a tree's leaves: how many there are, the shallowest and
+ * deepest, and a histogram where histogram[i] counts the leaves at depth
+ * minDepth + i. All zero and empty for an empty tree.
+ */
+struct LeafDepthStats
+{
+    LeafDepthStats();
+
+    // Leaves at the given depth.
+    size_t leavesAt(long depth) const;
+    // Adds other's leaves to these.
+    void merge(const LeafDepthStats& other);
+
+    size_t leaves;
+    long minDepth;
+    long maxDepth;
+    std::vector<size_t> histogram;
+};
+
+// The statistics for root's tree. With a pool the work is shared across
+// its threads; without one it all runs on the caller.
+LeafDepthStats leafDepthStats(Node* root, ThreadPool* pool = nullptr);
+
+// Whether every leaf of root's tree is at the same depth. The same walk
+// as leafDepthStats, but every task stops at the first leaf whose depth
+// differs from the first one found anywhere, or as soon as it is deeper.
+bool sameLeafDepths(Node* root, ThreadPool* pool = nullptr);
+
+namespace tree_analytics_detail {
+
+/**
+ * Counts leaf depths into a histogram that grows at either end by at least
+ * its own size, so each add is amortized O(1) whatever order the depths
+ * come in.
+ */
+class DepthCounter
+{
+public:
+    DepthCounter();
+    void add(long depth);
+    // The counts so far, trimmed to [minDepth, maxDepth].
+    LeafDepthStats stats() const;
+
+private:
+    std::vector<size_t> counts_;
+    long first_;        // depth counted by counts_[0]
+    size_t leaves_;
+    long minDepth_;
+    long maxDepth_;
+};
+
+/**
+ * Collects every leaf into a DepthCounter; never stops early.
+ */
+struct CountLeaves
+{
+    DepthCounter counter;
+
+    bool leaf(long depth)
+    {
+        counter.add(depth);
+        return true;
+    }
+    long limit() const
+    {
+        return LONG_MAX;
+    }
+    void mismatch() { }
+};
+
+/**
+ * The state shared by the tasks of one sameLeafDepths call: the depth of
+ * the first leaf any of them found, and whether one has seen a mismatch.
+ */
+struct SharedDepth
+{
+    std::atomic<long> depth;    // -1 until the first leaf
+    std::atomic<bool> failed;
+};
+
+/**
+ * Checks every leaf against the shared depth. Its limit, the depth below
+ * which the walk cannot go, drops to -1 once any task has failed, which
+ * stops the others too.
+ */
+struct MatchLeaves
+{
+    SharedDepth* shared;
+
+    bool leaf(long depth)
+    {
+        long expected = -1;
+        if(shared->depth.compare_exchange_strong(expected, depth, std::memory_order_relaxed) ||
+           expected == depth)
+            return true;
+        mismatch();
+        return false;
+    }
+    long limit() const
+    {
+        if(shared->failed.load(std::memory_order_relaxed))
+            return -1;
+        long depth = shared->depth.load(std::memory_order_relaxed);
+        return (depth == -1) ? LONG_MAX : depth;
+    }
+    void mismatch()
+    {
+        shared->failed.store(true, std::memory_order_relaxed);
+    }
+};
+
+void removeThreads(Node* cur, size_t threads);
+
+template<typename Visitor>
+bool walkLeaves(Node* root, long rootDepth, Visitor& visitor);
+
+template<typename Visitor>
+bool walkSubtree(Node* node, long depth, ThreadPool* pool, int splits, Visitor& visitor,
+                 std::vector<Visitor>& results);
+
+int splitLevels(ThreadPool* pool);
+
+} // namespace tree_analytics_detail
+
+/* --- LeafDepthStats implementations --- */
+
+inline LeafDepthStats::LeafDepthStats() :
+    leaves(0),
+    minDepth(0),
+    maxDepth(0)
+{
+}
+
+inline size_t LeafDepthStats::leavesAt(long depth) const
+{
+    if(leaves == 0 || depth < minDepth || depth > maxDepth)
+        return 0;
+    return histogram[depth - minDepth];
+}
+
+inline void LeafDepthStats::merge(const LeafDepthStats& other)
+{
+    if(other.leaves == 0)
+        return;
+    if(leaves == 0) {
+        *this = other;
+        return;
+    }
+    long low = std::min(minDepth, other.minDepth);
+    long high = std::max(maxDepth, other.maxDepth);
+    std::vector<size_t> merged(high - low + 1, 0);
+    for(size_t i = 0; i < histogram.size(); ++i) {
+        merged[minDepth - low + i] += histogram[i];
+    }
+    for(size_t i = 0; i < other.histogram.size(); ++i) {
+        merged[other.minDepth - low + i] += other.histogram[i];
+    }
+    histogram.swap(merged);
+    leaves += other.leaves;
+    minDepth = low;
+    maxDepth = high;
+}
+
+/* --- tree_analytics_detail implementations --- */
+
+namespace tree_analytics_detail {
+
+inline DepthCounter::DepthCounter() :
+    first_(0),
+    leaves_(0),
+    minDepth_(0),
+    maxDepth_(0)
+{
+}
+
+inline void DepthCounter::add(long depth)
+{
+    if(leaves_ == 0) {
+        counts_.assign(1, 0);
+        first_ = depth;
+        minDepth_ = depth;
+        maxDepth_ = depth;
+    }
+    if(depth < first_) {
+        size_t grow = std::max((size_t)(first_ - depth), counts_.size());
+        counts_.insert(counts_.begin(), grow, 0);
+        first_ -= (long)grow;
+    }
+    else if(depth - first_ >= (long)counts_.size()) {
+        counts_.resize(std::max((size_t)(depth - first_ + 1), 2 * counts_.size()), 0);
+    }
+    ++counts_[depth - first_];
+    ++leaves_;
+    minDepth_ = std::min(minDepth_, depth);
+    maxDepth_ = std::max(maxDepth_, depth);
+}
+
+inline LeafDepthStats DepthCounter::stats() const
+{
+    LeafDepthStats stats;
+    if(leaves_ == 0)
+        return stats;
+    stats.leaves = leaves_;
+    stats.minDepth = minDepth_;
+    stats.maxDepth = maxDepth_;
+    stats.histogram.assign(counts_.begin() + (minDepth_ - first_),
+                           counts_.begin() + (maxDepth_ - first_ + 1));
+    return stats;
+}
+
+/**
+ * Removes the links an unfinished walk left behind. Every linked node has
+ * cur in its left subtree, so walking right from cur (down real right
+ * links, and up temporary ones) reaches each of them in turn, innermost
+ * first; no new left subtree is entered on the way.
+ */
+inline void removeThreads(Node* cur, size_t threads)
+{
+    while(threads > 0) {
+        if(cur->left != nullptr) {
+            Node* pred = cur->left;
+            while(pred->right != nullptr && pred->right != cur) {
+                pred = pred->right;
+            }
+            if(pred->right == cur) {
+                pred->right = nullptr;
+                --threads;
+            }
+        }
+        cur = cur->right;
+    }
+}
+
+/**
+ * Morris traversal of root's subtree, passing each leaf's depth to the
+ * visitor. Coming back up a temporary link from a node's predecessor
+ * climbs one level plus one per right link down to it, which is how the
+ * depth is kept without parent pointers. A leaf either has no right link
+ * at all, if it is the subtree's last node in order, or has a temporary
+ * one, and is seen when the walk comes back up it.
+ *
+ * Returns false, with the tree restored, as soon as the visitor rejects a
+ * leaf or the walk reaches a node deeper than visitor.limit() (or a node
+ * with children at that depth, whose leaves would be deeper still).
+ */
+template<typename Visitor>
+bool walkLeaves(Node* root, long rootDepth, Visitor& visitor)
+{
+    long depth = rootDepth;   // depth of cur
+    size_t threads = 0;       // temporary links in place
+    Node* cur = root;
+    while(cur != nullptr) {
+        if(cur->left == nullptr) {
+            if(depth > visitor.limit()) {
+                visitor.mismatch();
+                removeThreads(cur, threads);
+                return false;
+            }
+            // The last node in order: no links are left.
+            if(cur->right == nullptr && !visitor.leaf(depth))
+                return false;
+            cur = cur->right;
+            ++depth;
+            continue;
+        }
+
+        Node* pred = cur->left;
+        long steps = 0;
+        while(pred->right != nullptr && pred->right != cur) {
+            pred = pred->right;
+            ++steps;
+        }
+        if(pred->right == nullptr) {
+            // First time here, on the way down.
+            if(depth >= visitor.limit()) {
+                visitor.mismatch();
+                removeThreads(cur, threads);
+                return false;
+            }
+            pred->right = cur;
+            ++threads;
+            cur = cur->left;
+            ++depth;
+        }
+        else {
+            // Back up from pred, after cur's left subtree.
+            pred->right = nullptr;
+            --threads;
+            long predDepth = depth - 1;
+            if(pred->left == nullptr && !visitor.leaf(predDepth)) {
+                removeThreads(cur, threads);
+                return false;
+            }
+            depth = predDepth - steps - 1;
+            cur = cur->right;
+            ++depth;
+        }
+    }
+    return true;
+}
+
+/**
+ * Walks node's subtree, which starts at the given depth. While splits are
+ * left, chains of single children are followed down and the two subtrees
+ * below are walked as parallel tasks, each with its own visitor, which
+ * then go to results; the rest goes to visitor.
+ */
+template<typename Visitor>
+bool walkSubtree(Node* node, long depth, ThreadPool* pool, int splits, Visitor& visitor,
+                 std::vector<Visitor>& results)
+{
+    if(pool != nullptr && splits > 0) {
+        while((node->left == nullptr) != (node->right == nullptr)) {
+            node = (node->left != nullptr) ? node->left : node->right;
+            ++depth;
+        }
+    }
+    if(pool == nullptr || splits == 0 || node->left == nullptr)
+        return walkLeaves(node, depth, visitor);
+
+    Visitor leftVisitor = visitor;
+    Visitor rightVisitor = visitor;
+    std::vector<Visitor> leftResults;
+    std::vector<Visitor> rightResults;
+    bool leftOk = true;
+    bool rightOk = true;
+    pool->invoke(
+        [&]() { leftOk = walkSubtree(node->left, depth + 1, pool, splits - 1, leftVisitor, leftResults); },
+        [&]() { rightOk = walkSubtree(node->right, depth + 1, pool, splits - 1, rightVisitor, rightResults); });
+    results.push_back(leftVisitor);
+    results.push_back(rightVisitor);
+    results.insert(results.end(), leftResults.begin(), leftResults.end());
+    results.insert(results.end(), rightResults.begin(), rightResults.end());
+    return leftOk && rightOk;
+}
+
+/**
+ * As many levels of tasks as it takes to give every thread one, and two
+ * more to even out the halves.
+ */
+inline int splitLevels(ThreadPool* pool)
+{
+    int levels = 0;
+    if(pool != nullptr) {
+        for(size_t threads = pool->size(); threads > 0; threads /= 2) {
+            ++levels;
+        }
+        if(levels > 0)
+            levels += 2;
+    }
+    return levels;
+}
+
+} // namespace tree_analytics_detail
+
+/* --- Entry points --- */
+
+inline LeafDepthStats leafDepthStats(Node* root, ThreadPool* pool)
+{
+    using namespace tree_analytics_detail;
+    if(root == nullptr)
+        return LeafDepthStats();
+    CountLeaves visitor;
+    std::vector<CountLeaves> results;
+    walkSubtree(root, 0, pool, splitLevels(pool), visitor, results);
+    LeafDepthStats stats = visitor.counter.stats();
+    for(size_t i = 0; i < results.size(); ++i) {
+        stats.merge(results[i].counter.stats());
+    }
+    return stats;
+}
+
+inline bool sameLeafDepths(Node* root, ThreadPool* pool)
+{
+    using namespace tree_analytics_detail;
+    if(root == nullptr)
+        return true;
+    SharedDepth shared;
+    shared.depth.store(-1);
+    shared.failed.store(false);
+    MatchLeaves visitor = { &shared };
+    std::vector<MatchLeaves> results;
+    return walkSubtree(root, 0, pool, splitLevels(pool), visitor, results) &&
+           !shared.failed.load();
+}
+
+#endif
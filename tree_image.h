@@ -0,0 +1,121 @@
+#ifndef TREE_IMAGE_H
+#define TREE_IMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * The on-disk image written by BinarySearchTree::save and read by load.
+ *
+ * A TreeImageHeader is followed by one record per node, in pre-order:
+ *
+ *   Key bytes | Value bytes | shape byte
+ *
+ * packed with no padding. Bit 0 of the shape byte is set if the node has a
+ * left child and bit 1 if it has a right child; bits 2-3 hold the node's
+ * balancing state (an AVL balance factor, say). The tree's shape can be
+ * rebuilt from that in one pass with no comparisons and no rebalancing.
+ * Keys and values are stored as raw bytes, so they must be trivially
+ * copyable, and an image is only readable on a machine with the same byte
+ * order and type sizes, which the header records. The header also records
+ * which kind of tree wrote the image, since the balancing state means
+ * something different to each.
+ */
+struct TreeImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;   // TREE_IMAGE_BYTE_ORDER as written
+    uint32_t keySize;
+    uint32_t valueSize;
+    uint32_t recordSize;
+    uint32_t treeKind;    // TREE_IMAGE_BST, TREE_IMAGE_AVL, ...
+    uint64_t count;       // number of records
+};
+
+static const char TREE_IMAGE_MAGIC[8] = { 'B', 'S', 'T', 'I', 'M', 'A', 'G', 'E' };
+static const uint32_t TREE_IMAGE_VERSION = 1;
+static const uint32_t TREE_IMAGE_BYTE_ORDER = 0x01020304;
+
+static const uint32_t TREE_IMAGE_BST = 0;
+static const uint32_t TREE_IMAGE_AVL = 1;
+static const uint32_t TREE_IMAGE_RED_BLACK = 2;
+
+static const unsigned char TREE_IMAGE_HAS_LEFT = 1;
+static const unsigned char TREE_IMAGE_HAS_RIGHT = 2;
+static const unsigned TREE_IMAGE_STATE_SHIFT = 2;
+
+/**
+ * A whole file mapped read-only into memory, unmapped on destruction.
+ * Throws std::runtime_error if the file cannot be opened or mapped.
+ */
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    const char* data() const;
+    size_t size() const;
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const char* data_;
+    size_t size_;
+};
+
+/* --- MappedFile implementations --- */
+
+inline MappedFile::MappedFile(const std::string& path) :
+    data_(nullptr),
+    size_(0)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error("cannot open " + path);
+    struct stat info;
+    if(::fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw std::runtime_error("cannot stat " + path);
+    }
+    size_ = (size_t)info.st_size;
+    if(size_ > 0) {
+        void* mapped = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapped == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("cannot map " + path);
+        }
+        // The file is read front to back exactly once.
+        ::madvise(mapped, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(mapped);
+    }
+    // The mapping stays valid after the descriptor is closed.
+    ::close(fd);
+}
+
+inline MappedFile::~MappedFile()
+{
+    if(data_ != nullptr)
+        ::munmap(const_cast<char*>(data_), size_);
+}
+
+inline const char* MappedFile::data() const
+{
+    return data_;
+}
+
+inline size_t MappedFile::size() const
+{
+    return size_;
+}
+
+#endif
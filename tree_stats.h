@@ -0,0 +1,191 @@
+#ifndef TREE_STATS_H
+#define TREE_STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#ifdef BST_STATS
+#include <atomic>
+#endif
+
+/**
+ * A snapshot of one tree's hot-path counters, from stats().
+ *
+ * The counters are only kept when the program is compiled with
+ * -DBST_STATS; otherwise enabled is false, every count is zero and the
+ * counting compiles away entirely. A tree counts what it did itself: a
+ * copy starts from zero, and nodes that move between trees in a split or
+ * join are counted where they were made or destroyed.
+ */
+struct TreeStats
+{
+#ifdef BST_STATS
+    static const bool enabled = true;
+#else
+    static const bool enabled = false;
+#endif
+    // searchDepth[d] counts searches that compared against d nodes; the
+    // last bucket also takes every deeper search.
+    static const size_t DEPTH_BUCKETS = 64;
+
+    TreeStats();
+
+    uint64_t searches;          // descents by find, insert, remove, ...
+    uint64_t comparisons;       // key comparisons made by those descents
+    uint64_t rotationsLL;       // rebalancing cases, from insert and remove
+    uint64_t rotationsLR;
+    uint64_t rotationsRR;
+    uint64_t rotationsRL;
+    uint64_t nodeSwaps;
+    uint64_t allocations;       // nodes created
+    uint64_t deallocations;     // nodes destroyed
+    uint64_t searchDepth[DEPTH_BUCKETS];
+};
+
+/**
+ * The live counters behind TreeStats, one set per tree. Every update is a
+ * relaxed atomic add, so trees read under a shared lock can count too;
+ * searches count in a local and publish once at the end. Without
+ * BST_STATS this is an empty class whose members do nothing.
+ */
+class TreeCounters
+{
+public:
+    enum Rotation { LL, LR, RR, RL };
+
+    void countSearch(size_t depth, size_t comparisons);
+    void countRotation(Rotation kind);
+    void countNodeSwap();
+    void countAllocation();
+    void countDeallocation();
+
+    TreeStats snapshot() const;
+    void reset();
+
+#ifdef BST_STATS
+    TreeCounters();
+
+private:
+    TreeCounters(const TreeCounters&);
+    TreeCounters& operator=(const TreeCounters&);
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t amount);
+
+    std::atomic<uint64_t> searches_;
+    std::atomic<uint64_t> comparisons_;
+    std::atomic<uint64_t> rotations_[4];
+    std::atomic<uint64_t> nodeSwaps_;
+    std::atomic<uint64_t> allocations_;
+    std::atomic<uint64_t> deallocations_;
+    std::atomic<uint64_t> searchDepth_[TreeStats::DEPTH_BUCKETS];
+#endif
+};
+
+/* --- TreeStats implementations --- */
+
+inline TreeStats::TreeStats() :
+    searches(0),
+    comparisons(0),
+    rotationsLL(0),
+    rotationsLR(0),
+    rotationsRR(0),
+    rotationsRL(0),
+    nodeSwaps(0),
+    allocations(0),
+    deallocations(0)
+{
+    for(size_t d = 0; d < DEPTH_BUCKETS; ++d) {
+        searchDepth[d] = 0;
+    }
+}
+
+/* --- TreeCounters implementations --- */
+
+#ifdef BST_STATS
+
+inline TreeCounters::TreeCounters()
+{
+    reset();
+}
+
+inline void TreeCounters::add(std::atomic<uint64_t>& counter, uint64_t amount)
+{
+    counter.fetch_add(amount, std::memory_order_relaxed);
+}
+
+inline void TreeCounters::countSearch(size_t depth, size_t comparisons)
+{
+    add(searches_, 1);
+    add(comparisons_, comparisons);
+    add(searchDepth_[depth < TreeStats::DEPTH_BUCKETS ? depth : TreeStats::DEPTH_BUCKETS - 1], 1);
+}
+
+inline void TreeCounters::countRotation(Rotation kind)
+{
+    add(rotations_[kind], 1);
+}
+
+inline void TreeCounters::countNodeSwap()
+{
+    add(nodeSwaps_, 1);
+}
+
+inline void TreeCounters::countAllocation()
+{
+    add(allocations_, 1);
+}
+
+inline void TreeCounters::countDeallocation()
+{
+    add(deallocations_, 1);
+}
+
+/**
+ * The counters are read one at a time, so a snapshot taken while the tree
+ * is being changed may be off by the operations in flight.
+ */
+inline TreeStats TreeCounters::snapshot() const
+{
+    TreeStats stats;
+    stats.searches = searches_.load(std::memory_order_relaxed);
+    stats.comparisons = comparisons_.load(std::memory_order_relaxed);
+    stats.rotationsLL = rotations_[LL].load(std::memory_order_relaxed);
+    stats.rotationsLR = rotations_[LR].load(std::memory_order_relaxed);
+    stats.rotationsRR = rotations_[RR].load(std::memory_order_relaxed);
+    stats.rotationsRL = rotations_[RL].load(std::memory_order_relaxed);
+    stats.nodeSwaps = nodeSwaps_.load(std::memory_order_relaxed);
+    stats.allocations = allocations_.load(std::memory_order_relaxed);
+    stats.deallocations = deallocations_.load(std::memory_order_relaxed);
+    for(size_t d = 0; d < TreeStats::DEPTH_BUCKETS; ++d) {
+        stats.searchDepth[d] = searchDepth_[d].load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+inline void TreeCounters::reset()
+{
+    searches_.store(0, std::memory_order_relaxed);
+    comparisons_.store(0, std::memory_order_relaxed);
+    for(size_t r = 0; r < 4; ++r) {
+        rotations_[r].store(0, std::memory_order_relaxed);
+    }
+    nodeSwaps_.store(0, std::memory_order_relaxed);
+    allocations_.store(0, std::memory_order_relaxed);
+    deallocations_.store(0, std::memory_order_relaxed);
+    for(size_t d = 0; d < TreeStats::DEPTH_BUCKETS; ++d) {
+        searchDepth_[d].store(0, std::memory_order_relaxed);
+    }
+}
+
+#else
+
+inline void TreeCounters::countSearch(size_t, size_t) { }
+inline void TreeCounters::countRotation(Rotation) { }
+inline void TreeCounters::countNodeSwap() { }
+inline void TreeCounters::countAllocation() { }
+inline void TreeCounters::countDeallocation() { }
+inline TreeStats TreeCounters::snapshot() const { return TreeStats(); }
+inline void TreeCounters::reset() { }
+
+#endif
+
+#endif